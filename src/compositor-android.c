@@ -150,7 +150,6 @@ android_output_repaint(struct weston_output *base, pixman_region32_t *damage)
 {
 	struct android_output *output = to_android_output(base);
 	struct android_compositor *compositor = output->compositor;
-	struct weston_surface *surface;
 	struct wl_event_loop *loop;
 	EGLBoolean ret;
 	static int errored;
@@ -158,10 +157,7 @@ android_output_repaint(struct weston_output *base, pixman_region32_t *damage)
 	if (android_output_make_current(output) < 0)
 		return;
 
-	wl_list_for_each_reverse(surface, &compositor->base.surface_list, link)
-		weston_surface_draw(surface, &output->base, damage);
-
-	wl_signal_emit(&output->base.frame_signal, output);
+	compositor->base.renderer->repaint_output(&output->base, damage);
 
 	ret = eglSwapBuffers(compositor->base.egl_display, output->egl_surface);
 	if (ret == EGL_FALSE && !errored) {
@@ -181,6 +177,8 @@ android_output_destroy(struct weston_output *base)
 	struct android_output *output = to_android_output(base);
 
 	wl_list_remove(&output->base.link);
+	if (output->base.renderer_state)
+		gles2_renderer_output_destroy(&output->base);
 	weston_output_destroy(&output->base);
 
 	android_framebuffer_destroy(output->fb);
@@ -536,7 +534,11 @@ android_compositor_create(struct wl_display *display, int argc, char *argv[],
 	if (android_init_egl(compositor, output) < 0)
 		goto err_output;
 
-	if (weston_compositor_init_gl(&compositor->base) < 0)
+	if (gles2_renderer_init(&compositor->base) < 0)
+		goto err_egl;
+
+	if (gles2_renderer_output_create(&output->base,
+					 output->egl_surface) < 0)
 		goto err_egl;
 
 	android_compositor_add_output(compositor, output);
@@ -44,10 +44,39 @@
 #include "launcher-util.h"
 
 static int option_current_mode = 0;
+static int option_no_atomic = 0;
 static char *output_name;
 static char *output_mode;
 static struct wl_list configured_output_list;
 
+#define DRM_PLANE_FAILURES		32
+#define DRM_PLANE_FAILURE_RETRY		5000	/* ms */
+#define DRM_MAX_OVERLAY_CANDIDATES	8
+#define DRM_CURSOR_BOS			4
+
+/*
+ * A sprite configuration the kernel refused.  It is not tried again
+ * for DRM_PLANE_FAILURE_RETRY ms, other sprites and configurations
+ * still are.  Size, scaling and the transform are part of the key,
+ * they are what usually exceeds the hardware limits.
+ */
+struct drm_plane_failure {
+	uint32_t plane_id;
+	uint32_t format;
+	uint32_t src_w, src_h;
+	uint32_t dest_w, dest_h;
+	uint32_t transform;
+	uint32_t msecs;
+};
+
+/* Identifies the transforms drm_surface_transform_supported() lets
+ * through, which only differ in the direction of the axes. */
+enum drm_sprite_transform {
+	DRM_SPRITE_TRANSFORM_ENABLED = 1 << 0,
+	DRM_SPRITE_TRANSFORM_FLIP_X = 1 << 1,
+	DRM_SPRITE_TRANSFORM_FLIP_Y = 1 << 2,
+};
+
 enum output_config {
 	OUTPUT_CONFIG_INVALID = 0,
 	OUTPUT_CONFIG_OFF,
@@ -90,7 +119,13 @@ struct drm_compositor {
 	EGLSurface dummy_egl_surface;
 
 	struct wl_list sprite_list;
-	int sprites_are_broken;
+	int atomic_modeset;
+	int32_t cursor_width, cursor_height;
+
+	struct drm_plane_failure plane_failures[DRM_PLANE_FAILURES];
+	int next_plane_failure;
+
+	struct wl_list buffer_fb_list;
 
 	uint32_t prev_state;
 };
@@ -100,13 +135,80 @@ struct drm_mode {
 	drmModeModeInfo mode_info;
 };
 
+/* Values of the "type" property of universal planes. */
+enum drm_plane_type {
+	DRM_PLANE_OVERLAY = 0,
+	DRM_PLANE_PRIMARY = 1,
+	DRM_PLANE_CURSOR = 2
+};
+
+enum drm_plane_prop {
+	PLANE_PROP_FB_ID,
+	PLANE_PROP_CRTC_ID,
+	PLANE_PROP_SRC_X,
+	PLANE_PROP_SRC_Y,
+	PLANE_PROP_SRC_W,
+	PLANE_PROP_SRC_H,
+	PLANE_PROP_CRTC_X,
+	PLANE_PROP_CRTC_Y,
+	PLANE_PROP_CRTC_W,
+	PLANE_PROP_CRTC_H,
+	PLANE_PROP_COUNT
+};
+
+enum drm_crtc_prop {
+	CRTC_PROP_ACTIVE,
+	CRTC_PROP_MODE_ID,
+	CRTC_PROP_COUNT
+};
+
+/* Property ids of a plane, looked up once when atomic modesetting is
+ * in use. */
+struct drm_plane_props {
+	uint32_t id;
+	uint32_t props[PLANE_PROP_COUNT];
+};
+
 struct drm_output;
 
+/*
+ * One of the cursor bos of an output.  They hold the last few cursor
+ * images, found again by hash, so that animated cursors cycling
+ * through a few images don't upload them over and over.
+ */
+struct drm_cursor_bo {
+	struct gbm_bo *bo;
+	uint32_t fb_id;		/* atomic modesetting only */
+	uint64_t hash;		/* of the image in bo, 0 if none */
+	uint32_t last_used;
+};
+
+/*
+ * A client buffer imported into gbm and added as a KMS framebuffer.  It
+ * lives as long as the wl_buffer, so that clients cycling through the
+ * same two or three buffers don't pay for the import and the addfb on
+ * every frame.  Scanout and sprites hold a reference while the
+ * framebuffer may be on screen.  A failed import or addfb is kept as
+ * well, as bo or fb_id of 0.
+ */
+struct drm_buffer_fb {
+	struct wl_list link;
+	struct drm_compositor *compositor;
+	int refcount;
+	struct gbm_bo *bo;
+	uint32_t fb_id;
+	uint32_t format;
+	uint32_t opaque_fb_id;	/* XRGB8888 view of ARGB8888 buffers */
+	struct wl_listener buffer_destroy_listener;
+};
+
 struct drm_fb {
 	struct gbm_bo *bo;
 	struct drm_output *output;
 	uint32_t fb_id;
+	uint32_t x, y;		/* scanout offset into the buffer */
 	int is_client_buffer;
+	struct drm_buffer_fb *buffer_fb;
 	struct wl_buffer *buffer;
 	struct wl_listener buffer_destroy_listener;
 };
@@ -123,14 +225,24 @@ struct drm_output {
 	int page_flip_pending;
 
 	struct gbm_surface *surface;
-	struct gbm_bo *cursor_bo[2];
+	struct drm_cursor_bo cursor_bos[DRM_CURSOR_BOS];
+	uint32_t *cursor_buf;
+	int32_t cursor_width, cursor_height;
+	uint32_t cursor_uses;
 	struct weston_plane cursor_plane;
 	struct weston_plane fb_plane;
 	struct weston_surface *cursor_surface;
-	int current_cursor;
+	int current_cursor;	/* -1 while no cursor is set */
 	EGLSurface egl_surface;
 	struct drm_fb *current, *next;
 	struct backlight *backlight;
+
+	/* Atomic modesetting state, unused with the legacy ioctls. */
+	struct drm_plane_props primary;
+	struct drm_plane_props cursor;
+	uint32_t crtc_props[CRTC_PROP_COUNT];
+	uint32_t connector_prop_crtc_id;
+	uint32_t mode_blob_id;
 };
 
 /*
@@ -140,8 +252,8 @@ struct drm_output {
 struct drm_sprite {
 	struct wl_list link;
 
-	uint32_t fb_id;
-	uint32_t pending_fb_id;
+	struct drm_buffer_fb *fb;
+	struct drm_buffer_fb *pending_fb;
 	struct weston_surface *surface;
 	struct weston_surface *pending_surface;
 	struct weston_plane plane;
@@ -161,6 +273,9 @@ struct drm_sprite {
 	uint32_t src_w, src_h;
 	uint32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
+	uint32_t transform;
+
+	struct drm_plane_props props;
 
 	uint32_t formats[];
 };
@@ -197,6 +312,48 @@ drm_sprite_crtc_supported(struct weston_output *output_base, uint32_t supported)
 	return 0;
 }
 
+static int
+drm_plane_failed(struct drm_compositor *c, uint32_t plane_id,
+		 uint32_t format, uint32_t src_w, uint32_t src_h,
+		 uint32_t dest_w, uint32_t dest_h, uint32_t transform)
+{
+	struct drm_plane_failure *f;
+	uint32_t now = weston_compositor_get_time();
+	int i;
+
+	for (i = 0; i < DRM_PLANE_FAILURES; i++) {
+		f = &c->plane_failures[i];
+		if (f->plane_id == plane_id && f->format == format &&
+		    f->src_w == src_w && f->src_h == src_h &&
+		    f->dest_w == dest_w && f->dest_h == dest_h &&
+		    f->transform == transform &&
+		    now - f->msecs < DRM_PLANE_FAILURE_RETRY)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+drm_sprite_record_failure(struct drm_sprite *s)
+{
+	struct drm_compositor *c = s->compositor;
+	struct drm_plane_failure *f;
+
+	f = &c->plane_failures[c->next_plane_failure];
+	c->next_plane_failure =
+		(c->next_plane_failure + 1) % DRM_PLANE_FAILURES;
+
+	f->plane_id = s->plane_id;
+	f->format = s->pending_fb->format;
+	f->src_w = s->src_w;
+	f->src_h = s->src_h;
+	f->dest_w = s->dest_w;
+	f->dest_h = s->dest_h;
+	f->transform = s->transform;
+	f->msecs = weston_compositor_get_time();
+}
+
 static void
 drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 {
@@ -206,11 +363,6 @@ drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 	if (fb->fb_id)
 		drmModeRmFB(gbm_device_get_fd(gbm), fb->fb_id);
 
-	if (fb->buffer) {
-		weston_buffer_post_release(fb->buffer);
-		wl_list_remove(&fb->buffer_destroy_listener.link);
-	}
-
 	free(data);
 }
 
@@ -230,7 +382,10 @@ drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_output *output)
 
 	fb->bo = bo;
 	fb->output = output;
+	fb->x = 0;
+	fb->y = 0;
 	fb->is_client_buffer = 0;
+	fb->buffer_fb = NULL;
 	fb->buffer = NULL;
 
 	width = gbm_bo_get_width(bo);
@@ -251,6 +406,136 @@ drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_output *output)
 	return fb;
 }
 
+static struct drm_buffer_fb *
+drm_buffer_fb_ref(struct drm_buffer_fb *bfb)
+{
+	bfb->refcount++;
+
+	return bfb;
+}
+
+static void
+drm_buffer_fb_unref(struct drm_buffer_fb *bfb)
+{
+	if (--bfb->refcount > 0)
+		return;
+
+	if (bfb->fb_id)
+		drmModeRmFB(bfb->compositor->drm.fd, bfb->fb_id);
+	if (bfb->opaque_fb_id)
+		drmModeRmFB(bfb->compositor->drm.fd, bfb->opaque_fb_id);
+	if (bfb->bo)
+		gbm_bo_destroy(bfb->bo);
+	wl_list_remove(&bfb->link);
+	free(bfb);
+}
+
+static void
+buffer_fb_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct drm_buffer_fb *bfb =
+		container_of(listener, struct drm_buffer_fb,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&bfb->buffer_destroy_listener.link);
+	wl_list_init(&bfb->buffer_destroy_listener.link);
+	drm_buffer_fb_unref(bfb);
+}
+
+static struct drm_buffer_fb *
+drm_buffer_fb_get(struct drm_compositor *c, struct wl_buffer *buffer)
+{
+	struct drm_buffer_fb *bfb;
+	struct wl_listener *listener;
+	uint32_t handles[4], pitches[4], offsets[4];
+	int ret;
+
+	listener = wl_signal_get(&buffer->resource.destroy_signal,
+				 buffer_fb_handle_buffer_destroy);
+	if (listener) {
+		bfb = container_of(listener, struct drm_buffer_fb,
+				   buffer_destroy_listener);
+		return bfb->fb_id ? bfb : NULL;
+	}
+
+	bfb = malloc(sizeof *bfb);
+	if (bfb == NULL)
+		return NULL;
+
+	memset(bfb, 0, sizeof *bfb);
+	bfb->compositor = c;
+	bfb->refcount = 1;
+	bfb->buffer_destroy_listener.notify = buffer_fb_handle_buffer_destroy;
+	wl_signal_add(&buffer->resource.destroy_signal,
+		      &bfb->buffer_destroy_listener);
+	wl_list_insert(&c->buffer_fb_list, &bfb->link);
+
+	bfb->bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
+				buffer, GBM_BO_USE_SCANOUT);
+	if (!bfb->bo)
+		return NULL;
+
+	bfb->format = gbm_bo_get_format(bfb->bo);
+	handles[0] = gbm_bo_get_handle(bfb->bo).u32;
+	pitches[0] = gbm_bo_get_stride(bfb->bo);
+	offsets[0] = 0;
+	if (!handles[0])
+		return NULL;
+
+	ret = drmModeAddFB2(c->drm.fd, gbm_bo_get_width(bfb->bo),
+			    gbm_bo_get_height(bfb->bo), bfb->format,
+			    handles, pitches, offsets, &bfb->fb_id, 0);
+	if (ret) {
+		weston_log("addfb2 failed: %d\n", ret);
+		bfb->fb_id = 0;
+		return NULL;
+	}
+
+	return bfb;
+}
+
+/* Primary planes don't always take formats with alpha, an opaque
+ * ARGB8888 buffer is scanned out through an XRGB8888 framebuffer. */
+static uint32_t
+drm_buffer_fb_get_opaque(struct drm_buffer_fb *bfb)
+{
+	struct drm_compositor *c = bfb->compositor;
+	uint32_t handles[4], pitches[4], offsets[4];
+
+	if (bfb->format == GBM_FORMAT_XRGB8888)
+		return bfb->fb_id;
+	if (bfb->format != GBM_FORMAT_ARGB8888)
+		return 0;
+	if (bfb->opaque_fb_id)
+		return bfb->opaque_fb_id;
+
+	handles[0] = gbm_bo_get_handle(bfb->bo).u32;
+	pitches[0] = gbm_bo_get_stride(bfb->bo);
+	offsets[0] = 0;
+	if (drmModeAddFB2(c->drm.fd, gbm_bo_get_width(bfb->bo),
+			  gbm_bo_get_height(bfb->bo), GBM_FORMAT_XRGB8888,
+			  handles, pitches, offsets, &bfb->opaque_fb_id, 0)) {
+		weston_log("addfb2 failed: %m\n");
+		bfb->opaque_fb_id = 0;
+	}
+
+	return bfb->opaque_fb_id;
+}
+
+static void
+drm_destroy_buffer_fbs(struct drm_compositor *c)
+{
+	struct drm_buffer_fb *bfb, *next;
+
+	/* Drop the references held by the wl_buffers, the buffers may
+	 * outlive the gbm device. */
+	wl_list_for_each_safe(bfb, next, &c->buffer_fb_list, link) {
+		wl_list_remove(&bfb->buffer_destroy_listener.link);
+		wl_list_init(&bfb->buffer_destroy_listener.link);
+		drm_buffer_fb_unref(bfb);
+	}
+}
+
 static void
 fb_handle_buffer_destroy(struct wl_listener *listener, void *data)
 {
@@ -264,6 +549,51 @@ fb_handle_buffer_destroy(struct wl_listener *listener, void *data)
 		weston_output_schedule_repaint(&fb->output->base);
 }
 
+static struct drm_fb *
+drm_fb_get_from_buffer(struct drm_buffer_fb *bfb, struct wl_buffer *buffer,
+		       struct drm_output *output)
+{
+	struct drm_fb *fb;
+
+	fb = malloc(sizeof *fb);
+	if (fb == NULL)
+		return NULL;
+
+	fb->bo = bfb->bo;
+	fb->output = output;
+	fb->fb_id = bfb->fb_id;
+	fb->x = 0;
+	fb->y = 0;
+	fb->is_client_buffer = 1;
+	fb->buffer_fb = drm_buffer_fb_ref(bfb);
+	fb->buffer = buffer;
+	fb->buffer->busy_count++;
+	fb->buffer_destroy_listener.notify = fb_handle_buffer_destroy;
+
+	wl_signal_add(&fb->buffer->resource.destroy_signal,
+		      &fb->buffer_destroy_listener);
+
+	return fb;
+}
+
+static void
+drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
+{
+	if (!fb)
+		return;
+
+	if (fb->is_client_buffer) {
+		if (fb->buffer) {
+			weston_buffer_post_release(fb->buffer);
+			wl_list_remove(&fb->buffer_destroy_listener.link);
+		}
+		drm_buffer_fb_unref(fb->buffer_fb);
+		free(fb);
+	} else {
+		gbm_surface_release_buffer(output->surface, fb->bo);
+	}
+}
+
 static struct weston_plane *
 drm_output_prepare_scanout_surface(struct weston_output *_output,
 				   struct weston_surface *es)
@@ -271,50 +601,529 @@ drm_output_prepare_scanout_surface(struct weston_output *_output,
 	struct drm_output *output = (struct drm_output *) _output;
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
-	struct gbm_bo *bo;
+	struct drm_buffer_fb *bfb;
+	pixman_region32_t uncovered;
+	int32_t x, y;
+	uint32_t fb_id;
+	int opaque;
+
+	if (es->transform.enabled || es->buffer == NULL || es->alpha != 1.0)
+		return NULL;
+
+	/* A buffer scanned out here isn't drawn on the other outputs. */
+	if (es->output_mask != (1u << output->base.id))
+		return NULL;
+
+	/* The surface has to cover the output, at a whole pixel offset.
+	 * Legacy page flips can't offset into the buffer. */
+	x = output->base.x - es->geometry.x;
+	y = output->base.y - es->geometry.y;
+	if (x != output->base.x - es->geometry.x ||
+	    y != output->base.y - es->geometry.y ||
+	    x < 0 || y < 0 ||
+	    es->geometry.width - x < output->base.current->width ||
+	    es->geometry.height - y < output->base.current->height ||
+	    ((x || y) && !c->atomic_modeset))
+		return NULL;
+
+	bfb = drm_buffer_fb_get(c, es->buffer);
+	if (!bfb)
+		return NULL;
+
+	/* XRGB8888 buffers, or ARGB8888 ones whose opaque region covers
+	 * the output. */
+	pixman_region32_init(&uncovered);
+	pixman_region32_subtract(&uncovered, &output->base.region,
+				 &es->transform.opaque);
+	opaque = !pixman_region32_not_empty(&uncovered);
+	pixman_region32_fini(&uncovered);
+
+	if (bfb->format == GBM_FORMAT_XRGB8888)
+		fb_id = bfb->fb_id;
+	else if (opaque)
+		fb_id = drm_buffer_fb_get_opaque(bfb);
+	else
+		fb_id = 0;
+	if (!fb_id)
+		return NULL;
+
+	output->next = drm_fb_get_from_buffer(bfb, es->buffer, output);
+	if (!output->next)
+		return NULL;
+
+	output->next->fb_id = fb_id;
+	output->next->x = x;
+	output->next->y = y;
+
+	return &output->fb_plane;
+}
+
+static uint64_t
+hash_cursor(struct weston_surface *es)
+{
+	int32_t width = es->geometry.width, height = es->geometry.height;
+	int32_t stride = wl_shm_buffer_get_stride(es->buffer);
+	unsigned char *data = wl_shm_buffer_get_data(es->buffer);
+	uint64_t hash = 14695981039346656037ull;
+	uint32_t *row;
+	int32_t x, y;
+
+	hash = (hash ^ width) * 1099511628211ull;
+	hash = (hash ^ height) * 1099511628211ull;
+	hash = (hash ^ wl_shm_buffer_get_format(es->buffer)) * 1099511628211ull;
+	for (y = 0; y < height; y++) {
+		row = (uint32_t *) (data + y * stride);
+		for (x = 0; x < width; x++)
+			hash = (hash ^ row[x]) * 1099511628211ull;
+	}
+
+	return hash | 1;
+}
+
+/*
+ * Makes current_cursor a bo holding the image of es, uploading it
+ * only if none of the cursor bos has it already.  Never writes to the
+ * bo on screen.  Returns 1 if current_cursor changed.
+ */
+static int
+drm_output_update_cursor_bo(struct drm_output *output,
+			    struct weston_surface *es)
+{
+	struct drm_cursor_bo *cursor;
+	int32_t width = output->cursor_width;
+	int32_t height = output->cursor_height;
+	uint32_t *buf = output->cursor_buf;
+	unsigned char *s;
+	int i, x, stride, opaque, victim = -1;
+	uint64_t hash;
+
+	pixman_region32_fini(&output->cursor_plane.damage);
+	pixman_region32_init(&output->cursor_plane.damage);
+
+	hash = hash_cursor(es);
+	for (i = 0; i < DRM_CURSOR_BOS; i++) {
+		cursor = &output->cursor_bos[i];
+		if (!cursor->bo)
+			continue;
+		if (cursor->hash == hash)
+			break;
+		if (i != output->current_cursor &&
+		    (victim < 0 ||
+		     cursor->last_used <
+		     output->cursor_bos[victim].last_used))
+			victim = i;
+	}
+
+	if (i == DRM_CURSOR_BOS) {
+		i = victim >= 0 ? victim : output->current_cursor;
+		cursor = &output->cursor_bos[i];
+
+		/* The cursor bos are ARGB, the undefined alpha of XRGB
+		 * buffers is made opaque. */
+		opaque = wl_shm_buffer_get_format(es->buffer) ==
+			WL_SHM_FORMAT_XRGB8888;
+		stride = wl_shm_buffer_get_stride(es->buffer);
+		s = wl_shm_buffer_get_data(es->buffer);
+		for (i = 0; i < es->geometry.height; i++) {
+			memcpy(buf + i * width, s + i * stride,
+			       es->geometry.width * 4);
+			if (opaque)
+				for (x = 0; x < es->geometry.width; x++)
+					buf[i * width + x] |= 0xff000000;
+			memset(buf + i * width + es->geometry.width, 0,
+			       (width - es->geometry.width) * 4);
+		}
+		memset(buf + i * width, 0, (height - i) * width * 4);
+
+		/* Keep showing the previous image rather than a
+		 * partially written one. */
+		if (gbm_bo_write(cursor->bo, buf, width * height * 4) < 0) {
+			weston_log("failed update cursor: %m\n");
+			cursor->hash = 0;
+			return 0;
+		}
+		cursor->hash = hash;
+		i = cursor - output->cursor_bos;
+	}
+
+	output->cursor_bos[i].last_used = ++output->cursor_uses;
+	if (i == output->current_cursor)
+		return 0;
+
+	output->current_cursor = i;
+
+	return 1;
+}
+
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+static const char *const plane_prop_names[] = {
+	[PLANE_PROP_FB_ID] = "FB_ID",
+	[PLANE_PROP_CRTC_ID] = "CRTC_ID",
+	[PLANE_PROP_SRC_X] = "SRC_X",
+	[PLANE_PROP_SRC_Y] = "SRC_Y",
+	[PLANE_PROP_SRC_W] = "SRC_W",
+	[PLANE_PROP_SRC_H] = "SRC_H",
+	[PLANE_PROP_CRTC_X] = "CRTC_X",
+	[PLANE_PROP_CRTC_Y] = "CRTC_Y",
+	[PLANE_PROP_CRTC_W] = "CRTC_W",
+	[PLANE_PROP_CRTC_H] = "CRTC_H",
+};
+
+static const char *const crtc_prop_names[] = {
+	[CRTC_PROP_ACTIVE] = "ACTIVE",
+	[CRTC_PROP_MODE_ID] = "MODE_ID",
+};
+
+/* Looks up the ids of the named properties of a KMS object, ids of
+ * properties the object doesn't have are left 0.  With a non-NULL
+ * value, the current value of the first property is stored there. */
+static int
+drm_get_prop_ids(int fd, uint32_t object_id, uint32_t object_type,
+		 const char *const *names, uint32_t *ids, int count,
+		 uint64_t *value)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j;
+
+	memset(ids, 0, count * sizeof *ids);
+	props = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (strcmp(prop->name, names[j]) != 0)
+				continue;
+			ids[j] = prop->prop_id;
+			if (j == 0 && value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return 0;
+}
+
+static int
+drm_plane_get_type(int fd, uint32_t plane_id)
+{
+	static const char *const names[] = { "type" };
+	uint32_t id;
+	uint64_t type;
+
+	if (drm_get_prop_ids(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+			     names, &id, 1, &type) < 0 || !id)
+		return -1;
+
+	return type;
+}
+
+static int
+drm_plane_props_init(struct drm_plane_props *plane, int fd,
+		     uint32_t plane_id)
+{
+	int i;
+
+	plane->id = plane_id;
+	drm_get_prop_ids(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+			 plane_prop_names, plane->props, PLANE_PROP_COUNT,
+			 NULL);
+
+	for (i = 0; i < PLANE_PROP_COUNT; i++)
+		if (!plane->props[i])
+			return -1;
+
+	return 0;
+}
+
+static int
+drm_add_prop(drmModeAtomicReq *req, uint32_t object_id,
+	     uint32_t prop_id, uint64_t value)
+{
+	if (drmModeAtomicAddProperty(req, object_id, prop_id, value) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+drm_plane_set(drmModeAtomicReq *req, struct drm_plane_props *plane,
+	      uint32_t crtc_id, uint32_t fb_id,
+	      int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+	      uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	uint64_t values[PLANE_PROP_COUNT] = {
+		[PLANE_PROP_FB_ID] = fb_id,
+		[PLANE_PROP_CRTC_ID] = crtc_id,
+		[PLANE_PROP_SRC_X] = src_x,
+		[PLANE_PROP_SRC_Y] = src_y,
+		[PLANE_PROP_SRC_W] = src_w,
+		[PLANE_PROP_SRC_H] = src_h,
+		[PLANE_PROP_CRTC_X] = crtc_x,
+		[PLANE_PROP_CRTC_Y] = crtc_y,
+		[PLANE_PROP_CRTC_W] = crtc_w,
+		[PLANE_PROP_CRTC_H] = crtc_h,
+	};
+	int i, ret = 0;
+
+	for (i = 0; i < PLANE_PROP_COUNT; i++)
+		ret |= drm_add_prop(req, plane->id, plane->props[i],
+				    values[i]);
+
+	return ret;
+}
+
+static int
+drm_plane_disable(drmModeAtomicReq *req, struct drm_plane_props *plane)
+{
+	int ret = 0;
+
+	ret |= drm_add_prop(req, plane->id,
+			    plane->props[PLANE_PROP_FB_ID], 0);
+	ret |= drm_add_prop(req, plane->id,
+			    plane->props[PLANE_PROP_CRTC_ID], 0);
+
+	return ret;
+}
+
+/*
+ * Adds the plane state of an output to an atomic request: the primary
+ * plane showing fb, the cursor and the sprites last assigned to the
+ * output.
+ */
+static int
+drm_output_populate_atomic(struct drm_output *output, drmModeAtomicReq *req,
+			   struct drm_fb *fb)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct weston_surface *es = output->cursor_surface;
+	struct drm_sprite *s;
+	int width = output->base.current->width;
+	int height = output->base.current->height;
+	int i, ret = 0;
+
+	ret |= drm_plane_set(req, &output->primary, output->crtc_id,
+			     fb->fb_id, 0, 0, width, height,
+			     fb->x << 16, fb->y << 16,
+			     width << 16, height << 16);
+
+	/* Test commits may come before the first cursor image. */
+	i = output->current_cursor < 0 ? 0 : output->current_cursor;
+	if (output->cursor.id && es)
+		ret |= drm_plane_set(req, &output->cursor, output->crtc_id,
+				     output->cursor_bos[i].fb_id,
+				     es->geometry.x - output->base.x,
+				     es->geometry.y - output->base.y,
+				     output->cursor_width,
+				     output->cursor_height, 0, 0,
+				     output->cursor_width << 16,
+				     output->cursor_height << 16);
+	else if (output->cursor.id)
+		ret |= drm_plane_disable(req, &output->cursor);
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		if (s->pending_fb)
+			ret |= drm_plane_set(req, &s->props, output->crtc_id,
+					     s->pending_fb->fb_id,
+					     s->dest_x, s->dest_y,
+					     s->dest_w, s->dest_h,
+					     s->src_x, s->src_y,
+					     s->src_w, s->src_h);
+		else if (s->fb)
+			ret |= drm_plane_disable(req, &s->props);
+	}
+
+	return ret;
+}
+
+/*
+ * Checks with the kernel whether the planes assigned so far can be
+ * shown together.  Until the renderer has drawn the next frame, the
+ * primary plane is tested with the frame on screen.
+ */
+static int
+drm_output_test_atomic(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_fb *fb = output->next ? output->next : output->current;
+	drmModeAtomicReq *req;
+	int ret;
+
+	if (!fb)
+		return -1;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_populate_atomic(output, req, fb);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/*
+ * Commits the primary plane, sprites and cursor of an output in one
+ * non-blocking commit, completion is reported to page_flip_handler.
+ */
+static int
+drm_output_repaint_atomic(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct weston_surface *es = output->cursor_surface;
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	struct drm_mode *mode;
+	drmModeAtomicReq *req;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	if (!output->current) {
+		mode = container_of(output->base.current,
+				    struct drm_mode, base);
+		if (output->mode_blob_id)
+			drmModeDestroyPropertyBlob(c->drm.fd,
+						   output->mode_blob_id);
+		output->mode_blob_id = 0;
+		if (drmModeCreatePropertyBlob(c->drm.fd, &mode->mode_info,
+					      sizeof mode->mode_info,
+					      &output->mode_blob_id)) {
+			weston_log("failed to create mode blob: %m\n");
+			drmModeAtomicFree(req);
+			return -1;
+		}
+
+		ret |= drm_add_prop(req, output->connector_id,
+				    output->connector_prop_crtc_id,
+				    output->crtc_id);
+		ret |= drm_add_prop(req, output->crtc_id,
+				    output->crtc_props[CRTC_PROP_MODE_ID],
+				    output->mode_blob_id);
+		ret |= drm_add_prop(req, output->crtc_id,
+				    output->crtc_props[CRTC_PROP_ACTIVE], 1);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	if (es && es->buffer &&
+	    (pixman_region32_not_empty(&output->cursor_plane.damage) ||
+	     output->current_cursor < 0))
+		drm_output_update_cursor_bo(output, es);
+
+	ret |= drm_output_populate_atomic(output, req, output->next);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req, flags, output);
+	drmModeAtomicFree(req);
+
+	if (ret) {
+		weston_log("atomic commit failed: %m\n");
+	} else if (es) {
+		output->cursor_plane.x = es->geometry.x - output->base.x;
+		output->cursor_plane.y = es->geometry.y - output->base.y;
+	}
+	output->cursor_surface = NULL;
+
+	return ret;
+}
+
+/* Finds the primary and cursor planes of the crtc at index pipe and
+ * the properties needed to drive the output with atomic commits. */
+static int
+drm_output_init_atomic(struct drm_compositor *c, struct drm_output *output,
+		       int pipe)
+{
+	static const char *const connector_prop_names[] = { "CRTC_ID" };
+	drmModePlaneRes *plane_res;
+	drmModePlane *plane;
+	uint32_t i;
+	int type;
+
+	drm_get_prop_ids(c->drm.fd, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+			 crtc_prop_names, output->crtc_props,
+			 CRTC_PROP_COUNT, NULL);
+	drm_get_prop_ids(c->drm.fd, output->connector_id,
+			 DRM_MODE_OBJECT_CONNECTOR, connector_prop_names,
+			 &output->connector_prop_crtc_id, 1, NULL);
+	if (!output->crtc_props[CRTC_PROP_ACTIVE] ||
+	    !output->crtc_props[CRTC_PROP_MODE_ID] ||
+	    !output->connector_prop_crtc_id)
+		return -1;
+
+	plane_res = drmModeGetPlaneResources(c->drm.fd);
+	if (!plane_res)
+		return -1;
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		plane = drmModeGetPlane(c->drm.fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
 
-	if (es->geometry.x != output->base.x ||
-	    es->geometry.y != output->base.y ||
-	    es->geometry.width != output->base.current->width ||
-	    es->geometry.height != output->base.current->height ||
-	    es->transform.enabled ||
-	    es->buffer == NULL)
-		return NULL;
+		type = -1;
+		if (plane->possible_crtcs & (1 << pipe))
+			type = drm_plane_get_type(c->drm.fd, plane->plane_id);
 
-	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   es->buffer, GBM_BO_USE_SCANOUT);
+		if (type == DRM_PLANE_PRIMARY && !output->primary.id)
+			drm_plane_props_init(&output->primary, c->drm.fd,
+					     plane->plane_id);
+		else if (type == DRM_PLANE_CURSOR && !output->cursor.id &&
+			 drm_plane_props_init(&output->cursor, c->drm.fd,
+					      plane->plane_id) < 0)
+			output->cursor.id = 0;
 
-	/* Need to verify output->region contained in surface opaque
-	 * region.  Or maybe just that format doesn't have alpha.
-	 * For now, scanout only if format is XRGB8888. */
-	if (gbm_bo_get_format(bo) != GBM_FORMAT_XRGB8888) {
-		gbm_bo_destroy(bo);
-		return NULL;
+		drmModeFreePlane(plane);
 	}
 
-	output->next = drm_fb_get_from_bo(bo, output);
-	if (!output->next) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
+	drmModeFreePlaneResources(plane_res);
 
-	output->next->is_client_buffer = 1;
-	output->next->buffer = es->buffer;
-	output->next->buffer->busy_count++;
-	output->next->buffer_destroy_listener.notify = fb_handle_buffer_destroy;
+	for (i = 0; i < PLANE_PROP_COUNT; i++)
+		if (!output->primary.props[i])
+			return -1;
 
-	wl_signal_add(&output->next->buffer->resource.destroy_signal,
-		      &output->next->buffer_destroy_listener);
+	return 0;
+}
 
-	return &output->fb_plane;
+static void
+drm_compositor_init_atomic(struct drm_compositor *c)
+{
+	if (option_no_atomic)
+		return;
+
+	if (drmSetClientCap(c->drm.fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	    drmSetClientCap(c->drm.fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		drmSetClientCap(c->drm.fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+		weston_log("atomic modesetting not supported, "
+			   "using legacy page flips\n");
+		return;
+	}
+
+	c->atomic_modeset = 1;
+	weston_log("using atomic modesetting\n");
 }
+#endif
 
 static void
 drm_output_render(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct drm_compositor *compositor =
 		(struct drm_compositor *) output->base.compositor;
-	struct weston_surface *surface;
 	struct gbm_bo *bo;
 
 	if (!eglMakeCurrent(compositor->base.egl_display, output->egl_surface,
@@ -324,11 +1133,7 @@ drm_output_render(struct drm_output *output, pixman_region32_t *damage)
 		return;
 	}
 
-	wl_list_for_each_reverse(surface, &compositor->base.surface_list, link)
-		if (surface->plane == &compositor->base.primary_plane)
-			weston_surface_draw(surface, &output->base, damage);
-
-	wl_signal_emit(&output->base.frame_signal, output);
+	compositor->base.renderer->repaint_output(&output->base, damage);
 
 	eglSwapBuffers(compositor->base.egl_display, output->egl_surface);
 	bo = gbm_surface_lock_front_buffer(output->surface);
@@ -361,6 +1166,14 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!output->next)
 		return;
 
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+	if (compositor->atomic_modeset) {
+		if (drm_output_repaint_atomic(output) == 0)
+			output->page_flip_pending = 1;
+		return;
+	}
+#endif
+
 	mode = container_of(output->base.current, struct drm_mode, base);
 	if (!output->current) {
 		ret = drmModeSetCrtc(compositor->drm.fd, output->crtc_id,
@@ -398,14 +1211,19 @@ drm_output_repaint(struct weston_output *output_base,
 			continue;
 
 		ret = drmModeSetPlane(compositor->drm.fd, s->plane_id,
-				      output->crtc_id, s->pending_fb_id, flags,
+				      output->crtc_id,
+				      s->pending_fb ? s->pending_fb->fb_id : 0,
+				      flags,
 				      s->dest_x, s->dest_y,
 				      s->dest_w, s->dest_h,
 				      s->src_x, s->src_y,
 				      s->src_w, s->src_h);
-		if (ret)
+		if (ret) {
 			weston_log("setplane failed: %d: %s\n",
 				ret, strerror(errno));
+			if (s->pending_fb)
+				drm_sprite_record_failure(s);
+		}
 
 		/*
 		 * Queue a vblank signal so we know when the surface
@@ -427,34 +1245,41 @@ drm_output_repaint(struct weston_output *output_base,
 	return;
 }
 
+/* The pending framebuffer of a sprite reached the screen. */
 static void
-vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
-	       void *data)
+drm_sprite_flip(struct drm_sprite *s)
 {
-	struct drm_sprite *s = (struct drm_sprite *)data;
-	struct drm_compositor *c = s->compositor;
-	struct drm_output *output = s->output;
-	uint32_t msecs;
-
-	output->vblank_pending = 0;
-
 	if (s->surface) {
 		weston_buffer_post_release(s->surface->buffer);
 		wl_list_remove(&s->destroy_listener.link);
 		s->surface = NULL;
-		drmModeRmFB(c->drm.fd, s->fb_id);
-		s->fb_id = 0;
 	}
 
+	if (s->fb)
+		drm_buffer_fb_unref(s->fb);
+	s->fb = s->pending_fb;
+	s->pending_fb = NULL;
+
 	if (s->pending_surface) {
 		wl_list_remove(&s->pending_destroy_listener.link);
 		wl_signal_add(&s->pending_surface->buffer->resource.destroy_signal,
 			      &s->destroy_listener);
 		s->surface = s->pending_surface;
 		s->pending_surface = NULL;
-		s->fb_id = s->pending_fb_id;
-		s->pending_fb_id = 0;
 	}
+}
+
+static void
+vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
+	       void *data)
+{
+	struct drm_sprite *s = (struct drm_sprite *)data;
+	struct drm_output *output = s->output;
+	uint32_t msecs;
+
+	output->vblank_pending = 0;
+
+	drm_sprite_flip(s);
 
 	if (!output->page_flip_pending) {
 		msecs = sec * 1000 + usec / 1000;
@@ -467,17 +1292,21 @@ page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = (struct drm_output *) data;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
 	uint32_t msecs;
 
 	output->page_flip_pending = 0;
 
-	if (output->current) {
-		if (output->current->is_client_buffer)
-			gbm_bo_destroy(output->current->bo);
-		else
-			gbm_surface_release_buffer(output->surface,
-						   output->current->bo);
-	}
+	drm_output_release_fb(output, output->current);
+
+	/* Atomic commits flip the sprites together with the primary
+	 * plane. */
+	if (c->atomic_modeset)
+		wl_list_for_each(s, &c->sprite_list, link)
+			if (s->output == output)
+				drm_sprite_flip(s);
 
 	output->current = output->next;
 	output->next = NULL;
@@ -531,6 +1360,24 @@ drm_surface_transform_supported(struct weston_surface *es)
 	return 1;
 }
 
+static uint32_t
+drm_surface_transform(struct weston_surface *es)
+{
+	struct weston_matrix *matrix = &es->transform.matrix;
+	uint32_t transform;
+
+	if (!es->transform.enabled)
+		return 0;
+
+	transform = DRM_SPRITE_TRANSFORM_ENABLED;
+	if (matrix->d[0] < 0.0)
+		transform |= DRM_SPRITE_TRANSFORM_FLIP_X;
+	if (matrix->d[5] < 0.0)
+		transform |= DRM_SPRITE_TRANSFORM_FLIP_Y;
+
+	return transform;
+}
+
 static void
 drm_disable_unused_sprites(struct weston_output *output_base)
 {
@@ -541,7 +1388,7 @@ drm_disable_unused_sprites(struct weston_output *output_base)
 	int ret;
 
 	wl_list_for_each(s, &c->sprite_list, link) {
-		if (s->pending_fb_id)
+		if (s->pending_fb)
 			continue;
 
 		ret = drmModeSetPlane(c->drm.fd, s->plane_id,
@@ -550,7 +1397,6 @@ drm_disable_unused_sprites(struct weston_output *output_base)
 		if (ret)
 			weston_log("failed to disable plane: %d: %s\n",
 				ret, strerror(errno));
-		drmModeRmFB(c->drm.fd, s->fb_id);
 
 		if (s->surface) {
 			s->surface = NULL;
@@ -558,8 +1404,9 @@ drm_disable_unused_sprites(struct weston_output *output_base)
 		}
 
 		assert(!s->pending_surface);
-		s->fb_id = 0;
-		s->pending_fb_id = 0;
+		if (s->fb)
+			drm_buffer_fb_unref(s->fb);
+		s->fb = NULL;
 	}
 }
 
@@ -576,18 +1423,11 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 	struct drm_compositor *c =(struct drm_compositor *) ec;
 	struct drm_sprite *s;
 	int found = 0;
-	EGLint handle, stride;
-	struct gbm_bo *bo;
-	uint32_t fb_id = 0;
-	uint32_t handles[4], pitches[4], offsets[4];
-	int ret = 0;
+	struct drm_buffer_fb *bfb;
 	pixman_region32_t dest_rect, src_rect;
-	pixman_box32_t *box;
-	uint32_t format;
+	pixman_box32_t *box, dest;
 	wl_fixed_t sx1, sy1, sx2, sy2;
-
-	if (c->sprites_are_broken)
-		return NULL;
+	uint32_t src_w, src_h, transform;
 
 	if (es->output_mask != (1u << output_base->id))
 		return NULL;
@@ -597,58 +1437,11 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 
 	if (!drm_surface_transform_supported(es))
 		return NULL;
+	transform = drm_surface_transform(es);
 
-	wl_list_for_each(s, &c->sprite_list, link) {
-		if (!drm_sprite_crtc_supported(output_base, s->possible_crtcs))
-			continue;
-
-		if (!s->pending_fb_id) {
-			found = 1;
-			break;
-		}
-	}
-
-	/* No sprites available */
-	if (!found)
-		return NULL;
-
-	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   es->buffer, GBM_BO_USE_SCANOUT);
-	if (!bo)
-		return NULL;
-
-	format = gbm_bo_get_format(bo);
-	handle = gbm_bo_get_handle(bo).s32;
-	stride = gbm_bo_get_stride(bo);
-
-	gbm_bo_destroy(bo);
-
-	if (!drm_surface_format_supported(s, format))
-		return NULL;
-
-	if (!handle)
-		return NULL;
-
-	handles[0] = handle;
-	pitches[0] = stride;
-	offsets[0] = 0;
-
-	ret = drmModeAddFB2(c->drm.fd, es->geometry.width, es->geometry.height,
-			    format, handles, pitches, offsets,
-			    &fb_id, 0);
-	if (ret) {
-		weston_log("addfb2 failed: %d\n", ret);
-		c->sprites_are_broken = 1;
+	bfb = drm_buffer_fb_get(c, es->buffer);
+	if (!bfb)
 		return NULL;
-	}
-
-	s->pending_fb_id = fb_id;
-	s->pending_surface = es;
-	es->buffer->busy_count++;
-
-	box = pixman_region32_extents(&es->transform.boundingbox);
-	s->plane.x = box->x1;
-	s->plane.y = box->y1;
 
 	/*
 	 * Calculate the source & dest rects properly based on actual
@@ -659,11 +1452,7 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 	pixman_region32_intersect(&dest_rect, &es->transform.boundingbox,
 				  &output_base->region);
 	pixman_region32_translate(&dest_rect, -output_base->x, -output_base->y);
-	box = pixman_region32_extents(&dest_rect);
-	s->dest_x = box->x1;
-	s->dest_y = box->y1;
-	s->dest_w = box->x2 - box->x1;
-	s->dest_h = box->y2 - box->y1;
+	dest = *pixman_region32_extents(&dest_rect);
 	pixman_region32_fini(&dest_rect);
 
 	pixman_region32_init(&src_rect);
@@ -688,12 +1477,50 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 		sx2 = wl_fixed_from_int(es->geometry.width);
 	if (sy2 > wl_fixed_from_int(es->geometry.height))
 		sy2 = wl_fixed_from_int(es->geometry.height);
+	pixman_region32_fini(&src_rect);
+
+	src_w = (sx2 - sx1) << 8;
+	src_h = (sy2 - sy1) << 8;
+
+	/* Any free sprite that takes the format, skipping the ones that
+	 * recently refused this configuration. */
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (!drm_sprite_crtc_supported(output_base, s->possible_crtcs))
+			continue;
+
+		if (!s->pending_fb &&
+		    drm_surface_format_supported(s, bfb->format) &&
+		    !drm_plane_failed(c, s->plane_id, bfb->format,
+				      src_w, src_h,
+				      dest.x2 - dest.x1, dest.y2 - dest.y1,
+				      transform)) {
+			found = 1;
+			break;
+		}
+	}
+
+	/* No sprites available */
+	if (!found)
+		return NULL;
+
+	s->pending_fb = drm_buffer_fb_ref(bfb);
+	s->pending_surface = es;
+	s->output = (struct drm_output *) output_base;
+	es->buffer->busy_count++;
+
+	box = pixman_region32_extents(&es->transform.boundingbox);
+	s->plane.x = box->x1;
+	s->plane.y = box->y1;
 
+	s->dest_x = dest.x1;
+	s->dest_y = dest.y1;
+	s->dest_w = dest.x2 - dest.x1;
+	s->dest_h = dest.y2 - dest.y1;
 	s->src_x = sx1 << 8;
 	s->src_y = sy1 << 8;
-	s->src_w = (sx2 - sx1) << 8;
-	s->src_h = (sy2 - sy1) << 8;
-	pixman_region32_fini(&src_rect);
+	s->src_w = src_w;
+	s->src_h = src_h;
+	s->transform = transform;
 
 	wl_signal_add(&es->buffer->resource.destroy_signal,
 		      &s->pending_destroy_listener);
@@ -706,13 +1533,21 @@ drm_output_prepare_cursor_surface(struct weston_output *output_base,
 				  struct weston_surface *es)
 {
 	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output_base->compositor;
 
 	if (output->cursor_surface)
 		return NULL;
+	if (!output->cursor_buf || (c->atomic_modeset && !output->cursor.id))
+		return NULL;
 	if (es->output_mask != (1u << output_base->id))
 		return NULL;
 	if (es->buffer == NULL || !wl_buffer_is_shm(es->buffer) ||
-	    es->geometry.width > 64 || es->geometry.height > 64)
+	    es->buffer_released ||
+	    (wl_shm_buffer_get_format(es->buffer) != WL_SHM_FORMAT_ARGB8888 &&
+	     wl_shm_buffer_get_format(es->buffer) != WL_SHM_FORMAT_XRGB8888) ||
+	    es->geometry.width > output->cursor_width ||
+	    es->geometry.height > output->cursor_height)
 		return NULL;
 
 	output->cursor_surface = es;
@@ -726,37 +1561,29 @@ drm_output_set_cursor(struct drm_output *output)
 	struct weston_surface *es = output->cursor_surface;
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
-	EGLint handle, stride;
+	EGLint handle;
 	struct gbm_bo *bo;
-	uint32_t buf[64 * 64];
-	unsigned char *s;
-	int i, x, y;
+	int x, y;
 
 	output->cursor_surface = NULL;
 	if (es == NULL) {
-		drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
+		if (output->current_cursor >= 0)
+			drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
+		output->current_cursor = -1;
 		return;
 	}
 
-	if (es->buffer && pixman_region32_not_empty(&output->cursor_plane.damage)) {
-		pixman_region32_fini(&output->cursor_plane.damage);
-		pixman_region32_init(&output->cursor_plane.damage);
-		output->current_cursor ^= 1;
-		bo = output->cursor_bo[output->current_cursor];
-		memset(buf, 0, sizeof buf);
-		stride = wl_shm_buffer_get_stride(es->buffer);
-		s = wl_shm_buffer_get_data(es->buffer);
-		for (i = 0; i < es->geometry.height; i++)
-			memcpy(buf + i * 64, s + i * stride,
-			       es->geometry.width * 4);
-
-		if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-			weston_log("failed update cursor: %n\n");
-
+	/* Only position changes need no new image. */
+	if (es->buffer &&
+	    (pixman_region32_not_empty(&output->cursor_plane.damage) ||
+	     output->current_cursor < 0) &&
+	    drm_output_update_cursor_bo(output, es)) {
+		bo = output->cursor_bos[output->current_cursor].bo;
 		handle = gbm_bo_get_handle(bo).s32;
-		if (drmModeSetCursor(c->drm.fd,
-				     output->crtc_id, handle, 64, 64))
-			weston_log("failed to set cursor: %n\n");
+		if (drmModeSetCursor(c->drm.fd, output->crtc_id, handle,
+				     output->cursor_width,
+				     output->cursor_height))
+			weston_log("failed to set cursor: %m\n");
 	}
 
 	x = es->geometry.x - output->base.x;
@@ -769,14 +1596,212 @@ drm_output_set_cursor(struct drm_output *output)
 	}
 }
 
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+/* Takes back a plane assignment the kernel refused. */
+static void
+drm_output_cancel_plane(struct drm_output *output, struct weston_plane *plane)
+{
+	struct drm_sprite *s;
+	struct drm_fb *fb;
+
+	if (plane == &output->cursor_plane) {
+		output->cursor_surface = NULL;
+	} else if (plane == &output->fb_plane) {
+		fb = output->next;
+		output->next = NULL;
+		fb->buffer->busy_count--;
+		wl_list_remove(&fb->buffer_destroy_listener.link);
+		drm_buffer_fb_unref(fb->buffer_fb);
+		free(fb);
+	} else {
+		s = container_of(plane, struct drm_sprite, plane);
+		drm_sprite_record_failure(s);
+		drm_buffer_fb_unref(s->pending_fb);
+		s->pending_fb = NULL;
+		s->pending_surface->buffer->busy_count--;
+		s->pending_surface = NULL;
+		wl_list_remove(&s->pending_destroy_listener.link);
+	}
+}
+#endif
+
+struct drm_overlay_candidate {
+	struct weston_surface *surface;
+	uint64_t benefit;
+	int visited;
+};
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+/*
+ * What moving a surface off the primary plane saves the renderer per
+ * second: the pixels it draws, twice for blended ones since those read
+ * the destination as well, once per update plus once for the repaints
+ * of whatever is below.
+ */
+static uint64_t
+drm_overlay_benefit(struct weston_output *output, struct weston_surface *es,
+		    uint32_t now)
+{
+	pixman_region32_t region;
+	uint64_t area, opaque, rate;
+	uint32_t interval;
+
+	pixman_region32_init(&region);
+	pixman_region32_intersect(&region, &es->transform.boundingbox,
+				  &output->region);
+	area = region_area(&region);
+	pixman_region32_intersect(&region, &es->transform.opaque,
+				  &output->region);
+	opaque = region_area(&region);
+	pixman_region32_fini(&region);
+
+	/* A surface that stopped updating is rated by how long it has
+	 * been idle, not by its last rate. */
+	interval = es->attach_interval;
+	if (!es->attach_msecs)
+		interval = UINT32_MAX;
+	else if (now - es->attach_msecs > interval)
+		interval = now - es->attach_msecs;
+
+	rate = 1000 / (interval ? interval : 1);
+	if (rate > (uint64_t) output->current->refresh / 1000)
+		rate = output->current->refresh / 1000;
+
+	return (2 * area - opaque) * (1 + rate);
+}
+
+/*
+ * Ranks the surfaces that could go on a sprite by benefit, best first.
+ * Only as many as there are sprites are kept.  Surfaces hidden by the
+ * opaque ones above don't compete for a sprite, and neither does one
+ * whose opaque region covers the output: that one goes on the scanout
+ * plane if anything and hides everything below.
+ */
+static int
+drm_output_rank_overlays(struct weston_output *output,
+			 struct drm_overlay_candidate *cand, int max)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->compositor;
+	struct weston_surface *es;
+	struct drm_sprite *s;
+	pixman_region32_t opaque, visible;
+	uint32_t now = weston_compositor_get_time();
+	uint64_t benefit;
+	int count = 0, sprites = 0, i;
+
+	wl_list_for_each(s, &c->sprite_list, link)
+		if (drm_sprite_crtc_supported(output, s->possible_crtcs) &&
+		    !s->pending_fb)
+			sprites++;
+	if (max > sprites)
+		max = sprites;
+
+	pixman_region32_init(&opaque);
+	pixman_region32_init(&visible);
+	wl_list_for_each(es, &c->base.surface_list, link) {
+		pixman_region32_intersect(&visible, &es->transform.boundingbox,
+					  &output->region);
+		pixman_region32_subtract(&visible, &visible, &opaque);
+		if (!pixman_region32_not_empty(&visible))
+			continue;
+
+		pixman_region32_union(&opaque, &opaque, &es->transform.opaque);
+		pixman_region32_subtract(&visible, &output->region,
+					 &es->transform.opaque);
+		if (!pixman_region32_not_empty(&visible))
+			break;
+
+		if (es->output_mask != (1u << output->id) ||
+		    es->buffer == NULL || wl_buffer_is_shm(es->buffer))
+			continue;
+
+		benefit = drm_overlay_benefit(output, es, now);
+		for (i = count; i > 0 && cand[i - 1].benefit < benefit; i--)
+			if (i < max)
+				cand[i] = cand[i - 1];
+		if (i >= max)
+			continue;
+
+		cand[i].surface = es;
+		cand[i].benefit = benefit;
+		cand[i].visited = 0;
+		if (count < max)
+			count++;
+	}
+	pixman_region32_fini(&visible);
+	pixman_region32_fini(&opaque);
+
+	return count;
+}
+
+/*
+ * Releases the sprite reserved for es once its plane is decided,
+ * whichever plane that is.
+ */
+static void
+drm_overlay_visit(struct weston_surface *es,
+		  struct drm_overlay_candidate *cand, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (cand[i].surface == es)
+			cand[i].visited = 1;
+}
+
+/*
+ * Whether es may take a sprite now: it has to be ranked, and the
+ * better ranked candidates further down the stack that haven't been
+ * placed yet keep a sprite reserved.
+ */
+static int
+drm_overlay_allowed(struct weston_output *output, struct weston_surface *es,
+		    struct drm_overlay_candidate *cand, int count)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->compositor;
+	struct drm_sprite *s;
+	int i, reserved = 0, sprites = 0;
+
+	for (i = 0; i < count && cand[i].surface != es; i++)
+		if (!cand[i].visited)
+			reserved++;
+	if (i == count)
+		return 0;
+
+	wl_list_for_each(s, &c->sprite_list, link)
+		if (drm_sprite_crtc_supported(output, s->possible_crtcs) &&
+		    !s->pending_fb)
+			sprites++;
+
+	return sprites > reserved;
+}
+
 static void
 drm_assign_planes(struct weston_output *output)
 {
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->compositor;
+	struct drm_overlay_candidate cand[DRM_MAX_OVERLAY_CANDIDATES];
 	struct weston_surface *es, *next;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
+	int count;
 
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
@@ -790,7 +1815,13 @@ drm_assign_planes(struct weston_output *output)
 	 * the main display surface may not need to update at all, and
 	 * the client buffer can be used directly for the sprite surface
 	 * as we do for flipping full screen surfaces.
+	 *
+	 * The sprites go to the surfaces ranked best by
+	 * drm_overlay_benefit(), not the first ones in stacking order.
 	 */
+	count = drm_output_rank_overlays(output, cand,
+					 DRM_MAX_OVERLAY_CANDIDATES);
+
 	pixman_region32_init(&overlap);
 	primary = &c->base.primary_plane;
 	wl_list_for_each_safe(es, next, &c->base.surface_list, link) {
@@ -805,10 +1836,20 @@ drm_assign_planes(struct weston_output *output)
 			next_plane = drm_output_prepare_cursor_surface(output, es);
 		if (next_plane == NULL)
 			next_plane = drm_output_prepare_scanout_surface(output, es);
-		if (next_plane == NULL)
+		if (next_plane == NULL &&
+		    drm_overlay_allowed(output, es, cand, count))
 			next_plane = drm_output_prepare_overlay_surface(output, es);
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+		if (c->atomic_modeset && next_plane && next_plane != primary &&
+		    drm_output_test_atomic((struct drm_output *) output) < 0) {
+			drm_output_cancel_plane((struct drm_output *) output,
+						next_plane);
+			next_plane = NULL;
+		}
+#endif
 		if (next_plane == NULL)
 			next_plane = primary;
+		drm_overlay_visit(es, cand, count);
 		weston_surface_move_to_plane(es, next_plane);
 		if (next_plane == primary)
 			pixman_region32_union(&overlap, &overlap,
@@ -819,6 +1860,22 @@ drm_assign_planes(struct weston_output *output)
 	pixman_region32_fini(&overlap);
 }
 
+static void
+drm_output_fini_cursor(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	int i;
+
+	for (i = 0; i < DRM_CURSOR_BOS; i++) {
+		if (output->cursor_bos[i].fb_id)
+			drmModeRmFB(c->drm.fd, output->cursor_bos[i].fb_id);
+		if (output->cursor_bos[i].bo)
+			gbm_bo_destroy(output->cursor_bos[i].bo);
+	}
+	free(output->cursor_buf);
+}
+
 static void
 drm_output_destroy(struct weston_output *output_base)
 {
@@ -842,6 +1899,13 @@ drm_output_destroy(struct weston_output *output_base)
 	c->crtc_allocator &= ~(1 << output->crtc_id);
 	c->connector_allocator &= ~(1 << output->connector_id);
 
+	drm_output_fini_cursor(output);
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+	if (output->mode_blob_id)
+		drmModeDestroyPropertyBlob(c->drm.fd, output->mode_blob_id);
+#endif
+
+	gles2_renderer_output_destroy(output_base);
 	eglDestroySurface(c->base.egl_display, output->egl_surface);
 	gbm_surface_destroy(output->surface);
 
@@ -968,28 +2032,17 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 	}
 
 	/* reset rendering stuff. */
-	if (output->current) {
-		if (output->current->is_client_buffer)
-			gbm_bo_destroy(output->current->bo);
-		else
-			gbm_surface_release_buffer(output->surface,
-						   output->current->bo);
-	}
+	drm_output_release_fb(output, output->current);
 	output->current = NULL;
 
-	if (output->next) {
-		if (output->next->is_client_buffer)
-			gbm_bo_destroy(output->next->bo);
-		else
-			gbm_surface_release_buffer(output->surface,
-						   output->next->bo);
-	}
+	drm_output_release_fb(output, output->next);
 	output->next = NULL;
 
 	eglDestroySurface(ec->base.egl_display, output->egl_surface);
 	gbm_surface_destroy(output->surface);
 	output->egl_surface = egl_surface;
 	output->surface = surface;
+	gles2_renderer_output_set_surface(&output->base, egl_surface);
 
 	/*update output*/
 	output->base.current = &drm_mode->base;
@@ -1038,6 +2091,17 @@ init_egl(struct drm_compositor *ec, struct udev_device *device)
 		EGL_NONE
 	};
 
+	static const EGLint depth_config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+		EGL_RED_SIZE, 1,
+		EGL_GREEN_SIZE, 1,
+		EGL_BLUE_SIZE, 1,
+		EGL_ALPHA_SIZE, 0,
+		EGL_DEPTH_SIZE, 1,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+
 	sysnum = udev_device_get_sysnum(device);
 	if (sysnum)
 		ec->drm.id = atoi(sysnum);
@@ -1075,8 +2139,12 @@ init_egl(struct drm_compositor *ec, struct udev_device *device)
 		return -1;
 	}
 
-	if (!eglChooseConfig(ec->base.egl_display, config_attribs,
-			     &ec->base.egl_config, 1, &n) || n != 1) {
+	/* The renderer uses a depth buffer to reject hidden fragments
+	 * early, but does fine without one. */
+	if ((!eglChooseConfig(ec->base.egl_display, depth_config_attribs,
+			      &ec->base.egl_config, 1, &n) || n != 1) &&
+	    (!eglChooseConfig(ec->base.egl_display, config_attribs,
+			      &ec->base.egl_config, 1, &n) || n != 1)) {
 		weston_log("failed to choose config: %d\n", n);
 		return -1;
 	}
@@ -1178,11 +2246,9 @@ sprite_handle_buffer_destroy(struct wl_listener *listener, void *data)
 	struct drm_sprite *sprite =
 		container_of(listener, struct drm_sprite,
 			     destroy_listener);
-	struct drm_compositor *compositor = sprite->compositor;
 
+	/* The framebuffer stays on screen until the sprite is updated. */
 	sprite->surface = NULL;
-	drmModeRmFB(compositor->drm.fd, sprite->fb_id);
-	sprite->fb_id = 0;
 }
 
 static void
@@ -1191,11 +2257,8 @@ sprite_handle_pending_buffer_destroy(struct wl_listener *listener, void *data)
 	struct drm_sprite *sprite =
 		container_of(listener, struct drm_sprite,
 			     pending_destroy_listener);
-	struct drm_compositor *compositor = sprite->compositor;
 
 	sprite->pending_surface = NULL;
-	drmModeRmFB(compositor->drm.fd, sprite->pending_fb_id);
-	sprite->pending_fb_id = 0;
 }
 
 /* returns a value between 0-255 range, where higher is brighter */
@@ -1324,6 +2387,55 @@ find_crtc_for_connector(struct drm_compositor *ec,
 	return -1;
 }
 
+static void
+drm_output_init_cursor(struct drm_compositor *ec, struct drm_output *output)
+{
+	struct drm_cursor_bo *cursor;
+	int i;
+
+	output->current_cursor = -1;
+	output->cursor_width = ec->cursor_width;
+	output->cursor_height = ec->cursor_height;
+
+	for (i = 0; i < DRM_CURSOR_BOS; i++) {
+		cursor = &output->cursor_bos[i];
+		cursor->bo = gbm_bo_create(ec->gbm, output->cursor_width,
+					   output->cursor_height,
+					   GBM_FORMAT_ARGB8888,
+					   GBM_BO_USE_CURSOR_64X64 |
+					   GBM_BO_USE_WRITE);
+
+		/* Older gbm only allocates 64x64 cursor bos. */
+		if (!cursor->bo && i == 0 && output->cursor_width != 64) {
+			output->cursor_width = 64;
+			output->cursor_height = 64;
+			cursor->bo = gbm_bo_create(ec->gbm, 64, 64,
+						   GBM_FORMAT_ARGB8888,
+						   GBM_BO_USE_CURSOR_64X64 |
+						   GBM_BO_USE_WRITE);
+		}
+		if (!cursor->bo)
+			continue;
+
+		/* The cursor plane takes framebuffers, not bo handles. */
+		if (ec->atomic_modeset && output->cursor.id &&
+		    drmModeAddFB(ec->drm.fd, output->cursor_width,
+				 output->cursor_height, 32, 32,
+				 gbm_bo_get_stride(cursor->bo),
+				 gbm_bo_get_handle(cursor->bo).u32,
+				 &cursor->fb_id)) {
+			weston_log("failed to create cursor fb: %m\n");
+			output->cursor.id = 0;
+		}
+	}
+
+	if (!output->cursor_bos[0].bo)
+		return;
+
+	output->cursor_buf = malloc(output->cursor_width *
+				    output->cursor_height * 4);
+}
+
 static int
 create_output_for_connector(struct drm_compositor *ec,
 			    drmModeRes *resources,
@@ -1371,6 +2483,14 @@ create_output_for_connector(struct drm_compositor *ec,
 
 	output->original_crtc = drmModeGetCrtc(ec->drm.fd, output->crtc_id);
 
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+	if (ec->atomic_modeset && drm_output_init_atomic(ec, output, i) < 0) {
+		weston_log("no usable primary plane for crtc %d\n",
+			   output->crtc_id);
+		goto err_free;
+	}
+#endif
+
 	/* Get the current mode on the crtc that's currently driving
 	 * this connector. */
 	encoder = drmModeGetEncoder(ec->drm.fd, connector->encoder_id);
@@ -1480,12 +2600,13 @@ create_output_for_connector(struct drm_compositor *ec,
 		goto err_surface;
 	}
 
-	output->cursor_bo[0] =
-		gbm_bo_create(ec->gbm, 64, 64, GBM_FORMAT_ARGB8888,
-			      GBM_BO_USE_CURSOR_64X64 | GBM_BO_USE_WRITE);
-	output->cursor_bo[1] =
-		gbm_bo_create(ec->gbm, 64, 64, GBM_FORMAT_ARGB8888,
-			      GBM_BO_USE_CURSOR_64X64 | GBM_BO_USE_WRITE);
+	if (gles2_renderer_output_create(&output->base,
+					 output->egl_surface) < 0) {
+		eglDestroySurface(ec->base.egl_display, output->egl_surface);
+		goto err_surface;
+	}
+
+	drm_output_init_cursor(ec, output);
 
 	output->backlight = backlight_init(drm_device,
 					   connector->connector_type);
@@ -1562,6 +2683,17 @@ create_sprites(struct drm_compositor *ec)
 		if (!plane)
 			continue;
 
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+		/* With universal planes the list includes the primary and
+		 * cursor planes, those belong to the outputs. */
+		if (ec->atomic_modeset &&
+		    drm_plane_get_type(ec->drm.fd,
+				       plane->plane_id) != DRM_PLANE_OVERLAY) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+#endif
+
 		sprite = malloc(sizeof(*sprite) + ((sizeof(uint32_t)) *
 						   plane->count_formats));
 		if (!sprite) {
@@ -1577,8 +2709,8 @@ create_sprites(struct drm_compositor *ec)
 		sprite->plane_id = plane->plane_id;
 		sprite->surface = NULL;
 		sprite->pending_surface = NULL;
-		sprite->fb_id = 0;
-		sprite->pending_fb_id = 0;
+		sprite->fb = NULL;
+		sprite->pending_fb = NULL;
 		sprite->destroy_listener.notify = sprite_handle_buffer_destroy;
 		sprite->pending_destroy_listener.notify =
 			sprite_handle_pending_buffer_destroy;
@@ -1589,6 +2721,16 @@ create_sprites(struct drm_compositor *ec)
 		drmModeFreePlane(plane);
 		weston_plane_init(&sprite->plane, 0, 0);
 
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+		if (ec->atomic_modeset &&
+		    drm_plane_props_init(&sprite->props, ec->drm.fd,
+					 sprite->plane_id) < 0) {
+			weston_plane_release(&sprite->plane);
+			free(sprite);
+			continue;
+		}
+#endif
+
 		wl_list_insert(&ec->sprite_list, &sprite->link);
 	}
 
@@ -1610,7 +2752,10 @@ destroy_sprites(struct drm_compositor *compositor)
 				sprite->plane_id,
 				output->crtc_id, 0, 0,
 				0, 0, 0, 0, 0, 0, 0, 0);
-		drmModeRmFB(compositor->drm.fd, sprite->fb_id);
+		if (sprite->fb)
+			drm_buffer_fb_unref(sprite->fb);
+		if (sprite->pending_fb)
+			drm_buffer_fb_unref(sprite->pending_fb);
 		weston_plane_release(&sprite->plane);
 		free(sprite);
 	}
@@ -2059,8 +3204,9 @@ drm_destroy(struct weston_compositor *ec)
 	eglTerminate(ec->egl_display);
 	eglReleaseThread();
 
-	gbm_device_destroy(d->gbm);
 	destroy_sprites(d);
+	drm_destroy_buffer_fbs(d);
+	gbm_device_destroy(d->gbm);
 	if (weston_launcher_drm_set_master(&d->base, d->drm.fd, 0) < 0)
 		weston_log("failed to drop master: %m\n");
 	tty_destroy(d->tty);
@@ -2136,6 +3282,7 @@ vt_func(struct weston_compositor *compositor, int event)
 		wl_list_for_each(output, &ec->base.output_list, base.link) {
 			output->base.repaint_needed = 0;
 			drmModeSetCursor(ec->drm.fd, output->crtc_id, 0, 0, 0);
+			output->current_cursor = -1;
 		}
 
 		output = container_of(ec->base.output_list.next,
@@ -2162,6 +3309,24 @@ switch_vt_binding(struct wl_seat *seat, uint32_t time, uint32_t key, void *data)
 	tty_activate_vt(ec->tty, key - KEY_F1 + 1);
 }
 
+static void
+drm_compositor_init_cursor_size(struct drm_compositor *ec)
+{
+#ifdef DRM_CAP_CURSOR_WIDTH
+	uint64_t value;
+#endif
+
+	ec->cursor_width = 64;
+	ec->cursor_height = 64;
+
+#ifdef DRM_CAP_CURSOR_WIDTH
+	if (drmGetCap(ec->drm.fd, DRM_CAP_CURSOR_WIDTH, &value) == 0)
+		ec->cursor_width = value;
+	if (drmGetCap(ec->drm.fd, DRM_CAP_CURSOR_HEIGHT, &value) == 0)
+		ec->cursor_height = value;
+#endif
+}
+
 static struct weston_compositor *
 drm_compositor_create(struct wl_display *display,
 		      int connector, const char *seat, int tty,
@@ -2239,7 +3404,7 @@ drm_compositor_create(struct wl_display *display,
 
 	ec->prev_state = WESTON_COMPOSITOR_ACTIVE;
 
-	if (weston_compositor_init_gl(&ec->base) < 0)
+	if (gles2_renderer_init(&ec->base) < 0)
 		goto err_egl;
 
 	for (key = KEY_F1; key < KEY_F9; key++)
@@ -2247,7 +3412,13 @@ drm_compositor_create(struct wl_display *display,
 						  MODIFIER_CTRL | MODIFIER_ALT,
 						  switch_vt_binding, ec);
 
+#if HAVE_DECL_DRMMODEATOMICADDPROPERTY
+	drm_compositor_init_atomic(ec);
+#endif
+	drm_compositor_init_cursor_size(ec);
+
 	wl_list_init(&ec->sprite_list);
+	wl_list_init(&ec->buffer_fb_list);
 	create_sprites(ec);
 
 	if (create_outputs(ec, connector, drm_device) < 0) {
@@ -2425,6 +3596,7 @@ backend_init(struct wl_display *display, int argc, char *argv[],
 		{ WESTON_OPTION_STRING, "seat", 0, &seat },
 		{ WESTON_OPTION_INTEGER, "tty", 0, &tty },
 		{ WESTON_OPTION_BOOLEAN, "current-mode", 0, &option_current_mode },
+		{ WESTON_OPTION_BOOLEAN, "no-atomic", 0, &option_no_atomic },
 	};
 
 	parse_options(drm_options, ARRAY_LENGTH(drm_options), argc, argv);
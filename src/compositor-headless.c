@@ -0,0 +1,275 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "compositor.h"
+#include "pixman-renderer.h"
+
+struct headless_compositor {
+	struct weston_compositor base;
+	struct weston_seat fake_seat;
+};
+
+struct headless_output {
+	struct weston_output base;
+	struct weston_mode mode;
+	struct wl_event_source *finish_frame_timer;
+	uint32_t *buf;
+	pixman_image_t *image;
+};
+
+static void
+headless_output_repaint(struct weston_output *output_base,
+			pixman_region32_t *damage)
+{
+	struct headless_output *output = (struct headless_output *) output_base;
+	struct weston_compositor *ec = output->base.compositor;
+
+	ec->renderer->repaint_output(&output->base, damage);
+
+	/* One frame per refresh period, so that clients throttled on
+	 * frame callbacks see a realistic frame rate. */
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     1000000 / output->mode.refresh);
+}
+
+static int
+finish_frame_handler(void *data)
+{
+	struct headless_output *output = data;
+	uint32_t msec;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	weston_output_finish_frame(&output->base, msec);
+
+	return 1;
+}
+
+static void
+headless_output_destroy(struct weston_output *output_base)
+{
+	struct headless_output *output = (struct headless_output *) output_base;
+
+	wl_list_remove(&output->base.link);
+	wl_event_source_remove(output->finish_frame_timer);
+
+	pixman_renderer_output_destroy(&output->base);
+	pixman_image_unref(output->image);
+	free(output->buf);
+
+	weston_output_destroy(&output->base);
+
+	free(output);
+}
+
+static int
+headless_compositor_create_output(struct headless_compositor *c,
+				  int x, int width, int height, int refresh)
+{
+	struct headless_output *output;
+	struct wl_event_loop *loop;
+
+	output = malloc(sizeof *output);
+	if (output == NULL)
+		return -1;
+
+	memset(output, 0, sizeof *output);
+
+	output->mode.flags =
+		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
+	output->mode.width = width;
+	output->mode.height = height;
+	output->mode.refresh = refresh;
+	wl_list_init(&output->base.mode_list);
+	wl_list_insert(&output->base.mode_list, &output->mode.link);
+
+	output->base.current = &output->mode;
+	output->base.origin = output->base.current;
+	output->base.make = "weston";
+	output->base.model = "headless";
+	weston_output_init(&output->base, &c->base, x, 0, width, height, 0);
+
+	output->buf = malloc(width * height * 4);
+	if (output->buf == NULL)
+		goto err_output;
+
+	output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						 width, height,
+						 output->buf, width * 4);
+	if (output->image == NULL)
+		goto err_buf;
+
+	if (pixman_renderer_output_create(&output->base) < 0)
+		goto err_image;
+	pixman_renderer_output_set_buffer(&output->base, output->image);
+
+	loop = wl_display_get_event_loop(c->base.wl_display);
+	output->finish_frame_timer =
+		wl_event_loop_add_timer(loop, finish_frame_handler, output);
+
+	output->base.repaint = headless_output_repaint;
+	output->base.destroy = headless_output_destroy;
+	output->base.assign_planes = NULL;
+	output->base.set_backlight = NULL;
+	output->base.set_dpms = NULL;
+	output->base.switch_mode = NULL;
+
+	wl_list_insert(c->base.output_list.prev, &output->base.link);
+
+	weston_log("headless output %dx%d@%d.%03d at %d,0\n",
+		   width, height, refresh / 1000, refresh % 1000, x);
+
+	return 0;
+
+err_image:
+	pixman_image_unref(output->image);
+err_buf:
+	free(output->buf);
+err_output:
+	weston_output_destroy(&output->base);
+	free(output);
+	return -1;
+}
+
+static int
+headless_input_create(struct headless_compositor *c, int no_input)
+{
+	weston_seat_init(&c->fake_seat, &c->base);
+	c->base.seat = &c->fake_seat;
+
+	if (no_input)
+		return 0;
+
+	weston_seat_init_pointer(&c->fake_seat);
+	weston_seat_init_keyboard(&c->fake_seat, NULL);
+
+	return 0;
+}
+
+static void
+headless_input_destroy(struct headless_compositor *c)
+{
+	weston_seat_release(&c->fake_seat);
+}
+
+static void
+headless_restore(struct weston_compositor *ec)
+{
+}
+
+static void
+headless_destroy(struct weston_compositor *ec)
+{
+	struct headless_compositor *c = (struct headless_compositor *) ec;
+
+	headless_input_destroy(c);
+	weston_compositor_shutdown(ec); /* destroys outputs, too */
+
+	free(ec);
+}
+
+static struct weston_compositor *
+headless_compositor_create(struct wl_display *display,
+			   int width, int height, int count, int refresh,
+			   int no_input,
+			   int argc, char *argv[], const char *config_file)
+{
+	struct headless_compositor *c;
+	int i;
+
+	weston_log("initializing headless backend\n");
+
+	c = malloc(sizeof *c);
+	if (c == NULL)
+		return NULL;
+
+	memset(c, 0, sizeof *c);
+
+	if (weston_compositor_init(&c->base, display, argc, argv,
+				   config_file) < 0)
+		goto err_free;
+
+	c->base.wl_display = display;
+	c->base.destroy = headless_destroy;
+	c->base.restore = headless_restore;
+
+	if (pixman_renderer_init(&c->base) < 0)
+		goto err_compositor;
+
+	if (headless_input_create(c, no_input) < 0)
+		goto err_compositor;
+
+	for (i = 0; i < count; i++)
+		if (headless_compositor_create_output(c, i * width,
+						      width, height,
+						      refresh) < 0)
+			goto err_input;
+
+	return &c->base;
+
+err_input:
+	headless_input_destroy(c);
+err_compositor:
+	weston_compositor_shutdown(&c->base); /* destroys outputs, too */
+err_free:
+	free(c);
+	return NULL;
+}
+
+WL_EXPORT struct weston_compositor *
+backend_init(struct wl_display *display, int argc, char *argv[],
+	     const char *config_file)
+{
+	int width = 1024, height = 640, count = 1, refresh = 60000;
+	int no_input = 0;
+
+	const struct weston_option headless_options[] = {
+		{ WESTON_OPTION_INTEGER, "width", 0, &width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "output-count", 0, &count },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &refresh },
+		{ WESTON_OPTION_BOOLEAN, "no-input", 0, &no_input },
+	};
+
+	parse_options(headless_options,
+		      ARRAY_LENGTH(headless_options), argc, argv);
+
+	/* The frame timer has millisecond resolution. */
+	if (width <= 0 || height <= 0 || count <= 0 ||
+	    refresh <= 0 || refresh > 1000000) {
+		weston_log("invalid headless output configuration\n");
+		return NULL;
+	}
+
+	return headless_compositor_create(display, width, height, count,
+					  refresh, no_input,
+					  argc, argv, config_file);
+}
@@ -65,8 +65,6 @@ struct wayland_compositor {
 
 	struct {
 		int32_t top, bottom, left, right;
-		GLuint texture;
-		int32_t width, height;
 	} border;
 
 	struct wl_list input_list;
@@ -95,122 +93,6 @@ struct wayland_input {
 };
 
 
-static int
-texture_border(struct wayland_output *output)
-{
-	struct wayland_compositor *c =
-		(struct wayland_compositor *) output->base.compositor;
-	GLfloat *d;
-	unsigned int *p;
-	int i, j, k, n;
-	GLfloat x[4], y[4], u[4], v[4];
-
-	x[0] = -c->border.left;
-	x[1] = 0;
-	x[2] = output->base.current->width;
-	x[3] = output->base.current->width + c->border.right;
-
-	y[0] = -c->border.top;
-	y[1] = 0;
-	y[2] = output->base.current->height;
-	y[3] = output->base.current->height + c->border.bottom;
-
-	u[0] = 0.0;
-	u[1] = (GLfloat) c->border.left / c->border.width;
-	u[2] = (GLfloat) (c->border.width - c->border.right) / c->border.width;
-	u[3] = 1.0;
-
-	v[0] = 0.0;
-	v[1] = (GLfloat) c->border.top / c->border.height;
-	v[2] = (GLfloat) (c->border.height - c->border.bottom) / c->border.height;
-	v[3] = 1.0;
-
-	n = 8;
-	d = wl_array_add(&c->base.vertices, n * 16 * sizeof *d);
-	p = wl_array_add(&c->base.indices, n * 6 * sizeof *p);
-
-	k = 0;
-	for (i = 0; i < 3; i++)
-		for (j = 0; j < 3; j++) {
-
-			if (i == 1 && j == 1)
-				continue;
-
-			d[ 0] = x[i];
-			d[ 1] = y[j];
-			d[ 2] = u[i];
-			d[ 3] = v[j];
-
-			d[ 4] = x[i];
-			d[ 5] = y[j + 1];
-			d[ 6] = u[i];
-			d[ 7] = v[j + 1];
-
-			d[ 8] = x[i + 1];
-			d[ 9] = y[j];
-			d[10] = u[i + 1];
-			d[11] = v[j];
-
-			d[12] = x[i + 1];
-			d[13] = y[j + 1];
-			d[14] = u[i + 1];
-			d[15] = v[j + 1];
-
-			p[0] = k + 0;
-			p[1] = k + 1;
-			p[2] = k + 2;
-			p[3] = k + 2;
-			p[4] = k + 1;
-			p[5] = k + 3;
-
-			d += 16;
-			p += 6;
-			k += 4;
-		}
-
-	return k / 4;
-}
-
-static void
-draw_border(struct wayland_output *output)
-{
-	struct wayland_compositor *c =
-		(struct wayland_compositor *) output->base.compositor;
-	struct weston_shader *shader = &c->base.texture_shader_rgba;
-	GLfloat *v;
-	int n;
-
-	glDisable(GL_BLEND);
-	glUseProgram(shader->program);
-	c->base.current_shader = shader;
-
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, output->base.matrix.d);
-
-	glUniform1i(shader->tex_uniforms[0], 0);
-	glUniform1f(shader->alpha_uniform, 1);
-	glUniform1f(shader->texwidth_uniform, 1);
-
-	n = texture_border(output);
-
-	glBindTexture(GL_TEXTURE_2D, c->border.texture);
-
-	v = c->base.vertices.data;
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-
-	glDrawElements(GL_TRIANGLES, n * 6,
-		       GL_UNSIGNED_INT, c->base.indices.data);
-
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
-
-	c->base.vertices.size = 0;
-	c->base.indices.size = 0;
-}
-
 static void
 create_border(struct wayland_compositor *c)
 {
@@ -222,21 +104,10 @@ create_border(struct wayland_compositor *c)
 		return;
 	}
 
-	c->border.width = pixman_image_get_width(image);
-	c->border.height = pixman_image_get_height(image);
-
-	glGenTextures(1, &c->border.texture);
-	glBindTexture(GL_TEXTURE_2D, c->border.texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
-		     c->border.width,
-		     c->border.height,
-		     0, GL_BGRA_EXT, GL_UNSIGNED_BYTE,
-		     pixman_image_get_data(image));
+	gles2_renderer_set_border(&c->base,
+				  pixman_image_get_width(image),
+				  pixman_image_get_height(image),
+				  pixman_image_get_data(image));
 
 	c->border.top = 25;
 	c->border.bottom = 50;
@@ -333,7 +204,6 @@ wayland_output_repaint(struct weston_output *output_base,
 	struct wayland_compositor *compositor =
 		(struct wayland_compositor *) output->base.compositor;
 	struct wl_callback *callback;
-	struct weston_surface *surface;
 
 	if (!eglMakeCurrent(compositor->base.egl_display, output->egl_surface,
 			    output->egl_surface,
@@ -342,12 +212,7 @@ wayland_output_repaint(struct weston_output *output_base,
 		return;
 	}
 
-	wl_list_for_each_reverse(surface, &compositor->base.surface_list, link)
-		weston_surface_draw(surface, &output->base, damage);
-
-	draw_border(output);
-
-	wl_signal_emit(&output->base.frame_signal, output);
+	compositor->base.renderer->repaint_output(&output->base, damage);
 
 	eglSwapBuffers(compositor->base.egl_display, output->egl_surface);
 	callback = wl_surface_frame(output->parent.surface);
@@ -362,6 +227,7 @@ wayland_output_destroy(struct weston_output *output_base)
 	struct wayland_output *output = (struct wayland_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
 
+	gles2_renderer_output_destroy(output_base);
 	eglDestroySurface(ec->egl_display, output->egl_surface);
 	wl_egl_window_destroy(output->parent.egl_window);
 	free(output);
@@ -386,7 +252,7 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = width;
 	output->mode.height = height;
-	output->mode.refresh = 60;
+	output->mode.refresh = 60000;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
@@ -429,6 +295,10 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 		return -1;
 	}
 
+	if (gles2_renderer_output_create(&output->base,
+					 output->egl_surface) < 0)
+		goto cleanup_surface;
+
 	output->parent.shell_surface =
 		wl_shell_get_shell_surface(c->parent.shell,
 					   output->parent.surface);
@@ -877,7 +747,7 @@ wayland_compositor_create(struct wl_display *display,
 	c->base.destroy = wayland_destroy;
 	c->base.restore = wayland_restore;
 
-	if (weston_compositor_init_gl(&c->base) < 0)
+	if (gles2_renderer_init(&c->base) < 0)
 		goto err_display;
 
 	create_border(c);
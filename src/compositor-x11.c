@@ -48,6 +48,7 @@
 #include <EGL/egl.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
 #include "../shared/config-parser.h"
 
 static char *output_name;
@@ -77,6 +78,7 @@ struct x11_compositor {
 	struct xkb_keymap	*xkb_keymap;
 	unsigned int		 has_xkb;
 	uint8_t			 xkb_event_base;
+	int			 use_pixman;
 	struct {
 		xcb_atom_t		 wm_protocols;
 		xcb_atom_t		 wm_normal_hints;
@@ -101,6 +103,10 @@ struct x11_output {
 	EGLSurface		egl_surface;
 	struct weston_mode	mode;
 	struct wl_event_source *finish_frame_timer;
+
+	xcb_gc_t		gc;
+	uint32_t	       *buf;
+	pixman_image_t	       *hw_surface;
 };
 
 struct x11_input {
@@ -330,27 +336,96 @@ x11_compositor_fini_egl(struct x11_compositor *compositor)
 }
 
 static void
-x11_output_repaint(struct weston_output *output_base,
-		   pixman_region32_t *damage)
+x11_output_repaint_gl(struct weston_output *output_base,
+		      pixman_region32_t *damage)
 {
 	struct x11_output *output = (struct x11_output *)output_base;
-	struct x11_compositor *compositor =
-		(struct x11_compositor *)output->base.compositor;
-	struct weston_surface *surface;
+	struct weston_compositor *ec = output->base.compositor;
 
-	if (!eglMakeCurrent(compositor->base.egl_display, output->egl_surface,
-			    output->egl_surface,
-			    compositor->base.egl_context)) {
+	if (!eglMakeCurrent(ec->egl_display, output->egl_surface,
+			    output->egl_surface, ec->egl_context)) {
 		weston_log("failed to make current\n");
 		return;
 	}
 
-	wl_list_for_each_reverse(surface, &compositor->base.surface_list, link)
-		weston_surface_draw(surface, &output->base, damage);
+	ec->renderer->repaint_output(output_base, damage);
 
-	wl_signal_emit(&output->base.frame_signal, output);
+	eglSwapBuffers(ec->egl_display, output->egl_surface);
 
-	eglSwapBuffers(compositor->base.egl_display, output->egl_surface);
+	wl_event_source_timer_update(output->finish_frame_timer, 10);
+}
+
+static void
+x11_output_put_image(struct x11_output *output, pixman_region32_t *damage)
+{
+	struct x11_compositor *c =
+		(struct x11_compositor *)output->base.compositor;
+	pixman_region32_t region;
+	pixman_box32_t *rects;
+	uint32_t *data, max_pixels;
+	int i, j, n, x, y, width, height, rows, stride;
+
+	pixman_region32_init(&region);
+	pixman_region32_intersect(&region, damage, &output->base.region);
+	pixman_region32_translate(&region, -output->base.x, -output->base.y);
+
+	/* Request length is in 4 byte units and put_image has a 24 byte
+	 * header; split rectangles into pieces that fit, columns first
+	 * if a single row doesn't. */
+	max_pixels = xcb_get_maximum_request_length(c->conn) - 6;
+	stride = output->base.current->width;
+	if (max_pixels > (uint32_t) stride * output->base.current->height)
+		max_pixels = stride * output->base.current->height;
+
+	data = malloc(max_pixels * 4);
+	if (data == NULL) {
+		pixman_region32_fini(&region);
+		return;
+	}
+
+	rects = pixman_region32_rectangles(&region, &n);
+	for (i = 0; i < n; i++) {
+		for (x = rects[i].x1; x < rects[i].x2; x += width) {
+			width = rects[i].x2 - x;
+			if ((uint32_t) width > max_pixels)
+				width = max_pixels;
+			height = rects[i].y2 - rects[i].y1;
+			rows = max_pixels / width;
+
+			for (y = 0; y < height; y += rows) {
+				if (rows > height - y)
+					rows = height - y;
+				for (j = 0; j < rows; j++)
+					memcpy(data + j * width,
+					       output->buf +
+					       (rects[i].y1 + y + j) * stride +
+					       x, width * 4);
+
+				xcb_put_image(c->conn,
+					      XCB_IMAGE_FORMAT_Z_PIXMAP,
+					      output->window, output->gc,
+					      width, rows,
+					      x, rects[i].y1 + y,
+					      0, 24, width * rows * 4,
+					      (uint8_t *) data);
+			}
+		}
+	}
+
+	free(data);
+	pixman_region32_fini(&region);
+	xcb_flush(c->conn);
+}
+
+static void
+x11_output_repaint_shm(struct weston_output *output_base,
+		       pixman_region32_t *damage)
+{
+	struct x11_output *output = (struct x11_output *)output_base;
+	struct weston_compositor *ec = output->base.compositor;
+
+	ec->renderer->repaint_output(output_base, damage);
+	x11_output_put_image(output, damage);
 
 	wl_event_source_timer_update(output->finish_frame_timer, 10);
 }
@@ -379,7 +454,16 @@ x11_output_destroy(struct weston_output *output_base)
 	wl_list_remove(&output->base.link);
 	wl_event_source_remove(output->finish_frame_timer);
 
-	eglDestroySurface(compositor->base.egl_display, output->egl_surface);
+	if (compositor->use_pixman) {
+		pixman_renderer_output_destroy(output_base);
+		pixman_image_unref(output->hw_surface);
+		free(output->buf);
+		xcb_free_gc(compositor->conn, output->gc);
+	} else {
+		gles2_renderer_output_destroy(output_base);
+		eglDestroySurface(compositor->base.egl_display,
+				  output->egl_surface);
+	}
 
 	xcb_destroy_window(compositor->conn, output->window);
 
@@ -482,6 +566,41 @@ x11_output_set_icon(struct x11_compositor *c,
 	pixman_image_unref(image);
 }
 
+static int
+x11_output_init_shm(struct x11_compositor *c, struct x11_output *output,
+		    int width, int height)
+{
+	if (c->screen->root_depth != 24) {
+		weston_log("pixman renderer needs a depth 24 screen\n");
+		return -1;
+	}
+
+	output->buf = malloc(width * height * 4);
+	if (output->buf == NULL)
+		return -1;
+
+	output->hw_surface =
+		pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+					 output->buf, width * 4);
+	if (output->hw_surface == NULL)
+		goto err_buf;
+
+	if (pixman_renderer_output_create(&output->base) < 0)
+		goto err_image;
+	pixman_renderer_output_set_buffer(&output->base, output->hw_surface);
+
+	output->gc = xcb_generate_id(c->conn);
+	xcb_create_gc(c->conn, output->gc, output->window, 0, NULL);
+
+	return 0;
+
+err_image:
+	pixman_image_unref(output->hw_surface);
+err_buf:
+	free(output->buf);
+	return -1;
+}
+
 static int
 x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 			     int width, int height, int fullscreen,
@@ -577,17 +696,27 @@ x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 		x11_output_change_state(output, 1,
 					c->atom.net_wm_state_fullscreen);
 
-	output->egl_surface = 
-		eglCreateWindowSurface(c->base.egl_display, c->base.egl_config,
-				       output->window, NULL);
-	if (!output->egl_surface) {
-		weston_log("failed to create window surface\n");
-		return -1;
-	}
-	if (!eglMakeCurrent(c->base.egl_display, output->egl_surface,
-			    output->egl_surface, c->base.egl_context)) {
-		weston_log("failed to make surface current\n");
-		return -1;
+	if (c->use_pixman) {
+		if (x11_output_init_shm(c, output, width, height) < 0)
+			return -1;
+	} else {
+		output->egl_surface = 
+			eglCreateWindowSurface(c->base.egl_display,
+					       c->base.egl_config,
+					       output->window, NULL);
+		if (!output->egl_surface) {
+			weston_log("failed to create window surface\n");
+			return -1;
+		}
+		if (!eglMakeCurrent(c->base.egl_display, output->egl_surface,
+				    output->egl_surface,
+				    c->base.egl_context)) {
+			weston_log("failed to make surface current\n");
+			return -1;
+		}
+		if (gles2_renderer_output_create(&output->base,
+						 output->egl_surface) < 0)
+			return -1;
 	}
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
@@ -595,7 +724,10 @@ x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
 	output->base.origin = output->base.current;
-	output->base.repaint = x11_output_repaint;
+	if (c->use_pixman)
+		output->base.repaint = x11_output_repaint_shm;
+	else
+		output->base.repaint = x11_output_repaint_gl;
 	output->base.destroy = x11_output_destroy;
 	output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
@@ -1065,7 +1197,8 @@ x11_destroy(struct weston_compositor *ec)
 
 	weston_compositor_shutdown(ec); /* destroys outputs, too */
 
-	x11_compositor_fini_egl(compositor);
+	if (!compositor->use_pixman)
+		x11_compositor_fini_egl(compositor);
 
 	XCloseDisplay(compositor->dpy);
 	free(ec);
@@ -1075,6 +1208,7 @@ static struct weston_compositor *
 x11_compositor_create(struct wl_display *display,
 		      int fullscreen,
 		      int no_input,
+		      int use_pixman,
 		      int argc, char *argv[], const char *config_file)
 {
 	static const char name[] = "Weston Compositor";
@@ -1114,15 +1248,20 @@ x11_compositor_create(struct wl_display *display,
 	x11_compositor_get_resources(c);
 
 	c->base.wl_display = display;
-	if (x11_compositor_init_egl(c) < 0)
-		goto err_xdisplay;
+	c->use_pixman = use_pixman;
+	if (c->use_pixman) {
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_xdisplay;
+	} else {
+		if (x11_compositor_init_egl(c) < 0)
+			goto err_xdisplay;
+		if (gles2_renderer_init(&c->base) < 0)
+			goto err_egl;
+	}
 
 	c->base.destroy = x11_destroy;
 	c->base.restore = x11_restore;
 
-	if (weston_compositor_init_gl(&c->base) < 0)
-		goto err_egl;
-
 	if (x11_input_create(c, no_input) < 0)
 		goto err_egl;
 
@@ -1165,7 +1304,10 @@ x11_compositor_create(struct wl_display *display,
 err_x11_input:
 	x11_input_destroy(c);
 err_egl:
-	x11_compositor_fini_egl(c);
+	if (c->base.renderer)
+		c->base.renderer->destroy(&c->base);
+	if (!c->use_pixman)
+		x11_compositor_fini_egl(c);
 err_xdisplay:
 	XCloseDisplay(c->dpy);
 err_free:
@@ -1214,6 +1356,7 @@ backend_init(struct wl_display *display, int argc, char *argv[],
 {
 	int fullscreen = 0;
 	int no_input = 0;
+	int use_pixman = 0;
 
 	const struct weston_option x11_options[] = {
 		{ WESTON_OPTION_INTEGER, "width", 0, &option_width },
@@ -1221,6 +1364,7 @@ backend_init(struct wl_display *display, int argc, char *argv[],
 		{ WESTON_OPTION_BOOLEAN, "fullscreen", 0, &fullscreen },
 		{ WESTON_OPTION_INTEGER, "output-count", 0, &option_count },
 		{ WESTON_OPTION_BOOLEAN, "no-input", 0, &no_input },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &use_pixman },
 	};
 
 	parse_options(x11_options, ARRAY_LENGTH(x11_options), argc, argv);
@@ -1243,5 +1387,6 @@ backend_init(struct wl_display *display, int argc, char *argv[],
 	return x11_compositor_create(display,
 				     fullscreen,
 				     no_input,
+				     use_pixman,
 				     argc, argv, config_file);
 }
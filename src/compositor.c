@@ -179,22 +179,6 @@ weston_client_launch(struct weston_compositor *compositor,
 	return client;
 }
 
-static void
-update_shm_texture(struct weston_surface *surface);
-
-static void
-surface_handle_buffer_destroy(struct wl_listener *listener, void *data)
-{
-	struct weston_surface *es =
-		container_of(listener, struct weston_surface, 
-			     buffer_destroy_listener);
-
-	if (es->buffer && wl_buffer_is_shm(es->buffer))
-		update_shm_texture(es);
-
-	es->buffer = NULL;
-}
-
 static const pixman_region32_data_t undef_region_data;
 
 static void
@@ -220,6 +204,32 @@ empty_region(pixman_region32_t *region)
 	pixman_region32_init(region);
 }
 
+static void
+surface_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_surface *es =
+		container_of(listener, struct weston_surface, 
+			     buffer_destroy_listener);
+
+	if (es->buffer && wl_buffer_is_shm(es->buffer)) {
+		pixman_region32_union(&es->damage, &es->damage,
+				      &es->upload_damage);
+		es->compositor->renderer->flush_damage(es);
+	}
+	empty_region(&es->upload_damage);
+
+	es->buffer = NULL;
+}
+
+/* Queues the surface to be sorted into the pick grid cells again. */
+static void
+pick_grid_surface_moved(struct weston_surface *surface)
+{
+	if (wl_list_empty(&surface->pick.link))
+		wl_list_insert(&surface->compositor->pick_grid.moved_list,
+			       &surface->pick.link);
+}
+
 WL_EXPORT struct weston_surface *
 weston_surface_create(struct weston_compositor *compositor)
 {
@@ -233,26 +243,30 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	wl_list_init(&surface->link);
 	wl_list_init(&surface->layer_link);
+	wl_list_init(&surface->pick.link);
+	surface->pick.x2 = -1;
+	surface->pick.index = -1;
 
 	surface->surface.resource.client = NULL;
 
 	surface->compositor = compositor;
 	surface->alpha = 1.0;
-	surface->blend = 1;
 	surface->opaque_rect[0] = 0.0;
 	surface->opaque_rect[1] = 0.0;
 	surface->opaque_rect[2] = 0.0;
 	surface->opaque_rect[3] = 0.0;
-	surface->pitch = 1;
 
-	surface->num_textures = 0;
-	surface->num_images = 0;
+	if (compositor->renderer->create_surface(surface) < 0) {
+		free(surface);
+		return NULL;
+	}
 
 	surface->buffer = NULL;
 	surface->output = NULL;
 	surface->plane = &compositor->primary_plane;
 
 	pixman_region32_init(&surface->damage);
+	pixman_region32_init(&surface->upload_damage);
 	pixman_region32_init(&surface->opaque);
 	pixman_region32_init(&surface->clip);
 	undef_region(&surface->input);
@@ -276,11 +290,9 @@ WL_EXPORT void
 weston_surface_set_color(struct weston_surface *surface,
 		 GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
 {
-	surface->color[0] = red;
-	surface->color[1] = green;
-	surface->color[2] = blue;
-	surface->color[3] = alpha;
-	surface->shader = &surface->compositor->solid_shader;
+	surface->compositor->renderer->surface_set_color(surface,
+							 red, green, blue,
+							 alpha);
 }
 
 WL_EXPORT void
@@ -455,6 +467,9 @@ weston_surface_update_transform(struct weston_surface *surface)
 			weston_surface_update_transform_disable(surface);
 	}
 
+	surface->transform.serial++;
+	pick_grid_surface_moved(surface);
+
 	weston_surface_damage_below(surface);
 
 	if (weston_surface_is_mapped(surface))
@@ -476,9 +491,10 @@ weston_surface_to_global_fixed(struct weston_surface *surface,
 	*y = wl_fixed_from_double(yf);
 }
 
-static void
-surface_from_global_float(struct weston_surface *surface,
-			  GLfloat x, GLfloat y, GLfloat *sx, GLfloat *sy)
+WL_EXPORT void
+weston_surface_from_global_float(struct weston_surface *surface,
+				 GLfloat x, GLfloat y,
+				 GLfloat *sx, GLfloat *sy)
 {
 	if (surface->transform.enabled) {
 		struct weston_vector v = { { x, y, 0.0f, 1.0f } };
@@ -509,7 +525,7 @@ weston_surface_from_global_fixed(struct weston_surface *surface,
 {
 	GLfloat sxf, syf;
 
-	surface_from_global_float(surface,
+	weston_surface_from_global_float(surface,
 	                          wl_fixed_to_double(x),
 				  wl_fixed_to_double(y),
 				  &sxf, &syf);
@@ -523,7 +539,7 @@ weston_surface_from_global(struct weston_surface *surface,
 {
 	GLfloat sxf, syf;
 
-	surface_from_global_float(surface, x, y, &sxf, &syf);
+	weston_surface_from_global_float(surface, x, y, &sxf, &syf);
 	*sx = floorf(sxf);
 	*sy = floorf(syf);
 }
@@ -557,6 +573,7 @@ weston_surface_configure(struct weston_surface *surface,
 	surface->geometry.width = width;
 	surface->geometry.height = height;
 	surface->geometry.dirty = 1;
+	pick_grid_surface_moved(surface);
 }
 
 WL_EXPORT void
@@ -566,6 +583,7 @@ weston_surface_set_position(struct weston_surface *surface,
 	surface->geometry.x = x;
 	surface->geometry.y = y;
 	surface->geometry.dirty = 1;
+	pick_grid_surface_moved(surface);
 }
 
 WL_EXPORT int
@@ -587,22 +605,259 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static void
+pick_grid_release(struct weston_compositor *compositor)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(compositor->pick_grid.cells); i++)
+		wl_array_release(&compositor->pick_grid.cells[i]);
+}
+
+/* Lists the surface in the cells box overlaps, behind the surfaces
+ * above it in surface_list. */
+static int
+pick_grid_add(struct weston_compositor *compositor,
+	      struct weston_surface *surface, pixman_box32_t *box)
+{
+	struct weston_surface **p, **begin;
+	struct wl_array *cell;
+	pixman_box32_t *extents = &compositor->pick_grid.extents;
+	int32_t cw = compositor->pick_grid.cell_width;
+	int32_t ch = compositor->pick_grid.cell_height;
+	int32_t x1, y1, x2, y2, cx, cy;
+
+	x1 = box->x1 > extents->x1 ? box->x1 : extents->x1;
+	y1 = box->y1 > extents->y1 ? box->y1 : extents->y1;
+	x2 = box->x2 < extents->x2 ? box->x2 : extents->x2;
+	y2 = box->y2 < extents->y2 ? box->y2 : extents->y2;
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	surface->pick.x1 = (x1 - extents->x1) / cw;
+	surface->pick.y1 = (y1 - extents->y1) / ch;
+	surface->pick.x2 = (x2 - 1 - extents->x1) / cw;
+	surface->pick.y2 = (y2 - 1 - extents->y1) / ch;
+
+	for (cy = surface->pick.y1; cy <= surface->pick.y2; cy++)
+		for (cx = surface->pick.x1; cx <= surface->pick.x2; cx++) {
+			cell = &compositor->pick_grid.cells[
+				cy * WESTON_PICK_GRID_SIZE + cx];
+			if (!wl_array_add(cell, sizeof *p))
+				return -1;
+
+			begin = cell->data;
+			p = begin + cell->size / sizeof *p - 1;
+			while (p > begin &&
+			       p[-1]->pick.index > surface->pick.index) {
+				p[0] = p[-1];
+				p--;
+			}
+			*p = surface;
+		}
+
+	return 0;
+}
+
+static void
+pick_grid_remove(struct weston_compositor *compositor,
+		 struct weston_surface *surface)
+{
+	struct weston_surface **p, **end;
+	struct wl_array *cell;
+	int32_t cx, cy;
+
+	for (cy = surface->pick.y1; cy <= surface->pick.y2; cy++)
+		for (cx = surface->pick.x1; cx <= surface->pick.x2; cx++) {
+			cell = &compositor->pick_grid.cells[
+				cy * WESTON_PICK_GRID_SIZE + cx];
+			end = (struct weston_surface **)
+				((char *) cell->data + cell->size);
+			for (p = cell->data; p < end; p++)
+				if (*p == surface)
+					break;
+			if (p == end)
+				continue;
+
+			memmove(p, p + 1, (char *) end - (char *) (p + 1));
+			cell->size -= sizeof *p;
+		}
+
+	surface->pick.x1 = 0;
+	surface->pick.x2 = -1;
+}
+
+/* Sorts the surface into the cells by the global bounding box of its
+ * input region.  Cursors and drag icons take no input and stay out of
+ * the grid.  A surface with a pending geometry change has no
+ * trustworthy bounding box yet, so it goes into every cell until its
+ * transform is updated. */
+static int
+pick_grid_insert(struct weston_compositor *compositor,
+		 struct weston_surface *surface)
+{
+	pixman_region32_t region;
+	pixman_box32_t *box;
+	int ret;
+
+	surface->pick.generation = compositor->pick_grid.generation;
+	surface->pick.x1 = 0;
+	surface->pick.x2 = -1;
+
+	if (region_is_undefined(&surface->input) ||
+	    !pixman_region32_not_empty(&surface->input))
+		return 0;
+
+	if (surface->geometry.dirty)
+		return pick_grid_add(compositor, surface,
+				     &compositor->pick_grid.extents);
+
+	box = pixman_region32_extents(&surface->input);
+	surface_compute_bbox(surface, box->x1, box->y1,
+			     box->x2 - box->x1, box->y2 - box->y1, &region);
+	ret = pick_grid_add(compositor, surface,
+			    pixman_region32_extents(&region));
+	pixman_region32_fini(&region);
+
+	return ret;
+}
+
+/* The grid covers the union of all outputs. */
+static void
+pick_grid_rebuild(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+	struct weston_surface *surface, *next;
+	pixman_region32_t region;
+	pixman_box32_t *all;
+	int32_t width, height;
+	unsigned int i;
+	int index = 0;
+
+	compositor->pick_grid.dirty = 0;
+	compositor->pick_grid.generation++;
+	for (i = 0; i < ARRAY_LENGTH(compositor->pick_grid.cells); i++)
+		compositor->pick_grid.cells[i].size = 0;
+	wl_list_for_each_safe(surface, next,
+			      &compositor->pick_grid.moved_list, pick.link) {
+		wl_list_remove(&surface->pick.link);
+		wl_list_init(&surface->pick.link);
+	}
+
+	pixman_region32_init(&region);
+	wl_list_for_each(output, &compositor->output_list, link)
+		pixman_region32_union(&region, &region, &output->region);
+	compositor->pick_grid.extents = *pixman_region32_extents(&region);
+	pixman_region32_fini(&region);
+
+	all = &compositor->pick_grid.extents;
+	width = all->x2 - all->x1;
+	height = all->y2 - all->y1;
+	compositor->pick_grid.cell_width =
+		(width + WESTON_PICK_GRID_SIZE - 1) / WESTON_PICK_GRID_SIZE;
+	compositor->pick_grid.cell_height =
+		(height + WESTON_PICK_GRID_SIZE - 1) / WESTON_PICK_GRID_SIZE;
+	if (width <= 0 || height <= 0) {
+		compositor->pick_grid.cell_width = 0;
+		return;
+	}
+
+	wl_list_for_each(surface, &compositor->surface_list, link) {
+		surface->pick.index = index++;
+		if (pick_grid_insert(compositor, surface) < 0) {
+			/* Out of memory, walk the whole list instead
+			 * and try again on the next pick. */
+			compositor->pick_grid.cell_width = 0;
+			compositor->pick_grid.dirty = 1;
+			return;
+		}
+	}
+	compositor->pick_grid.count = index;
+}
+
+/* Only the surfaces that moved since the last pick are sorted into
+ * their new cells. */
+static void
+pick_grid_update(struct weston_compositor *compositor)
+{
+	struct weston_surface *surface, *next;
+
+	if (compositor->pick_grid.dirty) {
+		pick_grid_rebuild(compositor);
+		return;
+	}
+
+	wl_list_for_each_safe(surface, next,
+			      &compositor->pick_grid.moved_list, pick.link) {
+		wl_list_remove(&surface->pick.link);
+		wl_list_init(&surface->pick.link);
+
+		/* Surfaces not in the grid yet come with the rebuild
+		 * that follows their restacking. */
+		if (surface->pick.generation !=
+		    compositor->pick_grid.generation ||
+		    compositor->pick_grid.cell_width == 0)
+			continue;
+
+		pick_grid_remove(compositor, surface);
+		if (pick_grid_insert(compositor, surface) < 0) {
+			compositor->pick_grid.cell_width = 0;
+			compositor->pick_grid.dirty = 1;
+			return;
+		}
+	}
+}
+
+static int
+pick_surface_at(struct weston_surface *surface,
+		wl_fixed_t x, wl_fixed_t y, wl_fixed_t *sx, wl_fixed_t *sy)
+{
+	weston_surface_from_global_fixed(surface, x, y, sx, sy);
+
+	return pixman_region32_contains_point(&surface->input,
+					      wl_fixed_to_int(*sx),
+					      wl_fixed_to_int(*sy),
+					      NULL);
+}
+
 static struct weston_surface *
 weston_compositor_pick_surface(struct weston_compositor *compositor,
 			       wl_fixed_t x, wl_fixed_t y,
 			       wl_fixed_t *sx, wl_fixed_t *sy)
 {
-	struct weston_surface *surface;
+	struct weston_surface *surface, **s, **end;
+	pixman_box32_t *extents = &compositor->pick_grid.extents;
+	struct wl_array *cell;
+	int32_t ix, iy;
 
-	wl_list_for_each(surface, &compositor->surface_list, link) {
-		weston_surface_from_global_fixed(surface, x, y, sx, sy);
-		if (pixman_region32_contains_point(&surface->input,
-						   wl_fixed_to_int(*sx),
-						   wl_fixed_to_int(*sy),
-						   NULL))
-			return surface;
+	pick_grid_update(compositor);
+
+	ix = floor(wl_fixed_to_double(x));
+	iy = floor(wl_fixed_to_double(y));
+
+	/* Points off the grid, e.g. outside all outputs, fall back to
+	 * the full stacking order walk. */
+	if (compositor->pick_grid.cell_width > 0 &&
+	    compositor->pick_grid.cell_height > 0 &&
+	    ix >= extents->x1 && ix < extents->x2 &&
+	    iy >= extents->y1 && iy < extents->y2) {
+		cell = &compositor->pick_grid.cells[
+			(iy - extents->y1) / compositor->pick_grid.cell_height *
+			WESTON_PICK_GRID_SIZE +
+			(ix - extents->x1) / compositor->pick_grid.cell_width];
+		end = (struct weston_surface **)
+			((char *) cell->data + cell->size);
+		for (s = cell->data; s < end; s++)
+			if (pick_surface_at(*s, x, y, sx, sy))
+				return *s;
+
+		return NULL;
 	}
 
+	wl_list_for_each(surface, &compositor->surface_list, link)
+		if (pick_surface_at(surface, x, y, sx, sy))
+			return surface;
+
 	return NULL;
 }
 
@@ -683,8 +938,6 @@ struct weston_frame_callback {
 static void
 destroy_surface(struct wl_resource *resource)
 {
-	int i;
-
 	struct weston_surface *surface =
 		container_of(resource,
 			     struct weston_surface, surface.resource);
@@ -696,17 +949,17 @@ destroy_surface(struct wl_resource *resource)
 	else if (surface->layer_link.next)
 		wl_list_remove(&surface->layer_link);
 
-	glDeleteTextures(surface->num_textures, surface->textures);
-
 	if (surface->buffer)
 		wl_list_remove(&surface->buffer_destroy_listener.link);
 
-	for (i = 0; i < surface->num_images; i++)
-		compositor->destroy_image(compositor->egl_display,
-					  surface->images[i]);
+	compositor->renderer->destroy_surface(surface);
+	compositor->pick_grid.dirty = 1;
+	wl_list_remove(&surface->pick.link);
 
 	pixman_region32_fini(&surface->transform.boundingbox);
 	pixman_region32_fini(&surface->damage);
+	pixman_region32_fini(&surface->upload_damage);
+	free(surface->tile_hash.hashes);
 	pixman_region32_fini(&surface->opaque);
 	pixman_region32_fini(&surface->clip);
 	if (!region_is_undefined(&surface->input))
@@ -729,258 +982,61 @@ weston_surface_destroy(struct weston_surface *surface)
 	destroy_surface(&surface->surface.resource);
 }
 
-static void
-ensure_textures(struct weston_surface *es, int num_textures)
-{
-	int i;
-
-	if (num_textures <= es->num_textures)
-		return;
-
-	for (i = es->num_textures; i < num_textures; i++) {
-		glGenTextures(1, &es->textures[i]);
-		glBindTexture(GL_TEXTURE_2D, es->textures[i]);
-		glTexParameteri(GL_TEXTURE_2D,
-				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D,
-				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	}
-	es->num_textures = num_textures;
-	glBindTexture(GL_TEXTURE_2D, 0);
-}
-
 static void
 weston_surface_attach(struct wl_surface *surface, struct wl_buffer *buffer)
 {
 	struct weston_surface *es = (struct weston_surface *) surface;
 	struct weston_compositor *ec = es->compositor;
-	EGLint attribs[3], format;
-	int i, num_planes;
+	uint32_t now;
 
 	if (es->buffer) {
-		weston_buffer_post_release(es->buffer);
+		if (!es->buffer_released)
+			weston_buffer_post_release(es->buffer);
 		wl_list_remove(&es->buffer_destroy_listener.link);
 	}
 
 	es->buffer = buffer;
-
-	if (!buffer) {
-		if (weston_surface_is_mapped(es))
-			weston_surface_unmap(es);
-		for (i = 0; i < es->num_images; i++) {
-			ec->destroy_image(ec->egl_display, es->images[i]);
-			es->images[i] = NULL;
-		}
-		es->num_images = 0;
-		glDeleteTextures(es->num_textures, es->textures);
-		es->num_textures = 0;
-		return;
-	}
-
-	buffer->busy_count++;
-	wl_signal_add(&es->buffer->resource.destroy_signal,
-		      &es->buffer_destroy_listener);
-
-	if (es->geometry.width != buffer->width ||
-	    es->geometry.height != buffer->height) {
-		undef_region(&es->input);
-		pixman_region32_fini(&es->opaque);
-		pixman_region32_init(&es->opaque);
-	}
-
-	if (wl_buffer_is_shm(buffer)) {
-		es->pitch = wl_shm_buffer_get_stride(buffer) / 4;
-		es->shader = &ec->texture_shader_rgba;
-
-		ensure_textures(es, 1);
-		glBindTexture(GL_TEXTURE_2D, es->textures[0]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
-			     es->pitch, es->buffer->height, 0,
-			     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
-		if (wl_shm_buffer_get_format(buffer) == WL_SHM_FORMAT_XRGB8888)
-			es->blend = 0;
-		else
-			es->blend = 1;
-	} else if (ec->query_buffer(ec->egl_display, buffer,
-				    EGL_TEXTURE_FORMAT, &format)) {
-		for (i = 0; i < es->num_images; i++)
-			ec->destroy_image(ec->egl_display, es->images[i]);
-		es->num_images = 0;
-
-		switch (format) {
-		case EGL_TEXTURE_RGB:
-		case EGL_TEXTURE_RGBA:
-		default:
-			num_planes = 1;
-			es->shader = &ec->texture_shader_rgba;
-			break;
-		case EGL_TEXTURE_Y_UV_WL:
-			num_planes = 2;
-			es->shader = &ec->texture_shader_y_uv;
-			break;
-		case EGL_TEXTURE_Y_U_V_WL:
-			num_planes = 3;
-			es->shader = &ec->texture_shader_y_u_v;
-			break;
-		case EGL_TEXTURE_Y_XUXV_WL:
-			num_planes = 2;
-			es->shader = &ec->texture_shader_y_xuxv;
-			break;
-		}
-
-		ensure_textures(es, num_planes);
-		for (i = 0; i < num_planes; i++) {
-			attribs[0] = EGL_WAYLAND_PLANE_WL;
-			attribs[1] = i;
-			attribs[2] = EGL_NONE;
-			es->images[i] = ec->create_image(ec->egl_display,
-							 NULL,
-							 EGL_WAYLAND_BUFFER_WL,
-							 buffer, attribs);
-			if (!es->images[i])
-				continue;
-			es->num_images++;
-
-			glActiveTexture(GL_TEXTURE0 + i);
-			glBindTexture(GL_TEXTURE_2D, es->textures[i]);
-			ec->image_target_texture_2d(GL_TEXTURE_2D,
-						    es->images[i]);
+	es->buffer_released = 0;
+
+	/* The tile hashes only compare against the same pixel layout.
+	 * The renderers reallocate their copy when it changes, so none
+	 * of the new buffer's damage may be dropped. */
+	if (es->tile_hash.hashes &&
+	    (buffer == NULL || !wl_buffer_is_shm(buffer) ||
+	     wl_shm_buffer_get_format(buffer) != es->tile_hash.format ||
+	     wl_shm_buffer_get_stride(buffer) != es->tile_hash.stride ||
+	     buffer->width != es->tile_hash.buffer_width ||
+	     buffer->height != es->tile_hash.buffer_height)) {
+		free(es->tile_hash.hashes);
+		es->tile_hash.hashes = NULL;
+	}
+
+	if (buffer) {
+		buffer->busy_count++;
+		wl_signal_add(&es->buffer->resource.destroy_signal,
+			      &es->buffer_destroy_listener);
+
+		now = weston_compositor_get_time();
+		if (es->attach_msecs && es->attach_interval)
+			es->attach_interval = (3 * es->attach_interval +
+					       now - es->attach_msecs) / 4;
+		else if (es->attach_msecs)
+			es->attach_interval = now - es->attach_msecs;
+		es->attach_msecs = now;
+
+		if (es->geometry.width != buffer->width ||
+		    es->geometry.height != buffer->height) {
+			undef_region(&es->input);
+			pixman_region32_fini(&es->opaque);
+			pixman_region32_init(&es->opaque);
+			es->opaque_from_client = 0;
 		}
-
-		es->pitch = buffer->width;
 	} else {
-		/* unhandled buffer type */
-	}
-}
-
-static int
-texture_region(struct weston_surface *es, pixman_region32_t *region)
-{
-	struct weston_compositor *ec = es->compositor;
-	GLfloat *v, inv_width, inv_height;
-	GLfloat sx, sy;
-	pixman_box32_t *rectangles;
-	unsigned int *p;
-	int i, n;
-
-	rectangles = pixman_region32_rectangles(region, &n);
-	v = wl_array_add(&ec->vertices, n * 16 * sizeof *v);
-	p = wl_array_add(&ec->indices, n * 6 * sizeof *p);
-	inv_width = 1.0 / es->pitch;
-	inv_height = 1.0 / es->geometry.height;
-
-	for (i = 0; i < n; i++, v += 16, p += 6) {
-		surface_from_global_float(es, rectangles[i].x1,
-					  rectangles[i].y1, &sx, &sy);
-		v[ 0] = rectangles[i].x1;
-		v[ 1] = rectangles[i].y1;
-		v[ 2] = sx * inv_width;
-		v[ 3] = sy * inv_height;
-
-		surface_from_global_float(es, rectangles[i].x1,
-					  rectangles[i].y2, &sx, &sy);
-		v[ 4] = rectangles[i].x1;
-		v[ 5] = rectangles[i].y2;
-		v[ 6] = sx * inv_width;
-		v[ 7] = sy * inv_height;
-
-		surface_from_global_float(es, rectangles[i].x2,
-					  rectangles[i].y1, &sx, &sy);
-		v[ 8] = rectangles[i].x2;
-		v[ 9] = rectangles[i].y1;
-		v[10] = sx * inv_width;
-		v[11] = sy * inv_height;
-
-		surface_from_global_float(es, rectangles[i].x2,
-					  rectangles[i].y2, &sx, &sy);
-		v[12] = rectangles[i].x2;
-		v[13] = rectangles[i].y2;
-		v[14] = sx * inv_width;
-		v[15] = sy * inv_height;
-
-		p[0] = i * 4 + 0;
-		p[1] = i * 4 + 1;
-		p[2] = i * 4 + 2;
-		p[3] = i * 4 + 2;
-		p[4] = i * 4 + 1;
-		p[5] = i * 4 + 3;
-	}
-
-	return n;
-}
-
-WL_EXPORT void
-weston_surface_draw(struct weston_surface *es, struct weston_output *output,
-		    pixman_region32_t *damage)
-{
-	GLfloat surface_rect[4] = { 0.0, 1.0, 0.0, 1.0 };
-	struct weston_compositor *ec = es->compositor;
-	GLfloat *v;
-	pixman_region32_t repaint;
-	GLint filter;
-	int i, n;
-
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &es->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &es->clip);
-
-	if (!pixman_region32_not_empty(&repaint))
-		goto out;
-
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-	if (es->blend || es->alpha < 1.0)
-		glEnable(GL_BLEND);
-	else
-		glDisable(GL_BLEND);
-
-	if (ec->current_shader != es->shader) {
-		glUseProgram(es->shader->program);
-		ec->current_shader = es->shader;
-	}
-
-	glUniformMatrix4fv(es->shader->proj_uniform,
-			   1, GL_FALSE, output->matrix.d);
-	glUniform4fv(es->shader->color_uniform, 1, es->color);
-	glUniform1f(es->shader->alpha_uniform, es->alpha);
-	glUniform1f(es->shader->texwidth_uniform,
-		    (GLfloat)es->geometry.width / es->pitch);
-	if (es->blend)
-		glUniform4fv(es->shader->opaque_uniform, 1, es->opaque_rect);
-	else
-		glUniform4fv(es->shader->opaque_uniform, 1, surface_rect);
-
-	if (es->transform.enabled || output->zoom.active)
-		filter = GL_LINEAR;
-	else
-		filter = GL_NEAREST;
-
-	n = texture_region(es, &repaint);
-
-	for (i = 0; i < es->num_textures; i++) {
-		glUniform1i(es->shader->tex_uniforms[i], i);
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(GL_TEXTURE_2D, es->textures[i]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		if (weston_surface_is_mapped(es))
+			weston_surface_unmap(es);
 	}
 
-	v = ec->vertices.data;
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-
-	glDrawElements(GL_TRIANGLES, n * 6, GL_UNSIGNED_INT, ec->indices.data);
-
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
-
-	ec->vertices.size = 0;
-	ec->indices.size = 0;
-
-out:
-	pixman_region32_fini(&repaint);
+	ec->renderer->attach(es, buffer);
 }
 
 WL_EXPORT void
@@ -1056,49 +1112,68 @@ fade_frame(struct weston_animation *animation,
 	}
 }
 
+/* The renderer has its own copy of the contents, so hand the buffer
+ * back now rather than on the next attach.  Single buffered clients can
+ * then draw the next frame while this one is still on screen. */
 static void
-update_shm_texture(struct weston_surface *surface)
+surface_release_shm_buffer(struct weston_surface *surface)
 {
-#ifdef GL_UNPACK_ROW_LENGTH
-	pixman_box32_t *rectangles;
-	void *data;
-	int i, n;
-#endif
-
-	glBindTexture(GL_TEXTURE_2D, surface->textures[0]);
+	struct wl_buffer *buffer = surface->buffer;
 
-	if (!surface->compositor->has_unpack_subimage) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
-			     surface->pitch, surface->buffer->height, 0,
-			     GL_BGRA_EXT, GL_UNSIGNED_BYTE,
-			     wl_shm_buffer_get_data(surface->buffer));
+	if (surface->buffer_released)
+		return;
 
+	surface->buffer_released = 1;
+	if (--buffer->busy_count > 0)
 		return;
-	}
 
-#ifdef GL_UNPACK_ROW_LENGTH
-	/* Mesa does not define GL_EXT_unpack_subimage */
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, surface->pitch);
-	data = wl_shm_buffer_get_data(surface->buffer);
-	rectangles = pixman_region32_rectangles(&surface->damage, &n);
-	for (i = 0; i < n; i++) {
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS, rectangles[i].x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS, rectangles[i].y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0,
-				rectangles[i].x1, rectangles[i].y1,
-				rectangles[i].x2 - rectangles[i].x1,
-				rectangles[i].y2 - rectangles[i].y1,
-				GL_BGRA_EXT, GL_UNSIGNED_BYTE, data);
-	}
-#endif
+	wl_resource_post_event(&buffer->resource, WL_BUFFER_RELEASE);
+}
+
+static int
+surface_is_occluded(struct weston_surface *surface,
+		    pixman_region32_t *opaque, pixman_region32_t *screen)
+{
+	pixman_region32_t visible;
+	int occluded;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible,
+				  &surface->transform.boundingbox, screen);
+	pixman_region32_subtract(&visible, &visible, opaque);
+	occluded = !pixman_region32_not_empty(&visible);
+	pixman_region32_fini(&visible);
+
+	return occluded;
 }
 
 static void
 surface_accumulate_damage(struct weston_surface *surface,
-			  pixman_region32_t *opaque)
-{
-	if (surface->buffer && wl_buffer_is_shm(surface->buffer))
-		update_shm_texture(surface);
+			  pixman_region32_t *opaque,
+			  pixman_region32_t *screen)
+{
+	struct weston_compositor *ec = surface->compositor;
+
+	surface->occluded = surface_is_occluded(surface, opaque, screen);
+
+	/* Surfaces on other planes are scanned out straight from the
+	 * buffer, so leave the upload pending and keep the buffer until
+	 * they come back to the primary plane. */
+	if (surface->buffer && wl_buffer_is_shm(surface->buffer)) {
+		if (surface->occluded ||
+		    surface->plane != &ec->primary_plane) {
+			pixman_region32_union(&surface->upload_damage,
+					      &surface->upload_damage,
+					      &surface->damage);
+		} else {
+			pixman_region32_union(&surface->damage,
+					      &surface->damage,
+					      &surface->upload_damage);
+			empty_region(&surface->upload_damage);
+			if (ec->renderer->flush_damage(surface))
+				surface_release_shm_buffer(surface);
+		}
+	}
 
 	if (surface->transform.enabled) {
 		pixman_box32_t *extents;
@@ -1125,26 +1200,33 @@ surface_accumulate_damage(struct weston_surface *surface,
 	pixman_region32_union(opaque, opaque, &surface->transform.opaque);
 }
 
+static int
+occluded_frame_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	/* The repaint sends the frame callbacks that are due. */
+	compositor->occluded_frame_pending = 0;
+	weston_compositor_schedule_repaint(compositor);
+
+	return 1;
+}
+
 static void
 weston_output_repaint(struct weston_output *output, uint32_t msecs)
 {
 	struct weston_compositor *ec = output->compositor;
 	struct weston_surface *es;
 	struct weston_layer *layer;
+	struct weston_output *o;
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
-	pixman_region32_t opaque, output_damage;
-	int32_t width, height;
+	pixman_region32_t opaque, screen, output_damage;
+	int deferred = 0, index = 0;
 
 	weston_compositor_update_drag_surfaces(ec);
 
-	width = output->current->width +
-		output->border.left + output->border.right;
-	height = output->current->height +
-		output->border.top + output->border.bottom;
-	glViewport(0, 0, width, height);
-
 	/* Rebuild the surface list and update surface transforms up front. */
 	wl_list_init(&ec->surface_list);
 	wl_list_init(&frame_callback_list);
@@ -1152,13 +1234,18 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 		wl_list_for_each(es, &layer->surface_list, layer_link) {
 			weston_surface_update_transform(es);
 			wl_list_insert(ec->surface_list.prev, &es->link);
-			if (es->output == output) {
-				wl_list_insert_list(&frame_callback_list,
-						    &es->frame_callback_list);
-				wl_list_init(&es->frame_callback_list);
-			}
+
+			/* The pick grid is only rebuilt when the
+			 * stacking order changed. */
+			if (es->pick.index != index ||
+			    es->pick.generation != ec->pick_grid.generation)
+				ec->pick_grid.dirty = 1;
+			es->pick.index = index++;
 		}
 	}
+	if (index != ec->pick_grid.count)
+		ec->pick_grid.dirty = 1;
+	ec->pick_grid.count = index;
 
 	if (output->assign_planes && !output->disable_planes)
 		output->assign_planes(output);
@@ -1168,17 +1255,47 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 
 
 	pixman_region32_init(&opaque);
+	pixman_region32_init(&screen);
+	wl_list_for_each(o, &ec->output_list, link)
+		pixman_region32_union(&screen, &screen, &o->region);
 
 	wl_list_for_each(es, &ec->surface_list, link)
-		surface_accumulate_damage(es, &opaque);
+		surface_accumulate_damage(es, &opaque, &screen);
+
+	pixman_region32_fini(&screen);
+
+	/* Hold back the frame callbacks of surfaces nobody can see, so
+	 * clients in the background do not render at full rate.  They
+	 * still get one every WESTON_OCCLUDED_FRAME_INTERVAL ms. */
+	wl_list_for_each(es, &ec->surface_list, link) {
+		if (es->output != output ||
+		    wl_list_empty(&es->frame_callback_list))
+			continue;
+
+		if (es->occluded &&
+		    msecs - es->frame_msecs < WESTON_OCCLUDED_FRAME_INTERVAL) {
+			deferred = 1;
+			continue;
+		}
+
+		es->frame_msecs = msecs;
+		wl_list_insert_list(&frame_callback_list,
+				    &es->frame_callback_list);
+		wl_list_init(&es->frame_callback_list);
+	}
+
+	if (deferred && !ec->occluded_frame_pending) {
+		wl_event_source_timer_update(ec->occluded_frame_source,
+					     WESTON_OCCLUDED_FRAME_INTERVAL);
+		ec->occluded_frame_pending = 1;
+	}
 
+	/* Only the damage of this frame; backends with more than one
+	 * buffer add the damage the back buffer missed. */
 	pixman_region32_init(&output_damage);
-	pixman_region32_union(&output_damage, &ec->primary_plane.damage,
-			      &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage,
-			     &ec->primary_plane.damage);
 	pixman_region32_intersect(&output_damage,
-				  &output_damage, &output->region);
+				  &ec->primary_plane.damage, &output->region);
+	pixman_region32_copy(&output->previous_damage, &output_damage);
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, &output->region);
 
@@ -1218,17 +1335,50 @@ weston_compositor_read_input(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
-WL_EXPORT void
-weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
+/* How long to wait after the vblank at msecs before repainting, so
+ * that the repaint starts repaint_msec before the next vblank. */
+static int32_t
+weston_output_repaint_delay(struct weston_output *output, uint32_t msecs)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int32_t refresh_msec, since_vblank, delay;
+
+	if (compositor->repaint_msec <= 0 || output->current->refresh <= 0)
+		return 0;
+
+	refresh_msec = 1000000 / output->current->refresh;
+
+	/* Backends may time stamp frames with a different clock.  If
+	 * the stamp is not from within the last refresh period, assume
+	 * the vblank just happened. */
+	since_vblank = (int32_t) (weston_compositor_get_time() - msecs);
+	if (since_vblank < 0 || since_vblank > refresh_msec)
+		since_vblank = 0;
+
+	delay = refresh_msec - compositor->repaint_msec - since_vblank;
+
+	return delay > 0 ? delay : 0;
+}
+
+static void
+output_finish_frame(struct weston_output *output, uint32_t msecs,
+		    int use_repaint_window)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct wl_event_loop *loop =
 		wl_display_get_event_loop(compositor->wl_display);
+	int32_t delay;
 	int fd;
 
 	output->frame_time = msecs;
 	if (output->repaint_needed) {
-		weston_output_repaint(output, msecs);
+		delay = use_repaint_window ?
+			weston_output_repaint_delay(output, msecs) : 0;
+		if (delay > 0)
+			wl_event_source_timer_update(output->repaint_timer,
+						     delay);
+		else
+			weston_output_repaint(output, msecs);
 		return;
 	}
 
@@ -1242,12 +1392,34 @@ weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
 				     weston_compositor_read_input, compositor);
 }
 
+WL_EXPORT void
+weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
+{
+	output_finish_frame(output, msecs, 1);
+}
+
+static int
+output_repaint_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+
+	/* Input that arrived during the repaint window makes it into
+	 * this frame rather than the next one. */
+	wl_event_loop_dispatch(compositor->input_loop, 0);
+
+	weston_output_repaint(output, output->frame_time);
+
+	return 1;
+}
+
 static void
 idle_repaint(void *data)
 {
 	struct weston_output *output = data;
 
-	weston_output_finish_frame(output, weston_compositor_get_time());
+	/* Nothing is being displayed, there is no vblank to wait for. */
+	output_finish_frame(output, weston_compositor_get_time(), 0);
 }
 
 WL_EXPORT void
@@ -1405,6 +1577,101 @@ weston_surface_assign_output(struct weston_surface *es)
 	weston_surface_update_output_mask(es, mask);
 }
 
+/* wl_shm only checks stride * height against the pool, the chroma
+ * planes of the planar formats follow beyond that.  They are rounded
+ * up for odd sizes, as the renderers read them. */
+static uint64_t
+shm_buffer_size(uint32_t format, int32_t stride, int32_t height)
+{
+	uint64_t size = (uint64_t) stride * height;
+
+	switch (format) {
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	case WL_SHM_FORMAT_NV12:
+	case WL_SHM_FORMAT_YUV420:
+		return size + (uint64_t) (stride + 1) / 2 * 2 *
+			((height + 1) / 2);
+#endif
+	default:
+		return size;
+	}
+}
+
+/* The pool of an shm buffer is mapped on its own, so the end of the
+ * mapping holding its data bounds what the buffer can cover. */
+static int
+shm_mapping_end(void *data, uintptr_t *end)
+{
+	unsigned long start, stop;
+	char line[256];
+	int line_start = 1, found = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL)
+		return -1;
+
+	while (!found && fgets(line, sizeof line, fp)) {
+		if (line_start &&
+		    sscanf(line, "%lx-%lx", &start, &stop) == 2 &&
+		    start <= (uintptr_t) data && (uintptr_t) data < stop) {
+			*end = stop;
+			found = 1;
+		}
+		line_start = strchr(line, '\n') != NULL;
+	}
+
+	fclose(fp);
+
+	return found ? 0 : -1;
+}
+
+static void
+shm_planes_checked_destroy(struct wl_listener *listener, void *data)
+{
+	free(listener);
+}
+
+/* Returns 0 if the buffer holds all the planes of its format.  The
+ * planar formats are looked up once per buffer, the mark is a
+ * listener on the buffer. */
+static int
+shm_buffer_check_planes(struct wl_buffer *buffer)
+{
+	struct wl_listener *checked;
+	void *data = wl_shm_buffer_get_data(buffer);
+	int32_t stride = wl_shm_buffer_get_stride(buffer);
+	uint32_t format = wl_shm_buffer_get_format(buffer);
+	uint64_t size;
+	uintptr_t end;
+
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	/* The gles2 renderer samples YUYV rows again as RGBA texels. */
+	if (format == WL_SHM_FORMAT_YUYV && stride % 4 != 0)
+		return -1;
+#endif
+
+	size = shm_buffer_size(format, stride, buffer->height);
+	if (size == (uint64_t) stride * buffer->height)
+		return 0;
+
+	if (wl_signal_get(&buffer->resource.destroy_signal,
+			  shm_planes_checked_destroy))
+		return 0;
+
+	if (shm_mapping_end(data, &end) < 0 ||
+	    end - (uintptr_t) data < size)
+		return -1;
+
+	checked = malloc(sizeof *checked);
+	if (checked) {
+		checked->notify = shm_planes_checked_destroy;
+		wl_signal_add(&buffer->resource.destroy_signal, checked);
+	}
+
+	return 0;
+}
+
 static void
 surface_attach(struct wl_client *client,
 	       struct wl_resource *resource,
@@ -1416,12 +1683,309 @@ surface_attach(struct wl_client *client,
 	if (buffer_resource)
 		buffer = buffer_resource->data;
 
+	if (buffer && wl_buffer_is_shm(buffer) &&
+	    shm_buffer_check_planes(buffer) < 0) {
+		wl_resource_post_error(buffer_resource,
+				       WL_DISPLAY_ERROR_INVALID_OBJECT,
+				       "shm buffer does not hold its planes");
+		return;
+	}
+
 	weston_surface_attach(&es->surface, buffer);
 
 	if (buffer && es->configure)
 		es->configure(es, sx, sy);
 }
 
+/* Runs of opaque pixels shorter than this are left out of the opaque
+ * region, they cost more in region complexity than they save. */
+#define OPAQUE_SCAN_MIN_RUN 16
+#define OPAQUE_SCAN_MAX_BACKOFF 64
+
+static int
+add_opaque_run(struct wl_array *boxes, int32_t x1, int32_t x2, int32_t y)
+{
+	pixman_box32_t *b;
+
+	if (x2 - x1 < OPAQUE_SCAN_MIN_RUN)
+		return 0;
+
+	b = wl_array_add(boxes, sizeof *b);
+	if (b == NULL)
+		return -1;
+
+	b->x1 = x1;
+	b->y1 = y;
+	b->x2 = x2;
+	b->y2 = y + 1;
+
+	return 0;
+}
+
+/* Collect the runs of pixels with full alpha in rect of an ARGB8888
+ * buffer.  Rows are and'ed together first, a loop the compiler can
+ * vectorize, so fully opaque rows are not looked at pixel by pixel. */
+static void
+scan_opaque_rect(struct wl_buffer *buffer, pixman_box32_t *rect,
+		 pixman_region32_t *opaque)
+{
+	uint32_t *data = wl_shm_buffer_get_data(buffer);
+	int32_t stride = wl_shm_buffer_get_stride(buffer) / 4;
+	struct wl_array boxes;
+	uint32_t *row, acc;
+	int32_t x, y, start;
+
+	wl_array_init(&boxes);
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		row = data + y * stride;
+
+		acc = 0xff000000;
+		for (x = rect->x1; x < rect->x2; x++)
+			acc &= row[x];
+
+		if (acc == 0xff000000) {
+			if (add_opaque_run(&boxes, rect->x1, rect->x2, y) < 0)
+				goto out;
+			continue;
+		}
+
+		start = -1;
+		for (x = rect->x1; x < rect->x2; x++) {
+			if ((row[x] >> 24) == 0xff) {
+				if (start < 0)
+					start = x;
+			} else if (start >= 0) {
+				if (add_opaque_run(&boxes, start, x, y) < 0)
+					goto out;
+				start = -1;
+			}
+		}
+		if (start >= 0 && add_opaque_run(&boxes, start, x, y) < 0)
+			goto out;
+	}
+
+	pixman_region32_fini(opaque);
+	pixman_region32_init_rects(opaque, boxes.data,
+				   boxes.size / sizeof(pixman_box32_t));
+out:
+	wl_array_release(&boxes);
+}
+
+/* Update the opaque region of an ARGB8888 shm surface for the damaged
+ * rectangle.  The rectangle is dropped from the region first, so when
+ * a scan is skipped the region only shrinks. */
+static void
+surface_detect_opaque(struct weston_surface *es,
+		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct wl_buffer *buffer = es->buffer;
+	pixman_region32_t opaque, found;
+	pixman_box32_t rect;
+
+	if (es->opaque_from_client || buffer == NULL ||
+	    !wl_buffer_is_shm(buffer) ||
+	    wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_ARGB8888)
+		return;
+
+	rect.x1 = x > 0 ? x : 0;
+	rect.y1 = y > 0 ? y : 0;
+	rect.x2 = x + width < buffer->width ? x + width : buffer->width;
+	rect.y2 = y + height < buffer->height ? y + height : buffer->height;
+	if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+		return;
+
+	pixman_region32_init_rect(&found, rect.x1, rect.y1,
+				  rect.x2 - rect.x1, rect.y2 - rect.y1);
+	pixman_region32_init(&opaque);
+	pixman_region32_subtract(&opaque, &es->opaque, &found);
+	empty_region(&found);
+
+	/* A released buffer may already be reused by the client. */
+	if (es->opaque_scan.skip > 0) {
+		es->opaque_scan.skip--;
+	} else if (!es->buffer_released) {
+		scan_opaque_rect(buffer, &rect, &found);
+		if (pixman_region32_not_empty(&found)) {
+			pixman_region32_union(&opaque, &opaque, &found);
+			es->opaque_scan.backoff = 0;
+		} else {
+			es->opaque_scan.backoff = es->opaque_scan.backoff ?
+				es->opaque_scan.backoff * 2 : 1;
+			if (es->opaque_scan.backoff > OPAQUE_SCAN_MAX_BACKOFF)
+				es->opaque_scan.backoff =
+					OPAQUE_SCAN_MAX_BACKOFF;
+			es->opaque_scan.skip = es->opaque_scan.backoff;
+		}
+	}
+
+	/* Recomputing the transform damages the whole surface, so only
+	 * do it when the region really changed. */
+	if (!pixman_region32_equal(&opaque, &es->opaque)) {
+		pixman_region32_copy(&es->opaque, &opaque);
+		es->geometry.dirty = 1;
+	}
+
+	pixman_region32_fini(&found);
+	pixman_region32_fini(&opaque);
+}
+
+#define DAMAGE_TILE_SIZE 32
+#define DAMAGE_TILE_MAX_BACKOFF 64
+
+/* FNV-1a over four interleaved lanes, so the compiler can vectorize
+ * the inner loop, folded into 64 bits at the end.  Never returns 0. */
+static uint64_t
+hash_tile(uint32_t *data, int32_t stride, pixman_box32_t *box)
+{
+	uint32_t lane[4] = {
+		2166136261u, 2166136261u, 2166136261u, 2166136261u
+	};
+	uint32_t *row;
+	uint64_t hash = 14695981039346656037ull;
+	int32_t x, y;
+	int i;
+
+	for (y = box->y1; y < box->y2; y++) {
+		row = data + y * stride;
+		for (x = box->x1; x + 4 <= box->x2; x += 4)
+			for (i = 0; i < 4; i++)
+				lane[i] = (lane[i] ^ row[x + i]) * 16777619u;
+		for (; x < box->x2; x++)
+			lane[0] = (lane[0] ^ row[x]) * 16777619u;
+	}
+
+	for (i = 0; i < 4; i++)
+		hash = (hash ^ lane[i]) * 1099511628211ull;
+
+	return hash | 1;
+}
+
+static int
+surface_ensure_tile_hashes(struct weston_surface *es,
+			   struct wl_buffer *buffer)
+{
+	int32_t width, height;
+
+	width = (buffer->width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+	height = (buffer->height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+	if (es->tile_hash.hashes &&
+	    es->tile_hash.width == width && es->tile_hash.height == height)
+		return 0;
+
+	free(es->tile_hash.hashes);
+	es->tile_hash.hashes = calloc(width * height, sizeof(uint64_t));
+	if (es->tile_hash.hashes == NULL)
+		return -1;
+
+	es->tile_hash.width = width;
+	es->tile_hash.height = height;
+	es->tile_hash.format = wl_shm_buffer_get_format(buffer);
+	es->tile_hash.stride = wl_shm_buffer_get_stride(buffer);
+	es->tile_hash.buffer_width = buffer->width;
+	es->tile_hash.buffer_height = buffer->height;
+
+	return 0;
+}
+
+/* Many clients damage the whole surface for every frame, even when
+ * only a cursor blinked.  Hash the shm buffer in tiles and only add the
+ * damaged parts of the tiles that changed to the surface damage. */
+static void
+surface_refine_damage(struct weston_surface *es,
+		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct wl_buffer *buffer = es->buffer;
+	pixman_region32_t damage, changed;
+	pixman_box32_t rect, tile;
+	uint64_t *hash, value;
+	int32_t tx, ty, stride;
+	uint32_t *data;
+	int skip, known = 0, unchanged = 0;
+
+	/* A released buffer may already be reused by the client.  Only
+	 * the 32 bit formats are hashed. */
+	if (buffer == NULL || !wl_buffer_is_shm(buffer) ||
+	    es->buffer_released ||
+	    (wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_ARGB8888 &&
+	     wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_XRGB8888) ||
+	    surface_ensure_tile_hashes(es, buffer) < 0) {
+		free(es->tile_hash.hashes);
+		es->tile_hash.hashes = NULL;
+		pixman_region32_union_rect(&es->damage, &es->damage,
+					   x, y, width, height);
+		return;
+	}
+
+	rect.x1 = x > 0 ? x : 0;
+	rect.y1 = y > 0 ? y : 0;
+	rect.x2 = x + width < buffer->width ? x + width : buffer->width;
+	rect.y2 = y + height < buffer->height ? y + height : buffer->height;
+	if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+		return;
+
+	data = wl_shm_buffer_get_data(buffer);
+	stride = wl_shm_buffer_get_stride(buffer) / 4;
+
+	/* Tiles not hashed while backing off are forgotten. */
+	skip = es->tile_hash.skip > 0;
+	if (skip)
+		es->tile_hash.skip--;
+
+	pixman_region32_init(&changed);
+	for (ty = rect.y1 / DAMAGE_TILE_SIZE;
+	     ty <= (rect.y2 - 1) / DAMAGE_TILE_SIZE; ty++)
+		for (tx = rect.x1 / DAMAGE_TILE_SIZE;
+		     tx <= (rect.x2 - 1) / DAMAGE_TILE_SIZE; tx++) {
+			hash = &es->tile_hash.hashes[ty * es->tile_hash.width + tx];
+			if (skip) {
+				*hash = 0;
+				continue;
+			}
+
+			tile.x1 = tx * DAMAGE_TILE_SIZE;
+			tile.y1 = ty * DAMAGE_TILE_SIZE;
+			tile.x2 = tile.x1 + DAMAGE_TILE_SIZE;
+			tile.y2 = tile.y1 + DAMAGE_TILE_SIZE;
+			if (tile.x2 > buffer->width)
+				tile.x2 = buffer->width;
+			if (tile.y2 > buffer->height)
+				tile.y2 = buffer->height;
+
+			value = hash_tile(data, stride, &tile);
+			if (*hash)
+				known++;
+			if (*hash == value) {
+				unchanged++;
+				continue;
+			}
+
+			*hash = value;
+			pixman_region32_union_rect(&changed, &changed,
+						   tile.x1, tile.y1,
+						   tile.x2 - tile.x1,
+						   tile.y2 - tile.y1);
+		}
+
+	pixman_region32_init_rect(&damage, rect.x1, rect.y1,
+				  rect.x2 - rect.x1, rect.y2 - rect.y1);
+	if (!skip)
+		pixman_region32_intersect(&damage, &damage, &changed);
+	pixman_region32_union(&es->damage, &es->damage, &damage);
+	pixman_region32_fini(&damage);
+	pixman_region32_fini(&changed);
+
+	if (unchanged > 0) {
+		es->tile_hash.backoff = 0;
+	} else if (known > 0) {
+		es->tile_hash.backoff = es->tile_hash.backoff ?
+			es->tile_hash.backoff * 2 : 1;
+		if (es->tile_hash.backoff > DAMAGE_TILE_MAX_BACKOFF)
+			es->tile_hash.backoff = DAMAGE_TILE_MAX_BACKOFF;
+		es->tile_hash.skip = es->tile_hash.backoff;
+	}
+}
+
 static void
 surface_damage(struct wl_client *client,
 	       struct wl_resource *resource,
@@ -1429,8 +1993,15 @@ surface_damage(struct wl_client *client,
 {
 	struct weston_surface *es = resource->data;
 
-	pixman_region32_union_rect(&es->damage, &es->damage,
-				   x, y, width, height);
+	if (es->compositor->refine_damage)
+		surface_refine_damage(es, x, y, width, height);
+	else
+		pixman_region32_union_rect(&es->damage, &es->damage,
+					   x, y, width, height);
+
+	if (es->compositor->detect_opaque)
+		surface_detect_opaque(es, x, y, width, height);
+
 	weston_surface_schedule_repaint(es);
 }
 
@@ -1476,6 +2047,10 @@ surface_set_opaque_region(struct wl_client *client,
 
 	pixman_region32_fini(&surface->opaque);
 
+	/* Only a client that says nothing is opaque still gets the
+	 * opaque region detected. */
+	surface->opaque_from_client = region_resource != NULL;
+
 	if (region_resource) {
 		region = region_resource->data;
 		pixman_region32_init_rect(&surface->opaque, 0, 0,
@@ -1511,6 +2086,7 @@ surface_set_input_region(struct wl_client *client,
 					  surface->geometry.height);
 	}
 
+	pick_grid_surface_moved(surface);
 	weston_surface_schedule_repaint(surface);
 }
 
@@ -1751,8 +2327,8 @@ notify_motion(struct wl_seat *seat, uint32_t time, wl_fixed_t x, wl_fixed_t y)
 	seat->pointer->x = x;
 	seat->pointer->y = y;
 
-	ix = wl_fixed_to_int(x);
-	iy = wl_fixed_to_int(y);
+	ix = floor(wl_fixed_to_double(x));
+	iy = floor(wl_fixed_to_double(y));
 
 	wl_list_for_each(output, &ec->output_list, link)
 		if (output->zoom.active &&
@@ -2276,6 +2852,7 @@ pointer_set_cursor(struct wl_client *client, struct wl_resource *resource,
 	surface->configure = pointer_cursor_surface_configure;
 	surface->private = seat;
 	empty_region(&surface->input);
+	pick_grid_surface_moved(surface);
 
 	seat->sprite = surface;
 	seat->hotspot_x = x;
@@ -2710,6 +3287,7 @@ device_map_drag_surface(struct weston_seat *seat)
 	wl_list_insert(list, &seat->drag_surface->layer_link);
 	weston_surface_assign_output(seat->drag_surface);
 	empty_region(&seat->drag_surface->input);
+	pick_grid_surface_moved(seat->drag_surface);
 }
 
 static  void
@@ -2799,174 +3377,17 @@ bind_output(struct wl_client *client,
 	}
 }
 
-static const char vertex_shader[] =
-	"uniform mat4 proj;\n"
-	"attribute vec2 position;\n"
-	"attribute vec2 texcoord;\n"
-	"varying vec2 v_texcoord;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_Position = proj * vec4(position, 0.0, 1.0);\n"
-	"   v_texcoord = texcoord;\n"
-	"}\n";
-
-/* Declare common fragment shader uniforms */
-#define FRAGMENT_SHADER_UNIFORMS		\
-	"uniform float alpha;\n"		\
-	"uniform float texwidth;\n"		\
-	"uniform vec4 opaque;\n"
-
-/* Common fragment shader init code (check texture bounds) */
-#define FRAGMENT_SHADER_INIT						\
-	"   if (v_texcoord.x < 0.0 || v_texcoord.x > texwidth ||\n"	\
-	"       v_texcoord.y < 0.0 || v_texcoord.y > 1.0)\n"		\
-	"      discard;\n"
-
-#define FRAGMENT_SHADER_EXIT						\
-	"   if (opaque.x <= v_texcoord.x && v_texcoord.x < opaque.y &&\n" \
-	"       opaque.z <= v_texcoord.y && v_texcoord.y < opaque.w)\n"	\
-	"      gl_FragColor.a = 1.0;\n"					\
-	"   gl_FragColor = alpha * gl_FragColor;\n"
-
-#define FRAGMENT_CONVERT_YUV						\
-	"  gl_FragColor.r = y + 1.59602678 * v;\n"			\
-	"  gl_FragColor.g = y - 0.39176229 * u - 0.81296764 * v;\n"	\
-	"  gl_FragColor.b = y + 2.01723214 * u;\n"			\
-	"  gl_FragColor.a = 1.0;\n"
-
-static const char texture_fragment_shader_rgba[] =
-	"precision mediump float;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform sampler2D tex;\n"
-	FRAGMENT_SHADER_UNIFORMS
-	"void main()\n"
-	"{\n"
-	FRAGMENT_SHADER_INIT
-	"   gl_FragColor = texture2D(tex, v_texcoord)\n;"
-	FRAGMENT_SHADER_EXIT
-	"}\n";
-
-static const char texture_fragment_shader_y_uv[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"varying vec2 v_texcoord;\n"
-	FRAGMENT_SHADER_UNIFORMS
-	"void main() {\n"
-	FRAGMENT_SHADER_INIT
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
-	"  float v = texture2D(tex1, v_texcoord).g - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	FRAGMENT_SHADER_EXIT
-	"}\n";
-
-static const char texture_fragment_shader_y_u_v[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"uniform sampler2D tex2;\n"
-	"varying vec2 v_texcoord;\n"
-	FRAGMENT_SHADER_UNIFORMS
-	"void main() {\n"
-	FRAGMENT_SHADER_INIT
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
-	"  float v = texture2D(tex2, v_texcoord).x - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	FRAGMENT_SHADER_EXIT
-	"}\n";
-
-static const char texture_fragment_shader_y_xuxv[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"varying vec2 v_texcoord;\n"
-	FRAGMENT_SHADER_UNIFORMS
-	"void main() {\n"
-	FRAGMENT_SHADER_INIT
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
-	"  float v = texture2D(tex1, v_texcoord).a - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	FRAGMENT_SHADER_EXIT
-	"}\n";
-
-static const char solid_fragment_shader[] =
-	"precision mediump float;\n"
-	"uniform vec4 color;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * color\n;"
-	"}\n";
-
-static int
-compile_shader(GLenum type, const char *source)
-{
-	GLuint s;
-	char msg[512];
-	GLint status;
-
-	s = glCreateShader(type);
-	glShaderSource(s, 1, &source, NULL);
-	glCompileShader(s);
-	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
-	if (!status) {
-		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
-		weston_log("shader info: %s\n", msg);
-		return GL_NONE;
-	}
-
-	return s;
-}
-
-static int
-weston_shader_init(struct weston_shader *shader,
-		   const char *vertex_source, const char *fragment_source)
-{
-	char msg[512];
-	GLint status;
-
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, vertex_source);
-	shader->fragment_shader =
-		compile_shader(GL_FRAGMENT_SHADER, fragment_source);
-
-	shader->program = glCreateProgram();
-	glAttachShader(shader->program, shader->vertex_shader);
-	glAttachShader(shader->program, shader->fragment_shader);
-	glBindAttribLocation(shader->program, 0, "position");
-	glBindAttribLocation(shader->program, 1, "texcoord");
-
-	glLinkProgram(shader->program);
-	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
-	if (!status) {
-		glGetProgramInfoLog(shader->program, sizeof msg, NULL, msg);
-		weston_log("link info: %s\n", msg);
-		return -1;
-	}
-
-	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
-	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
-	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
-	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
-	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
-	shader->color_uniform = glGetUniformLocation(shader->program, "color");
-	shader->texwidth_uniform = glGetUniformLocation(shader->program, "texwidth");
-	shader->opaque_uniform = glGetUniformLocation(shader->program, "opaque");
-
-	return 0;
-}
-
 WL_EXPORT void
 weston_output_destroy(struct weston_output *output)
 {
 	struct weston_compositor *c = output->compositor;
 
+	wl_event_source_remove(output->repaint_timer);
+
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
 	output->compositor->output_id_pool &= ~(1 << output->id);
+	c->pick_grid.dirty = 1;
 
 	wl_display_remove_global(c->wl_display, output->global);
 }
@@ -3014,6 +3435,7 @@ weston_output_move(struct weston_output *output, int x, int y)
 	pixman_region32_init_rect(&output->region, x, y,
 				  output->current->width,
 				  output->current->height);
+	output->compositor->pick_grid.dirty = 1;
 }
 
 WL_EXPORT void
@@ -3041,6 +3463,10 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->resource_list);
 
+	output->repaint_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(c->wl_display),
+					output_repaint_timer_handler, output);
+
 	output->id = ffs(~output->compositor->output_id_pool) - 1;
 	output->compositor->output_id_pool |= 1 << output->id;
 
@@ -3070,60 +3496,6 @@ log_uname(void)
 						usys.version, usys.machine);
 }
 
-static void
-log_extensions(const char *name, const char *extensions)
-{
-	const char *p, *end;
-	int l;
-
-	l = weston_log("%s:", name);
-	p = extensions;
-	while (*p) {
-		end = strchrnul(p, ' ');
-		if (l + (end - p) > 78)
-			l = weston_log_continue("\n" STAMP_SPACE "%.*s",
-						end - p, p);
-		else
-			l += weston_log_continue(" %.*s", end - p, p);
-		for (p = end; isspace(*p); p++)
-			;
-	}
-	weston_log_continue("\n");
-}
-
-static void
-log_egl_gl_info(EGLDisplay egldpy)
-{
-	const char *str;
-
-	str = eglQueryString(egldpy, EGL_VERSION);
-	weston_log("EGL version: %s\n", str ? str : "(null)");
-
-	str = eglQueryString(egldpy, EGL_VENDOR);
-	weston_log("EGL vendor: %s\n", str ? str : "(null)");
-
-	str = eglQueryString(egldpy, EGL_CLIENT_APIS);
-	weston_log("EGL client APIs: %s\n", str ? str : "(null)");
-
-	str = eglQueryString(egldpy, EGL_EXTENSIONS);
-	log_extensions("EGL extensions", str ? str : "(null)");
-
-	str = (char *)glGetString(GL_VERSION);
-	weston_log("GL version: %s\n", str ? str : "(null)");
-
-	str = (char *)glGetString(GL_SHADING_LANGUAGE_VERSION);
-	weston_log("GLSL version: %s\n", str ? str : "(null)");
-
-	str = (char *)glGetString(GL_VENDOR);
-	weston_log("GL vendor: %s\n", str ? str : "(null)");
-
-	str = (char *)glGetString(GL_RENDERER);
-	weston_log("GL renderer: %s\n", str ? str : "(null)");
-
-	str = (char *)glGetString(GL_EXTENSIONS);
-	log_extensions("GL extensions", str ? str : "(null)");
-}
-
 WL_EXPORT int
 weston_compositor_init(struct weston_compositor *ec,
 		       struct wl_display *display,
@@ -3133,6 +3505,7 @@ weston_compositor_init(struct weston_compositor *ec,
 {
 	struct wl_event_loop *loop;
 	struct xkb_rule_names xkb_names;
+	unsigned int i;
         const struct config_key keyboard_config_keys[] = {
 		{ "keymap_rules", CONFIG_KEY_STRING, &xkb_names.rules },
 		{ "keymap_model", CONFIG_KEY_STRING, &xkb_names.model },
@@ -3165,6 +3538,10 @@ weston_compositor_init(struct weston_compositor *ec,
 
 	wl_list_init(&ec->surface_list);
 	wl_list_init(&ec->layer_list);
+	for (i = 0; i < ARRAY_LENGTH(ec->pick_grid.cells); i++)
+		wl_array_init(&ec->pick_grid.cells[i]);
+	wl_list_init(&ec->pick_grid.moved_list);
+	ec->pick_grid.dirty = 1;
 	wl_list_init(&ec->seat_list);
 	wl_list_init(&ec->output_list);
 	wl_list_init(&ec->key_binding_list);
@@ -3174,6 +3551,12 @@ weston_compositor_init(struct weston_compositor *ec,
 
 	weston_plane_init(&ec->primary_plane, 0, 0);
 
+	weston_spring_init(&ec->fade.spring, 30.0, 1.0, 1.0);
+	ec->fade.animation.frame = fade_frame;
+
+	weston_layer_init(&ec->fade_layer, &ec->layer_list);
+	weston_layer_init(&ec->cursor_layer, &ec->fade_layer.link);
+
 	weston_compositor_xkb_init(ec, &xkb_names);
 
 	ec->ping_handler = NULL;
@@ -3185,102 +3568,37 @@ weston_compositor_init(struct weston_compositor *ec,
 	wl_data_device_manager_init(ec->wl_display);
 
 	wl_display_init_shm(display);
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	/* 16 bit formats halve the bytes to upload for clients that do
+	 * not need more. */
+	wl_display_add_shm_format(display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(display, WL_SHM_FORMAT_ARGB4444);
+	wl_display_add_shm_format(display, WL_SHM_FORMAT_XRGB4444);
+	/* Converted to RGB by the renderers, so video players can send
+	 * the decoded frames as they are. */
+	wl_display_add_shm_format(display, WL_SHM_FORMAT_YUYV);
+	wl_display_add_shm_format(display, WL_SHM_FORMAT_NV12);
+	wl_display_add_shm_format(display, WL_SHM_FORMAT_YUV420);
+#endif
 
 	loop = wl_display_get_event_loop(ec->wl_display);
 	ec->idle_source = wl_event_loop_add_timer(loop, idle_handler, ec);
 	wl_event_source_timer_update(ec->idle_source, ec->idle_time * 1000);
+	ec->occluded_frame_source =
+		wl_event_loop_add_timer(loop, occluded_frame_handler, ec);
 
 	ec->input_loop = wl_event_loop_create();
 
 	return 0;
 }
 
-WL_EXPORT int
-weston_compositor_init_gl(struct weston_compositor *ec)
-{
-	const char *extensions;
-
-	log_egl_gl_info(ec->egl_display);
-
-	ec->image_target_texture_2d =
-		(void *) eglGetProcAddress("glEGLImageTargetTexture2DOES");
-	ec->image_target_renderbuffer_storage = (void *)
-		eglGetProcAddress("glEGLImageTargetRenderbufferStorageOES");
-	ec->create_image = (void *) eglGetProcAddress("eglCreateImageKHR");
-	ec->destroy_image = (void *) eglGetProcAddress("eglDestroyImageKHR");
-	ec->bind_display =
-		(void *) eglGetProcAddress("eglBindWaylandDisplayWL");
-	ec->unbind_display =
-		(void *) eglGetProcAddress("eglUnbindWaylandDisplayWL");
-	ec->query_buffer =
-		(void *) eglGetProcAddress("eglQueryWaylandBufferWL");
-
-	extensions = (const char *) glGetString(GL_EXTENSIONS);
-	if (!extensions) {
-		weston_log("Retrieving GL extension string failed.\n");
-		return -1;
-	}
-
-	if (!strstr(extensions, "GL_EXT_texture_format_BGRA8888")) {
-		weston_log("GL_EXT_texture_format_BGRA8888 not available\n");
-		return -1;
-	}
-
-	if (strstr(extensions, "GL_EXT_read_format_bgra"))
-		ec->read_format = GL_BGRA_EXT;
-	else
-		ec->read_format = GL_RGBA;
-
-	if (strstr(extensions, "GL_EXT_unpack_subimage"))
-		ec->has_unpack_subimage = 1;
-
-	extensions =
-		(const char *) eglQueryString(ec->egl_display, EGL_EXTENSIONS);
-	if (!extensions) {
-		weston_log("Retrieving EGL extension string failed.\n");
-		return -1;
-	}
-
-	if (strstr(extensions, "EGL_WL_bind_wayland_display"))
-		ec->has_bind_display = 1;
-	if (ec->has_bind_display)
-		ec->bind_display(ec->egl_display, ec->wl_display);
-
-	weston_spring_init(&ec->fade.spring, 30.0, 1.0, 1.0);
-	ec->fade.animation.frame = fade_frame;
-
-	weston_layer_init(&ec->fade_layer, &ec->layer_list);
-	weston_layer_init(&ec->cursor_layer, &ec->fade_layer.link);
-
-	glActiveTexture(GL_TEXTURE0);
-
-	if (weston_shader_init(&ec->texture_shader_rgba,
-			     vertex_shader, texture_fragment_shader_rgba) < 0)
-		return -1;
-	if (weston_shader_init(&ec->texture_shader_y_uv,
-			       vertex_shader, texture_fragment_shader_y_uv) < 0)
-		return -1;
-	if (weston_shader_init(&ec->texture_shader_y_u_v,
-			       vertex_shader, texture_fragment_shader_y_u_v) < 0)
-		return -1;
-	if (weston_shader_init(&ec->texture_shader_y_xuxv,
-			       vertex_shader, texture_fragment_shader_y_xuxv) < 0)
-		return -1;
-	if (weston_shader_init(&ec->solid_shader,
-			     vertex_shader, solid_fragment_shader) < 0)
-		return -1;
-
-	weston_compositor_schedule_repaint(ec);
-
-	return 0;
-}
-
 WL_EXPORT void
 weston_compositor_shutdown(struct weston_compositor *ec)
 {
 	struct weston_output *output, *next;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->occluded_frame_source);
 	if (ec->input_loop_source)
 		wl_event_source_remove(ec->input_loop_source);
 
@@ -3293,9 +3611,10 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	weston_binding_list_destroy_all(&ec->axis_binding_list);
 
 	weston_plane_release(&ec->primary_plane);
+	pick_grid_release(ec);
 
-	wl_array_release(&ec->vertices);
-	wl_array_release(&ec->indices);
+	if (ec->renderer)
+		ec->renderer->destroy(ec);
 
 	wl_event_loop_destroy(ec->input_loop);
 }
@@ -3424,9 +3743,18 @@ usage(int error_code)
 
 		"Core options:\n\n"
 		"  -B, --backend=MODULE\tBackend module, one of drm-backend.so,\n"
-		"\t\t\t\tx11-backend.so or wayland-backend.so\n"
+		"\t\t\t\tx11-backend.so, wayland-backend.so or\n"
+		"\t\t\t\theadless-backend.so\n"
 		"  -S, --socket=NAME\tName of socket to listen on\n"
 		"  -i, --idle-time=SECS\tIdle time in seconds\n"
+		"  --repaint-window=MS\tRepaint MS milliseconds before the next\n"
+		"\t\t\t\tvblank instead of right after the last one\n"
+		"  --detect-opaque\tFind the opaque areas of ARGB shm buffers\n"
+		"  --refine-damage\tDrop shm damage where nothing changed\n"
+		"  --texture-budget=MB\tEvict textures of idle surfaces above\n"
+		"\t\t\t\tMB megabytes\n"
+		"  --texture-idle-time=S\tConsider surfaces idle after S seconds\n"
+		"\t\t\t\tnot drawn, 10 by default\n"
 		"  --xserver\t\tEnable X server integration\n"
 		"  --module\t\tLoad the specified module\n"
 		"  --log==FILE\t\tLog to the given file\n"
@@ -3437,7 +3765,8 @@ usage(int error_code)
 		"  --connector=ID\tBring up only this connector\n"
 		"  --seat=SEAT\t\tThe seat that weston should run on\n"
 		"  --tty=TTY\t\tThe tty to use\n"
-		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n\n");
+		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n"
+		"  --no-atomic\t\tUse legacy page flips instead of atomic commits\n\n");
 
 	fprintf(stderr,
 		"Options for x11-backend.so:\n\n"
@@ -3445,7 +3774,8 @@ usage(int error_code)
 		"  --height=HEIGHT\tHeight of X window\n"
 		"  --fullscreen\t\tRun in fullscreen mode\n"
 		"  --output-count=COUNT\tCreate multiple outputs\n"
-		"  --no-input\t\tDont create input devices\n\n");
+		"  --no-input\t\tDont create input devices\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n\n");
 
 	fprintf(stderr,
 		"Options for wayland-backend.so:\n\n"
@@ -3453,6 +3783,14 @@ usage(int error_code)
 		"  --height=HEIGHT\tHeight of Wayland surface\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of each output\n"
+		"  --height=HEIGHT\tHeight of each output\n"
+		"  --output-count=COUNT\tCreate multiple outputs\n"
+		"  --refresh=RATE\tRefresh rate in mHz\n"
+		"  --no-input\t\tDont create input devices\n\n");
+
 	exit(error_code);
 }
 
@@ -3475,6 +3813,11 @@ int main(int argc, char *argv[])
 	char *module = NULL;
 	char *log = NULL;
 	int32_t idle_time = 300;
+	int32_t repaint_window = -1, config_repaint_window = 0;
+	int32_t detect_opaque = 0, config_detect_opaque = 0;
+	int32_t refine_damage = 0, config_refine_damage = 0;
+	int32_t texture_budget = -1, config_texture_budget = 0;
+	int32_t texture_idle_time = -1, config_texture_idle_time = 10;
 	int32_t xserver = 0;
 	int32_t help = 0;
 	char *socket_name = NULL;
@@ -3484,15 +3827,32 @@ int main(int argc, char *argv[])
 		{ "type", CONFIG_KEY_STRING, &shell },
 	};
 
+	const struct config_key core_config_keys[] = {
+		{ "repaint-window", CONFIG_KEY_INTEGER, &config_repaint_window },
+		{ "detect-opaque", CONFIG_KEY_BOOLEAN, &config_detect_opaque },
+		{ "refine-damage", CONFIG_KEY_BOOLEAN, &config_refine_damage },
+		{ "texture-budget", CONFIG_KEY_INTEGER, &config_texture_budget },
+		{ "texture-idle-time", CONFIG_KEY_INTEGER,
+		  &config_texture_idle_time },
+	};
+
 	const struct config_section cs[] = {
 		{ "shell",
 		  shell_config_keys, ARRAY_LENGTH(shell_config_keys) },
+		{ "core",
+		  core_config_keys, ARRAY_LENGTH(core_config_keys) },
 	};
 
 	const struct weston_option core_options[] = {
 		{ WESTON_OPTION_STRING, "backend", 'B', &backend },
 		{ WESTON_OPTION_STRING, "socket", 'S', &socket_name },
 		{ WESTON_OPTION_INTEGER, "idle-time", 'i', &idle_time },
+		{ WESTON_OPTION_INTEGER, "repaint-window", 0, &repaint_window },
+		{ WESTON_OPTION_BOOLEAN, "detect-opaque", 0, &detect_opaque },
+		{ WESTON_OPTION_BOOLEAN, "refine-damage", 0, &refine_damage },
+		{ WESTON_OPTION_INTEGER, "texture-budget", 0, &texture_budget },
+		{ WESTON_OPTION_INTEGER, "texture-idle-time", 0,
+		  &texture_idle_time },
 		{ WESTON_OPTION_BOOLEAN, "xserver", 0, &xserver },
 		{ WESTON_OPTION_STRING, "module", 0, &module },
 		{ WESTON_OPTION_STRING, "log", 0, &log },
@@ -3573,6 +3933,21 @@ int main(int argc, char *argv[])
 	ec->option_idle_time = idle_time;
 	ec->idle_time = idle_time;
 
+	if (repaint_window < 0)
+		repaint_window = config_repaint_window;
+	ec->repaint_msec = repaint_window;
+	ec->detect_opaque = detect_opaque || config_detect_opaque;
+	ec->refine_damage = refine_damage || config_refine_damage;
+	if (texture_budget < 0)
+		texture_budget = config_texture_budget;
+	if (texture_idle_time < 0)
+		texture_idle_time = config_texture_idle_time;
+	if (texture_budget > 0 && texture_idle_time >= 0) {
+		ec->texture_budget = texture_budget < 4096 ?
+			(uint32_t) texture_budget << 20 : UINT32_MAX;
+		ec->texture_idle_time = texture_idle_time * 1000;
+	}
+
 	module_init = NULL;
 	if (xserver)
 		module_init = load_module("xwayland.so",
@@ -3617,9 +3992,6 @@ int main(int argc, char *argv[])
 
 	wl_signal_emit(&ec->destroy_signal, ec);
 
-	if (ec->has_bind_display)
-		ec->unbind_display(ec->egl_display, display);
-
 	for (i = ARRAY_LENGTH(signals); i;)
 		wl_event_source_remove(signals[--i]);
 
@@ -161,6 +161,7 @@ struct weston_output {
 	uint32_t flags;
 	int repaint_needed;
 	int repaint_scheduled;
+	struct wl_event_source *repaint_timer;
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -184,6 +185,8 @@ struct weston_output {
 	uint32_t backlight_current;
 	void (*set_backlight)(struct weston_output *output, uint32_t value);
 	void (*set_dpms)(struct weston_output *output, enum dpms_enum level);
+
+	void *renderer_state;
 };
 
 struct weston_xkb_info {
@@ -237,17 +240,6 @@ struct weston_seat {
 	} xkb_state;
 };
 
-struct weston_shader {
-	GLuint program;
-	GLuint vertex_shader, fragment_shader;
-	GLint proj_uniform;
-	GLint tex_uniforms[3];
-	GLint alpha_uniform;
-	GLint color_uniform;
-	GLint texwidth_uniform;
-	GLint opaque_uniform;
-};
-
 enum {
 	WESTON_COMPOSITOR_ACTIVE,
 	WESTON_COMPOSITOR_IDLE,		/* shell->unlock called on activity */
@@ -264,6 +256,31 @@ struct weston_plane {
 	int32_t x, y;
 };
 
+struct weston_renderer {
+	void (*repaint_output)(struct weston_output *output,
+			       pixman_region32_t *output_damage);
+	/* Uploads the damage of an shm buffer.  Returns 1 if the
+	 * renderer keeps a copy of the contents, so that the buffer
+	 * can be released right away. */
+	int (*flush_damage)(struct weston_surface *surface);
+	void (*attach)(struct weston_surface *es, struct wl_buffer *buffer);
+	/* Reads back a rectangle of the output, with the origin in the
+	 * lower left corner and rows bottom up, like glReadPixels. */
+	int (*read_pixels)(struct weston_output *output,
+			   pixman_format_code_t format, void *pixels,
+			   uint32_t x, uint32_t y,
+			   uint32_t width, uint32_t height);
+	int (*create_surface)(struct weston_surface *surface);
+	void (*surface_set_color)(struct weston_surface *surface,
+				  float red, float green,
+				  float blue, float alpha);
+	void (*destroy_surface)(struct weston_surface *surface);
+	void (*destroy)(struct weston_compositor *ec);
+};
+
+#define WESTON_PICK_GRID_SIZE 16
+#define WESTON_OCCLUDED_FRAME_INTERVAL 1000	/* ms */
+
 struct weston_compositor {
 	struct wl_shm *shm;
 	struct wl_signal destroy_signal;
@@ -271,13 +288,6 @@ struct weston_compositor {
 	EGLDisplay egl_display;
 	EGLContext egl_context;
 	EGLConfig egl_config;
-	GLuint fbo;
-	struct weston_shader texture_shader_rgba;
-	struct weston_shader texture_shader_y_uv;
-	struct weston_shader texture_shader_y_u_v;
-	struct weston_shader texture_shader_y_xuxv;
-	struct weston_shader solid_shader;
-	struct weston_shader *current_shader;
 	struct wl_display *wl_display;
 	struct weston_shell_interface shell_interface;
 
@@ -307,6 +317,23 @@ struct weston_compositor {
 	struct wl_list key_binding_list;
 	struct wl_list button_binding_list;
 	struct wl_list axis_binding_list;
+
+	/* Coarse grid over the output area for picking.  Each cell
+	 * lists the surfaces whose input region may overlap it, in
+	 * surface_list order.  Surfaces that moved or changed their
+	 * input region are resorted on the next pick; the grid is only
+	 * rebuilt when dirty, after output or stacking changes. */
+	struct {
+		int dirty;
+		uint32_t generation;	/* bumped on every rebuild */
+		int count;		/* surfaces in surface_list */
+		pixman_box32_t extents;
+		int32_t cell_width, cell_height;
+		struct wl_array cells[WESTON_PICK_GRID_SIZE *
+				      WESTON_PICK_GRID_SIZE];
+		struct wl_list moved_list;
+	} pick_grid;
+
 	struct {
 		struct weston_spring spring;
 		struct weston_animation animation;
@@ -320,24 +347,22 @@ struct weston_compositor {
 	int idle_time;			/* effective timeout, s */
 
 	/* Repaint state. */
-	struct wl_array vertices, indices;
 	struct weston_plane primary_plane;
+	int32_t repaint_msec;		/* repaint this long before vblank,
+					 * 0 to repaint right after it */
+	int detect_opaque;		/* scan shm buffers for opaque areas */
+	int refine_damage;		/* drop unchanged shm damage */
+	uint32_t texture_budget;	/* bytes of shm textures kept for
+					 * idle surfaces, 0 for no limit */
+	uint32_t texture_idle_time;	/* ms undrawn before evictable */
+	struct wl_event_source *occluded_frame_source;
+	int occluded_frame_pending;	/* occluded_frame_source is armed */
 
 	uint32_t focus;
 
-	PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC
-		image_target_renderbuffer_storage;
-	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
-	PFNEGLCREATEIMAGEKHRPROC create_image;
-	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
-
-	int has_unpack_subimage;
-	GLenum read_format;
+	struct weston_renderer *renderer;
 
-	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
-	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
-	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
-	int has_bind_display;
+	pixman_format_code_t read_format;
 
 	void (*destroy)(struct weston_compositor *ec);
 	void (*restore)(struct weston_compositor *ec);
@@ -391,22 +416,28 @@ struct weston_region {
 struct weston_surface {
 	struct wl_surface surface;
 	struct weston_compositor *compositor;
-	GLuint textures[3];
-	int num_textures;
 	pixman_region32_t clip;
 	pixman_region32_t damage;
 	pixman_region32_t opaque;
 	pixman_region32_t input;
-	int32_t pitch;
 	struct wl_list link;
 	struct wl_list layer_link;
-	struct weston_shader *shader;
-	GLfloat color[4];
 	GLfloat opaque_rect[4];
 	GLfloat alpha;
-	int blend;
 	struct weston_plane *plane;
 
+	void *renderer_state;
+
+	/* Where the surface is in compositor::pick_grid.  It is listed
+	 * in cells x1..x2, y1..y2 (none if x1 > x2) when generation
+	 * matches the grid's; index is its position in surface_list. */
+	struct {
+		struct wl_list link;	/* pick_grid.moved_list */
+		int32_t x1, y1, x2, y2;
+		int index;
+		uint32_t generation;
+	} pick;
+
 	/* Surface geometry state, mutable.
 	 * If you change anything, set dirty = 1.
 	 * That includes the transformations referenced from the list.
@@ -436,6 +467,10 @@ struct weston_surface {
 		struct weston_matrix inverse;
 
 		struct weston_transform position; /* matrix from x, y */
+
+		/* Bumped whenever the above is recomputed, so renderers
+		 * can cache state derived from it. */
+		uint32_t serial;
 	} transform;
 
 	/*
@@ -453,11 +488,55 @@ struct weston_surface {
 
 	struct wl_list frame_callback_list;
 
-	EGLImageKHR images[3];
-	int num_images;
+	/*
+	 * Set while the surface is entirely covered by opaque surfaces
+	 * or outside all outputs.  Its frame callbacks are then only
+	 * sent once every WESTON_OCCLUDED_FRAME_INTERVAL ms (frame_msecs
+	 * is when they were last sent) and shm uploads are held back in
+	 * upload_damage until it becomes visible again.
+	 */
+	int occluded;
+	uint32_t frame_msecs;
+	pixman_region32_t upload_damage;
 
 	struct wl_buffer *buffer;
 	struct wl_listener buffer_destroy_listener;
+	int buffer_released;	/* shm buffer already released */
+
+	/*
+	 * When a buffer was last attached and the smoothed interval
+	 * between attaches in ms, 0 until known.  Backends use it to
+	 * find the surfaces that update the most.
+	 */
+	uint32_t attach_msecs;
+	uint32_t attach_interval;
+
+	/*
+	 * Unless the client sets an opaque region, the opaque region of
+	 * ARGB8888 shm buffers is found by scanning the alpha channel of
+	 * the damaged area, see surface_detect_opaque().  After a scan
+	 * finds nothing opaque, the next backoff damage requests are not
+	 * scanned, with backoff doubling each time.
+	 */
+	int opaque_from_client;
+	struct {
+		uint32_t skip, backoff;
+	} opaque_scan;
+
+	/*
+	 * Hashes of the shm buffer contents in DAMAGE_TILE_SIZE tiles,
+	 * 0 if unknown, used to drop the unchanged parts of client
+	 * damage, see surface_refine_damage().  Backs off like
+	 * opaque_scan when the damage turns out to be accurate.
+	 */
+	struct {
+		uint64_t *hashes;
+		int32_t width, height;	/* in tiles */
+		uint32_t format;	/* of the hashed buffer */
+		int32_t stride;
+		int32_t buffer_width, buffer_height;
+		uint32_t skip, backoff;
+	} tile_hash;
 
 	/*
 	 * If non-NULL, this function will be called on surface::attach after
@@ -485,6 +564,9 @@ weston_surface_to_global_float(struct weston_surface *surface,
 			       GLfloat sx, GLfloat sy, GLfloat *x, GLfloat *y);
 
 void
+weston_surface_from_global_float(struct weston_surface *surface,
+				 GLfloat x, GLfloat y, GLfloat *sx, GLfloat *sy);
+void
 weston_surface_from_global(struct weston_surface *surface,
 			   int32_t x, int32_t y, int32_t *sx, int32_t *sy);
 void
@@ -503,9 +585,6 @@ weston_spring_done(struct weston_spring *spring);
 void
 weston_surface_activate(struct weston_surface *surface,
 			struct weston_seat *seat);
-void
-weston_surface_draw(struct weston_surface *es,
-		    struct weston_output *output, pixman_region32_t *damage);
 
 void
 notify_motion(struct wl_seat *seat, uint32_t time,
@@ -668,8 +747,6 @@ weston_compositor_get_time(void);
 int
 weston_compositor_init(struct weston_compositor *ec, struct wl_display *display,
 		       int argc, char *argv[], const char *config_file);
-int
-weston_compositor_init_gl(struct weston_compositor *ec);
 void
 weston_compositor_shutdown(struct weston_compositor *ec);
 void
@@ -788,6 +865,20 @@ weston_surface_set_color(struct weston_surface *surface,
 void
 weston_surface_destroy(struct weston_surface *surface);
 
+int
+gles2_renderer_init(struct weston_compositor *ec);
+int
+gles2_renderer_output_create(struct weston_output *output,
+			     EGLSurface surface);
+void
+gles2_renderer_output_set_surface(struct weston_output *output,
+				  EGLSurface surface);
+void
+gles2_renderer_output_destroy(struct weston_output *output);
+void
+gles2_renderer_set_border(struct weston_compositor *ec,
+			  int32_t width, int32_t height, void *data);
+
 struct weston_compositor *
 backend_init(struct wl_display *display, int argc, char *argv[],
 	     const char *config_file);
@@ -0,0 +1,2927 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "compositor.h"
+
+/* Fragment shader features that can be compiled out when a surface
+ * does not need them. */
+enum gles2_shader_variant {
+	SHADER_ALPHA = 1 << 0,		/* multiply by the surface alpha */
+	SHADER_CLIP = 1 << 1,		/* discard outside the texture */
+	SHADER_OPAQUE = 1 << 2,		/* force alpha to 1.0 */
+	SHADER_OPAQUE_RECT = 1 << 3,	/* force alpha to 1.0 in opaque rect */
+	SHADER_VARIANT_COUNT = 1 << 4
+};
+
+/* Used when no better variant is known, handles any surface. */
+#define SHADER_GENERIC (SHADER_ALPHA | SHADER_CLIP | SHADER_OPAQUE_RECT)
+
+struct gles2_shader {
+	GLuint program;
+	GLuint vertex_shader, fragment_shader;
+	GLint proj_uniform;
+	GLint tex_uniforms[3];
+	GLint alpha_uniform;
+	GLint color_uniform;
+	GLint texwidth_uniform;
+	GLint opaque_uniform;
+
+	/* Set on the generic shader of each kind; variants are
+	 * compiled from the same source the first time they are used. */
+	const char *fragment_source;
+	uint32_t variant_mask;
+	struct gles2_shader *variants[SHADER_VARIANT_COUNT];
+};
+
+/* How an shm format is laid out in textures.  Planes follow each other
+ * in the buffer, except for those that sample the previous plane's
+ * data again with a different texel size.  hsub and vsub are the
+ * number of pixels per texel. */
+struct gles2_shm_format {
+	uint32_t format;
+	int num_planes;
+	struct {
+		GLenum format, type;
+		int hsub, vsub;
+		int same_data;
+	} planes[3];
+};
+
+static const struct gles2_shm_format shm_formats[] = {
+	{ WL_SHM_FORMAT_ARGB8888, 1,
+	  { { GL_BGRA_EXT, GL_UNSIGNED_BYTE, 1, 1, 0 } } },
+	{ WL_SHM_FORMAT_XRGB8888, 1,
+	  { { GL_BGRA_EXT, GL_UNSIGNED_BYTE, 1, 1, 0 } } },
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	{ WL_SHM_FORMAT_RGB565, 1,
+	  { { GL_RGB, GL_UNSIGNED_SHORT_5_6_5, 1, 1, 0 } } },
+	/* Uploaded as RGBA, the shader moves alpha back in place. */
+	{ WL_SHM_FORMAT_ARGB4444, 1,
+	  { { GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, 1, 1, 0 } } },
+	{ WL_SHM_FORMAT_XRGB4444, 1,
+	  { { GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, 1, 1, 0 } } },
+	/* Y from the luminance of the pairs, U and V from green and
+	 * alpha of the quadruples. */
+	{ WL_SHM_FORMAT_YUYV, 2,
+	  { { GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, 1, 1, 0 },
+	    { GL_RGBA, GL_UNSIGNED_BYTE, 2, 1, 1 } } },
+	/* U and V are the luminance and alpha of the chroma plane. */
+	{ WL_SHM_FORMAT_NV12, 2,
+	  { { GL_LUMINANCE, GL_UNSIGNED_BYTE, 1, 1, 0 },
+	    { GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, 2, 2, 0 } } },
+	{ WL_SHM_FORMAT_YUV420, 3,
+	  { { GL_LUMINANCE, GL_UNSIGNED_BYTE, 1, 1, 0 },
+	    { GL_LUMINANCE, GL_UNSIGNED_BYTE, 2, 2, 0 },
+	    { GL_LUMINANCE, GL_UNSIGNED_BYTE, 2, 2, 0 } } },
+#endif
+};
+
+/* Surfaces drawn at half their size or less are drawn from a copy
+ * halved up to this many times. */
+#define REDUCED_MAX_LEVEL 4
+
+/* Small ARGB and XRGB shm surfaces, like cursors, menus and icons, are
+ * packed into shared textures so that they can be drawn together.  A
+ * page is divided into shelves, rows as high as their entries rounded
+ * up to ATLAS_SHELF_ALIGN, filled left to right.  Space freed inside a
+ * shelf is only reused once the shelf is empty or the page repacked. */
+#define ATLAS_SIZE 1024
+#define ATLAS_MAX_ENTRY 128
+#define ATLAS_MAX_PAGES 4
+#define ATLAS_SHELF_ALIGN 8
+
+struct gles2_atlas_shelf {
+	struct wl_list link;
+	int32_t y, height;
+	int32_t next_x;
+	int live; /* entries placed in the shelf */
+};
+
+struct gles2_atlas_page {
+	struct wl_list link;
+	GLuint texture;
+	struct wl_list shelves; /* top to bottom */
+	struct wl_list entries; /* gles2_surface_state::atlas.link */
+	int32_t top; /* first row below the shelves */
+	uint32_t live_area; /* pixels of the entries */
+	GLint filter; /* currently set on the texture */
+};
+
+struct gles2_surface_state {
+	GLfloat color[4];
+	struct gles2_shader *shader;
+
+	GLuint textures[3];
+	int num_textures;
+
+	EGLImageKHR images[3];
+	int num_images;
+
+	int32_t pitch; /* in pixels */
+	int32_t height; /* of the shm texture, 0 if not one */
+	const struct gles2_shm_format *shm_format;
+	uint32_t plane_offset[3]; /* in bytes */
+
+	/* Shm textures count against the compositor's texture_budget.
+	 * Once over it, those of surfaces not drawn for a while are
+	 * evicted, least recently drawn first, and uploaded again from
+	 * the buffer the next time they are drawn.  Atlas pages don't
+	 * count, their entries can't be evicted and there are at most
+	 * ATLAS_MAX_PAGES of them. */
+	struct weston_surface *surface;
+	struct wl_list lru_link; /* gles2_renderer::texture_lru */
+	uint32_t last_drawn;
+	uint32_t texture_bytes;
+	int evicted;
+
+	/* Halved copies of the contents, RGBA and pitch wide like the
+	 * textures, drawn instead of them while the surface is scaled
+	 * down, see update_reduced().  level is the number of halvings
+	 * drawn with, valid the number of copies up to date. */
+	struct {
+		GLuint textures[REDUCED_MAX_LEVEL];
+		int count, valid, level;
+		uint32_t bytes;
+	} reduced;
+
+	/* Set while the contents live in an atlas page instead of
+	 * textures.  The buffer is then kept until the next attach, so
+	 * the entry can be uploaded again when it moves. */
+	struct {
+		struct gles2_atlas_page *page;
+		struct gles2_atlas_shelf *shelf;
+		struct wl_list link;
+		int32_t x, y, width, height;
+	} atlas;
+	int blend;
+	GLint filter; /* currently set on textures, 0 if unknown */
+
+	/* Set while the shm buffer is known to hold a single color.  The
+	 * surface is then drawn with the solid shader and damage is only
+	 * compared, not uploaded, until other pixels show up. */
+	int solid;
+	uint32_t solid_pixel;
+
+	/* Maps global coordinates to texture coordinates as
+	 * s = m[0] * x + m[1] * y + m[2], t = m[3] * x + m[4] * y + m[5].
+	 * Recomputed when the surface transform or the buffer size
+	 * changes; projective transforms fall back to per-vertex
+	 * weston_surface_from_global_float(). */
+	struct {
+		GLfloat m[6];
+		int projective;
+		int valid;
+		uint32_t serial;
+	} texcoord;
+};
+
+/* Everything that goes into a draw call besides the geometry.  Adjacent
+ * draw items with identical state are submitted as a single call. */
+struct gles2_draw_state {
+	struct gles2_shader *shader;
+	GLuint textures[3];
+	int num_textures;
+	GLint filter;
+	int blend;
+	GLfloat color[4];
+	GLfloat alpha;
+	GLfloat texwidth;
+	GLfloat opaque[4];
+};
+
+/* Damage of the frames before the current one, newest first.  A buffer
+ * of age N needs the damage of the N - 1 frames before the current one
+ * repainted, so ages up to BUFFER_DAMAGE_COUNT + 1 are handled without
+ * a full repaint. */
+#define BUFFER_DAMAGE_COUNT 3
+
+struct gles2_output_state {
+	EGLSurface egl_surface;
+	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
+};
+
+struct gles2_draw_item {
+	struct weston_surface *surface;
+	pixman_region32_t repaint;
+	struct gles2_draw_state state;
+	int first, count; /* quads in the frame vertex array */
+};
+
+struct gles2_renderer {
+	struct weston_renderer base;
+
+	struct {
+		GLuint texture;
+		int32_t width, height;
+	} border;
+
+	struct gles2_shader texture_shader_rgba;
+	struct gles2_shader texture_shader_argb4444;
+	struct gles2_shader texture_shader_y_uv;
+	struct gles2_shader texture_shader_y_u_v;
+	struct gles2_shader texture_shader_y_xuxv;
+	struct gles2_shader solid_shader;
+	struct gles2_shader *current_shader;
+
+	struct wl_array vertices, indices;
+	struct wl_array draw_items, draw_order;
+	GLuint bound_textures[3];
+
+	PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC
+		image_target_renderbuffer_storage;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
+	PFNEGLCREATEIMAGEKHRPROC create_image;
+	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+
+	/* Surface states, most recently drawn first. */
+	struct wl_list texture_lru;
+	uint32_t texture_bytes;
+	GLuint reduce_fbo;
+
+	struct wl_list atlas_pages;
+	int atlas_page_count;
+
+	int has_unpack_subimage;
+	int has_egl_buffer_age;
+	int has_depth;
+
+	/* Linked programs are saved here and reused when the driver
+	 * and shader source are unchanged.  dir is NULL if disabled. */
+	struct {
+		PFNGLGETPROGRAMBINARYOESPROC get_binary;
+		PFNGLPROGRAMBINARYOESPROC load_binary;
+		char *dir;
+		uint64_t driver_hash;
+	} program_cache;
+
+	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
+	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
+	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
+	int has_bind_display;
+};
+
+static struct gles2_shader *
+gles2_shader_get_variant(struct gles2_renderer *gr,
+			 struct gles2_shader *shader, uint32_t variant);
+
+static void
+restore_shm_textures(struct weston_surface *surface);
+
+static void
+evict_idle_textures(struct weston_compositor *ec);
+
+static inline struct gles2_renderer *
+get_renderer(struct weston_compositor *ec)
+{
+	return (struct gles2_renderer *) ec->renderer;
+}
+
+static inline struct gles2_surface_state *
+get_surface_state(struct weston_surface *surface)
+{
+	return (struct gles2_surface_state *) surface->renderer_state;
+}
+
+static inline struct gles2_output_state *
+get_output_state(struct weston_output *output)
+{
+	return (struct gles2_output_state *) output->renderer_state;
+}
+
+static void
+update_texcoord_transform(struct weston_surface *es,
+			  struct gles2_surface_state *gs)
+{
+	GLfloat *m = gs->texcoord.m, *d = es->transform.inverse.d;
+	GLfloat inv_width, inv_height, w;
+
+	if (gs->texcoord.valid && gs->texcoord.serial == es->transform.serial)
+		return;
+
+	gs->texcoord.valid = 1;
+	gs->texcoord.serial = es->transform.serial;
+	gs->texcoord.projective = 0;
+
+	/* Atlas entries are only used untransformed. */
+	if (gs->atlas.page) {
+		inv_width = 1.0 / ATLAS_SIZE;
+		inv_height = 1.0 / ATLAS_SIZE;
+		m[0] = inv_width;
+		m[1] = 0;
+		m[2] = (gs->atlas.x - es->geometry.x) * inv_width;
+		m[3] = 0;
+		m[4] = inv_height;
+		m[5] = (gs->atlas.y - es->geometry.y) * inv_height;
+		return;
+	}
+
+	inv_width = 1.0 / gs->pitch;
+	inv_height = 1.0 / es->geometry.height;
+
+	if (!es->transform.enabled) {
+		m[0] = inv_width;
+		m[1] = 0;
+		m[2] = -es->geometry.x * inv_width;
+		m[3] = 0;
+		m[4] = inv_height;
+		m[5] = -es->geometry.y * inv_height;
+	} else if (d[3] == 0.0 && d[7] == 0.0 && fabsf(d[15]) >= 1e-6) {
+		w = 1.0 / d[15];
+		m[0] = d[0] * w * inv_width;
+		m[1] = d[4] * w * inv_width;
+		m[2] = d[12] * w * inv_width;
+		m[3] = d[1] * w * inv_height;
+		m[4] = d[5] * w * inv_height;
+		m[5] = d[13] * w * inv_height;
+	} else {
+		gs->texcoord.projective = 1;
+	}
+}
+
+/* Vertices are x, y, z in global coordinates followed by s, t. */
+static inline void
+texcoord_vertex(struct weston_surface *es, struct gles2_surface_state *gs,
+		GLfloat *v, GLfloat x, GLfloat y, GLfloat z)
+{
+	GLfloat *m = gs->texcoord.m;
+	GLfloat sx, sy;
+
+	v[0] = x;
+	v[1] = y;
+	v[2] = z;
+
+	if (gs->texcoord.projective) {
+		weston_surface_from_global_float(es, x, y, &sx, &sy);
+		v[3] = sx / gs->pitch;
+		v[4] = sy / es->geometry.height;
+	} else {
+		v[3] = m[0] * x + m[1] * y + m[2];
+		v[4] = m[3] * x + m[4] * y + m[5];
+	}
+}
+
+/* The index array only depends on the number of quads, so it is
+ * generated once and grown on demand instead of per draw. */
+static unsigned int *
+quad_indices(struct gles2_renderer *gr, int n)
+{
+	unsigned int *p;
+	int i, have;
+
+	have = gr->indices.size / (6 * sizeof *p);
+	if (have < n) {
+		p = wl_array_add(&gr->indices, (n - have) * 6 * sizeof *p);
+		if (p == NULL)
+			return NULL;
+
+		for (i = have; i < n; i++, p += 6) {
+			p[0] = i * 4 + 0;
+			p[1] = i * 4 + 1;
+			p[2] = i * 4 + 2;
+			p[3] = i * 4 + 2;
+			p[4] = i * 4 + 1;
+			p[5] = i * 4 + 3;
+		}
+	}
+
+	return gr->indices.data;
+}
+
+static int
+texture_region(struct weston_surface *es, pixman_region32_t *region,
+	       GLfloat z)
+{
+	struct gles2_renderer *gr = get_renderer(es->compositor);
+	struct gles2_surface_state *gs = get_surface_state(es);
+	pixman_box32_t *rectangles;
+	GLfloat *v;
+	int i, n;
+
+	update_texcoord_transform(es, gs);
+
+	rectangles = pixman_region32_rectangles(region, &n);
+	v = wl_array_add(&gr->vertices, n * 20 * sizeof *v);
+	if (v == NULL)
+		return 0;
+
+	for (i = 0; i < n; i++, v += 20) {
+		texcoord_vertex(es, gs, &v[0],
+				rectangles[i].x1, rectangles[i].y1, z);
+		texcoord_vertex(es, gs, &v[5],
+				rectangles[i].x1, rectangles[i].y2, z);
+		texcoord_vertex(es, gs, &v[10],
+				rectangles[i].x2, rectangles[i].y1, z);
+		texcoord_vertex(es, gs, &v[15],
+				rectangles[i].x2, rectangles[i].y2, z);
+	}
+
+	return n;
+}
+
+/* A blended surface with an opaque region is drawn as two items, the
+ * opaque part without blending and the rest with it. */
+static int
+prepare_draw_item(struct weston_surface *es, struct weston_output *output,
+		  pixman_region32_t *damage, int opaque_part,
+		  struct gles2_draw_item *item)
+{
+	static const GLfloat surface_rect[4] = { 0.0, 1.0, 0.0, 1.0 };
+	struct gles2_renderer *gr = get_renderer(es->compositor);
+	struct gles2_surface_state *gs = get_surface_state(es);
+	struct gles2_draw_state *state = &item->state;
+	struct gles2_shader *base;
+	uint32_t variant = 0;
+	int i, split, reduced;
+
+	/* transform.opaque is only set for untransformed surfaces with
+	 * full alpha. */
+	split = gs->blend &&
+		pixman_region32_not_empty(&es->transform.opaque);
+	if (opaque_part && !split)
+		return 0;
+
+	pixman_region32_init(&item->repaint);
+	pixman_region32_intersect(&item->repaint,
+				  &es->transform.boundingbox, damage);
+	pixman_region32_subtract(&item->repaint, &item->repaint, &es->clip);
+	if (opaque_part)
+		pixman_region32_intersect(&item->repaint, &item->repaint,
+					  &es->transform.opaque);
+	else if (split)
+		pixman_region32_subtract(&item->repaint, &item->repaint,
+					 &es->transform.opaque);
+
+	if (!pixman_region32_not_empty(&item->repaint)) {
+		pixman_region32_fini(&item->repaint);
+		return 0;
+	}
+
+	item->surface = es;
+
+	/* Only pay per fragment for what this surface needs. */
+	if (es->alpha < 1.0)
+		variant |= SHADER_ALPHA;
+	if (es->transform.enabled)
+		variant |= SHADER_CLIP;
+	if (!gs->blend || opaque_part)
+		variant |= SHADER_OPAQUE;
+	else if (es->opaque_rect[0] < es->opaque_rect[1] &&
+		 es->opaque_rect[2] < es->opaque_rect[3])
+		variant |= SHADER_OPAQUE_RECT;
+
+	/* Zero the padding too, states are compared with memcmp(). */
+	memset(state, 0, sizeof *state);
+	/* The copies go stale when update_reduced() was skipped after new
+	 * contents, the full texture is drawn then. */
+	reduced = gs->reduced.level > 0 &&
+		gs->reduced.valid >= gs->reduced.level;
+	base = reduced ? &gr->texture_shader_rgba : gs->shader;
+	state->shader = gles2_shader_get_variant(gr, base, variant);
+	if (reduced) {
+		state->num_textures = 1;
+		state->textures[0] =
+			gs->reduced.textures[gs->reduced.level - 1];
+	} else if (gs->solid) {
+		/* drawn with the solid shader */
+	} else if (gs->atlas.page) {
+		state->num_textures = 1;
+		state->textures[0] = gs->atlas.page->texture;
+	} else {
+		state->num_textures = gs->num_textures;
+		memcpy(state->textures, gs->textures,
+		       gs->num_textures * sizeof gs->textures[0]);
+	}
+	state->blend = (gs->blend && !opaque_part) || es->alpha < 1.0;
+	if (base == &gr->solid_shader)
+		memcpy(state->color, gs->color, sizeof state->color);
+	state->alpha = es->alpha;
+	state->texwidth = (GLfloat) es->geometry.width / gs->pitch;
+	if (gs->blend && !opaque_part)
+		memcpy(state->opaque, es->opaque_rect, sizeof state->opaque);
+	else
+		memcpy(state->opaque, surface_rect, sizeof state->opaque);
+
+	if (gs->atlas.page && !gs->solid) {
+		state->texwidth = 1.0;
+		for (i = 0; i < 2; i++)
+			state->opaque[i] = (gs->atlas.x +
+					    state->opaque[i] * gs->pitch) /
+				ATLAS_SIZE;
+		for (i = 2; i < 4; i++)
+			state->opaque[i] = (gs->atlas.y +
+					    state->opaque[i] * gs->atlas.height) /
+				ATLAS_SIZE;
+	}
+
+	/* Uniforms the variant does not read are cleared, so that more
+	 * states compare equal and get drawn together.  The generic
+	 * shader, used when a variant failed to build, reads all. */
+	if (state->shader != base) {
+		if (!(variant & base->variant_mask & SHADER_CLIP))
+			state->texwidth = 0.0;
+		if (!(variant & base->variant_mask & SHADER_OPAQUE_RECT))
+			memset(state->opaque, 0, sizeof state->opaque);
+	}
+
+	if (es->transform.enabled || output->zoom.active)
+		state->filter = GL_LINEAR;
+	else
+		state->filter = GL_NEAREST;
+
+	return 1;
+}
+
+static inline int
+same_draw_class(struct gles2_draw_item *a, struct gles2_draw_item *b)
+{
+	return a->state.shader == b->state.shader &&
+		a->state.blend == b->state.blend;
+}
+
+static inline int
+extents_overlap(pixman_box32_t *a, pixman_box32_t *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+		a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/* How far ahead of the next item in stacking order we look for one
+ * that can be hoisted to avoid a state change. */
+#define DRAW_REORDER_WINDOW 32
+
+/* Order the n draw items in pending, given in stacking order, so that
+ * items sharing shader and blend state are drawn back to back.  An item
+ * may only be drawn ahead of items below it in the stacking order if it
+ * does not overlap any of them, so the result is the same as drawing in
+ * stacking order.  pending is used as scratch space. */
+static void
+order_draw_items(struct gles2_draw_item **pending,
+		 struct gles2_draw_item **order, int n)
+{
+	struct gles2_draw_item *last = NULL;
+	pixman_box32_t *a, *b;
+	int i, j, k, pick, left, window;
+
+	for (i = 0, left = n; i < n; i++, left--) {
+		pick = 0;
+		window = left < DRAW_REORDER_WINDOW ? left : DRAW_REORDER_WINDOW;
+		if (last == NULL || same_draw_class(pending[0], last))
+			window = 0;
+
+		for (j = 1; j < window; j++) {
+			if (!same_draw_class(pending[j], last))
+				continue;
+
+			b = pixman_region32_extents(&pending[j]->repaint);
+			for (k = 0; k < j; k++) {
+				a = pixman_region32_extents(&pending[k]->repaint);
+				if (extents_overlap(a, b))
+					break;
+			}
+			if (k == j) {
+				pick = j;
+				break;
+			}
+		}
+
+		order[i] = last = pending[pick];
+		memmove(&pending[pick], &pending[pick + 1],
+			(left - pick - 1) * sizeof *pending);
+	}
+}
+
+static void
+use_draw_state(struct gles2_renderer *gr, struct weston_output *output,
+	       struct gles2_draw_state *state, struct gles2_draw_state *prev,
+	       struct weston_surface *es)
+{
+	struct gles2_surface_state *gs = get_surface_state(es);
+	struct gles2_shader *shader = state->shader;
+	GLint *filter = &gs->filter;
+	int i, all = prev == NULL || prev->shader != shader;
+
+	/* The page texture is shared by all its entries. */
+	if (gs->atlas.page && state->num_textures > 0 &&
+	    state->textures[0] == gs->atlas.page->texture)
+		filter = &gs->atlas.page->filter;
+
+	if (prev == NULL || prev->blend != state->blend) {
+		if (state->blend)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+	}
+
+	if (gr->current_shader != shader) {
+		glUseProgram(shader->program);
+		gr->current_shader = shader;
+	}
+
+	if (all)
+		glUniformMatrix4fv(shader->proj_uniform,
+				   1, GL_FALSE, output->matrix.d);
+	if (all || memcmp(prev->color, state->color, sizeof state->color))
+		glUniform4fv(shader->color_uniform, 1, state->color);
+	if (all || prev->alpha != state->alpha)
+		glUniform1f(shader->alpha_uniform, state->alpha);
+	if (all || prev->texwidth != state->texwidth)
+		glUniform1f(shader->texwidth_uniform, state->texwidth);
+	if (all || memcmp(prev->opaque, state->opaque, sizeof state->opaque))
+		glUniform4fv(shader->opaque_uniform, 1, state->opaque);
+
+	for (i = 0; i < state->num_textures; i++) {
+		if (all)
+			glUniform1i(shader->tex_uniforms[i], i);
+		if (gr->bound_textures[i] != state->textures[i] ||
+		    *filter != state->filter) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, state->textures[i]);
+			gr->bound_textures[i] = state->textures[i];
+		}
+		if (*filter != state->filter) {
+			glTexParameteri(GL_TEXTURE_2D,
+					GL_TEXTURE_MIN_FILTER, state->filter);
+			glTexParameteri(GL_TEXTURE_2D,
+					GL_TEXTURE_MAG_FILTER, state->filter);
+		}
+	}
+	*filter = state->filter;
+}
+
+/* With a depth buffer, the opaque items are drawn first, front to back
+ * with depth writes, so the hardware can reject the fragments they hide
+ * before shading them; even where the clip regions do not catch it, as
+ * under transformed surfaces.  The blended items follow back to front
+ * with depth testing only.  Each item gets a depth by stacking order,
+ * the topmost one nearest. */
+static int
+order_draw_passes(struct gles2_renderer *gr,
+		  struct gles2_draw_item **order, int n)
+{
+	struct gles2_draw_item *items = gr->draw_items.data;
+	struct gles2_draw_item **pending = order + n;
+	int i, opaque = 0, m = 0;
+
+	if (gr->has_depth)
+		for (i = n - 1; i >= 0; i--)
+			if (!items[i].state.blend)
+				order[opaque++] = &items[i];
+
+	for (i = 0; i < n; i++)
+		if (!gr->has_depth || items[i].state.blend)
+			pending[m++] = &items[i];
+
+	order_draw_items(pending, order + opaque, m);
+
+	return opaque;
+}
+
+static struct gles2_atlas_page *
+atlas_page_create(struct gles2_renderer *gr)
+{
+	struct gles2_atlas_page *page;
+
+	page = calloc(1, sizeof *page);
+	if (page == NULL)
+		return NULL;
+
+	glGenTextures(1, &page->texture);
+	glBindTexture(GL_TEXTURE_2D, page->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT, ATLAS_SIZE, ATLAS_SIZE, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+
+	page->filter = GL_NEAREST;
+
+	wl_list_init(&page->shelves);
+	wl_list_init(&page->entries);
+	wl_list_insert(gr->atlas_pages.prev, &page->link);
+	gr->atlas_page_count++;
+
+	return page;
+}
+
+static void
+atlas_page_destroy(struct gles2_renderer *gr, struct gles2_atlas_page *page)
+{
+	struct gles2_atlas_shelf *shelf, *next;
+
+	wl_list_for_each_safe(shelf, next, &page->shelves, link)
+		free(shelf);
+	glDeleteTextures(1, &page->texture);
+	wl_list_remove(&page->link);
+	gr->atlas_page_count--;
+	free(page);
+}
+
+static int
+atlas_page_alloc(struct gles2_atlas_page *page, struct gles2_surface_state *gs,
+		 int32_t width, int32_t height)
+{
+	struct gles2_atlas_shelf *shelf, *found = NULL;
+	int32_t shelf_height;
+
+	shelf_height = (height + ATLAS_SHELF_ALIGN - 1) &
+		~(ATLAS_SHELF_ALIGN - 1);
+
+	wl_list_for_each(shelf, &page->shelves, link)
+		if (shelf->height == shelf_height &&
+		    shelf->next_x + width <= ATLAS_SIZE) {
+			found = shelf;
+			break;
+		}
+
+	if (found == NULL) {
+		if (page->top + shelf_height > ATLAS_SIZE)
+			return -1;
+		found = calloc(1, sizeof *found);
+		if (found == NULL)
+			return -1;
+		found->y = page->top;
+		found->height = shelf_height;
+		wl_list_insert(page->shelves.prev, &found->link);
+		page->top += shelf_height;
+	}
+
+	gs->atlas.page = page;
+	gs->atlas.shelf = found;
+	gs->atlas.x = found->next_x;
+	gs->atlas.y = found->y;
+	gs->atlas.width = width;
+	gs->atlas.height = height;
+	wl_list_insert(&page->entries, &gs->atlas.link);
+	found->next_x += width;
+	found->live++;
+	page->live_area += width * height;
+	gs->texcoord.valid = 0;
+
+	return 0;
+}
+
+/* Takes the entry out of its page, leaving the page in place. */
+static void
+atlas_unlink(struct gles2_surface_state *gs)
+{
+	struct gles2_atlas_page *page = gs->atlas.page;
+	struct gles2_atlas_shelf *shelf = gs->atlas.shelf, *last;
+
+	wl_list_remove(&gs->atlas.link);
+	page->live_area -= gs->atlas.width * gs->atlas.height;
+	gs->atlas.page = NULL;
+	gs->atlas.shelf = NULL;
+	gs->texcoord.valid = 0;
+
+	if (--shelf->live > 0)
+		return;
+
+	shelf->next_x = 0;
+	while (!wl_list_empty(&page->shelves)) {
+		last = container_of(page->shelves.prev,
+				    struct gles2_atlas_shelf, link);
+		if (last->live > 0)
+			break;
+		page->top -= last->height;
+		wl_list_remove(&last->link);
+		free(last);
+	}
+}
+
+static void
+atlas_remove(struct gles2_renderer *gr, struct gles2_surface_state *gs)
+{
+	struct gles2_atlas_page *page = gs->atlas.page;
+
+	if (page == NULL)
+		return;
+
+	atlas_unlink(gs);
+	if (wl_list_empty(&page->entries))
+		atlas_page_destroy(gr, page);
+}
+
+/* Entries that can be uploaded again from their buffer may move, the
+ * solid ones are drawn without their contents anyway. */
+static int
+atlas_entry_movable(struct gles2_surface_state *gs)
+{
+	struct weston_surface *es = gs->surface;
+
+	return gs->solid ||
+		(es->buffer && wl_buffer_is_shm(es->buffer) &&
+		 !es->buffer_released);
+}
+
+static int
+compare_entry_height(const void *a, const void *b)
+{
+	const struct gles2_surface_state *ga =
+		*(struct gles2_surface_state * const *) a;
+	const struct gles2_surface_state *gb =
+		*(struct gles2_surface_state * const *) b;
+
+	return gb->atlas.height - ga->atlas.height;
+}
+
+/* Packs the entries of the page again, tallest first, closing the
+ * holes left by removed ones.  Moved entries are uploaded again before
+ * they are drawn; any that no longer fit go back to textures. */
+static int
+atlas_page_repack(struct gles2_atlas_page *page)
+{
+	struct gles2_surface_state *gs, **entries;
+	struct gles2_atlas_shelf *shelf, *next;
+	int i, n = 0;
+
+	wl_list_for_each(gs, &page->entries, atlas.link) {
+		if (!atlas_entry_movable(gs))
+			return -1;
+		n++;
+	}
+
+	entries = malloc(n * sizeof *entries);
+	if (entries == NULL)
+		return -1;
+
+	i = 0;
+	wl_list_for_each(gs, &page->entries, atlas.link)
+		entries[i++] = gs;
+	qsort(entries, n, sizeof *entries, compare_entry_height);
+
+	wl_list_for_each_safe(shelf, next, &page->shelves, link)
+		free(shelf);
+	wl_list_init(&page->shelves);
+	wl_list_init(&page->entries);
+	page->top = 0;
+	page->live_area = 0;
+
+	for (i = 0; i < n; i++) {
+		gs = entries[i];
+		gs->atlas.page = NULL;
+		gs->texcoord.valid = 0;
+		gs->evicted = 1;
+		atlas_page_alloc(page, gs, gs->atlas.width, gs->atlas.height);
+	}
+	free(entries);
+
+	return 0;
+}
+
+/* Finds room for a width x height entry, in a new page while there
+ * may be more, else in the page with the most room to gain from
+ * repacking. */
+static int
+atlas_place(struct gles2_renderer *gr, struct gles2_surface_state *gs,
+	    int32_t width, int32_t height)
+{
+	struct gles2_atlas_page *page, *worst = NULL;
+	uint32_t waste, worst_waste = 0;
+
+	wl_list_for_each(page, &gr->atlas_pages, link)
+		if (atlas_page_alloc(page, gs, width, height) == 0)
+			return 0;
+
+	if (gr->atlas_page_count < ATLAS_MAX_PAGES) {
+		page = atlas_page_create(gr);
+		if (page == NULL)
+			return -1;
+		if (atlas_page_alloc(page, gs, width, height) == 0)
+			return 0;
+		atlas_page_destroy(gr, page);
+		return -1;
+	}
+
+	wl_list_for_each(page, &gr->atlas_pages, link) {
+		waste = page->top * ATLAS_SIZE - page->live_area;
+		if (waste >= (uint32_t) (width * height) &&
+		    waste > worst_waste) {
+			worst = page;
+			worst_waste = waste;
+		}
+	}
+
+	if (worst == NULL || atlas_page_repack(worst) < 0)
+		return -1;
+
+	return atlas_page_alloc(worst, gs, width, height);
+}
+
+static void
+drop_reduced(struct gles2_renderer *gr, struct gles2_surface_state *gs)
+{
+	glDeleteTextures(gs->reduced.count, gs->reduced.textures);
+	gr->texture_bytes -= gs->reduced.bytes;
+	memset(&gs->reduced, 0, sizeof gs->reduced);
+}
+
+/* The number of halvings that bring the surface back to at least half
+ * its size on screen, 0 if it is not scaled down that far. */
+static int
+reduced_level(struct weston_surface *es)
+{
+	struct gles2_surface_state *gs = get_surface_state(es);
+	GLfloat *d = es->transform.matrix.d;
+	GLfloat scale, sy;
+	int level;
+
+	if (!es->transform.enabled || gs->solid ||
+	    gs->shader == &get_renderer(es->compositor)->solid_shader)
+		return 0;
+
+	/* Projective transforms are left alone. */
+	if (d[3] != 0.0 || d[7] != 0.0 || d[15] != 1.0)
+		return 0;
+
+	scale = sqrtf(d[0] * d[0] + d[1] * d[1]);
+	sy = sqrtf(d[4] * d[4] + d[5] * d[5]);
+	if (sy > scale)
+		scale = sy;
+
+	for (level = 0; scale <= 0.5 && level < REDUCED_MAX_LEVEL; level++)
+		scale *= 2.0;
+
+	return level;
+}
+
+/* Draws copy i from the previous one, or from the surface textures
+ * with its own shader for the first.  Sampling halfway between source
+ * texels averages 2x2 of them. */
+static int
+draw_reduced(struct gles2_renderer *gr, struct weston_surface *es, int i)
+{
+	static const GLfloat identity[16] = {
+		1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1
+	};
+	static const GLfloat quad[20] = {
+		-1, -1, 0, 0, 0,
+		 1, -1, 0, 1, 0,
+		-1,  1, 0, 0, 1,
+		 1,  1, 0, 1, 1
+	};
+	struct gles2_surface_state *gs = get_surface_state(es);
+	struct gles2_shader *shader;
+	GLuint *textures;
+	int32_t width, height;
+	int t, num_textures;
+
+	width = gs->pitch >> (i + 1);
+	height = es->geometry.height >> (i + 1);
+	if (width < 1)
+		width = 1;
+	if (height < 1)
+		height = 1;
+
+	if (i == gs->reduced.count) {
+		glGenTextures(1, &gs->reduced.textures[i]);
+		glBindTexture(GL_TEXTURE_2D, gs->reduced.textures[i]);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+			     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		gs->reduced.count++;
+		gs->reduced.bytes += width * height * 4;
+		gr->texture_bytes += width * height * 4;
+	}
+
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, gs->reduced.textures[i], 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE)
+		return -1;
+
+	if (i == 0) {
+		shader = gles2_shader_get_variant(gr, gs->shader, 0);
+		textures = gs->textures;
+		num_textures = gs->num_textures;
+	} else {
+		shader = gles2_shader_get_variant(gr,
+						  &gr->texture_shader_rgba, 0);
+		textures = &gs->reduced.textures[i - 1];
+		num_textures = 1;
+	}
+
+	glViewport(0, 0, width, height);
+	glUseProgram(shader->program);
+	gr->current_shader = shader;
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, identity);
+
+	for (t = 0; t < num_textures; t++) {
+		glUniform1i(shader->tex_uniforms[t], t);
+		glActiveTexture(GL_TEXTURE0 + t);
+		glBindTexture(GL_TEXTURE_2D, textures[t]);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+	gs->filter = GL_LINEAR;
+
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
+			      5 * sizeof quad[0], &quad[0]);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+			      5 * sizeof quad[0], &quad[3]);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	return 0;
+}
+
+/* Surfaces scaled down to half their size or less, as in zoom and
+ * slide animations, sample a copy halved as many times as it takes to
+ * get close to their size on screen.  The copies are made when first
+ * needed and dropped when the surface is drawn at full size again. */
+static void
+update_reduced(struct weston_output *output, struct weston_surface *es)
+{
+	struct gles2_renderer *gr = get_renderer(output->compositor);
+	struct gles2_surface_state *gs = get_surface_state(es);
+	int i, level;
+
+	level = reduced_level(es);
+	if (level == 0) {
+		if (gs->reduced.count > 0)
+			drop_reduced(gr, gs);
+		return;
+	}
+
+	gs->reduced.level = level;
+	if (gs->reduced.valid >= level)
+		return;
+
+	if (gr->reduce_fbo == 0)
+		glGenFramebuffers(1, &gr->reduce_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, gr->reduce_fbo);
+	glDisable(GL_BLEND);
+
+	for (i = gs->reduced.valid; i < level; i++)
+		if (draw_reduced(gr, es, i) < 0)
+			break;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0,
+		   output->current->width +
+		   output->border.left + output->border.right,
+		   output->current->height +
+		   output->border.top + output->border.bottom);
+
+	if (i < level) {
+		weston_log("reduced surface copy incomplete, "
+			   "drawing at full size\n");
+		drop_reduced(gr, gs);
+		return;
+	}
+
+	gs->reduced.valid = level;
+}
+
+static void
+repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gles2_renderer *gr = get_renderer(compositor);
+	struct gles2_draw_item *item, **order;
+	struct gles2_draw_state *prev = NULL;
+	struct gles2_surface_state *gs;
+	struct weston_surface *surface;
+	unsigned int *p;
+	GLfloat *v, z;
+	uint32_t now = weston_compositor_get_time();
+	int i, run, opaque, n = 0, quads = 0;
+
+	gr->draw_items.size = 0;
+	wl_list_for_each_reverse(surface, &compositor->surface_list, link) {
+		/* Surfaces on the other planes are shown too, and keep
+		 * their textures for when they come back. */
+		gs = get_surface_state(surface);
+		if (!surface->occluded) {
+			gs->last_drawn = now;
+			wl_list_remove(&gs->lru_link);
+			wl_list_insert(&gr->texture_lru, &gs->lru_link);
+		}
+
+		if (surface->plane != &compositor->primary_plane)
+			continue;
+
+		if (!surface->occluded) {
+			/* Atlas entries sample their neighbours when
+			 * filtered, so those surfaces go back to textures. */
+			if (gs->atlas.page && (surface->transform.enabled ||
+					       output->zoom.active)) {
+				atlas_remove(gr, gs);
+				gs->evicted = 1;
+			}
+			if (gs->evicted && !gs->solid && surface->buffer &&
+			    !surface->buffer_released)
+				restore_shm_textures(surface);
+			if (surface->output_mask & (1 << output->id))
+				update_reduced(output, surface);
+		}
+
+		for (i = 0; i < 2; i++) {
+			item = wl_array_add(&gr->draw_items, sizeof *item);
+			if (item == NULL)
+				break;
+			if (prepare_draw_item(surface, output, damage, i, item))
+				n++;
+			else
+				gr->draw_items.size -= sizeof *item;
+		}
+	}
+
+	if (n == 0)
+		return;
+
+	gr->draw_order.size = 0;
+	order = wl_array_add(&gr->draw_order, 2 * n * sizeof *order);
+	if (order == NULL)
+		goto out;
+
+	opaque = order_draw_passes(gr, order, n);
+
+	item = gr->draw_items.data;
+	for (i = 0; i < n; i++) {
+		z = 1.0 - 2.0 * (order[i] - item + 1) / (n + 1);
+		order[i]->first = quads;
+		order[i]->count = texture_region(order[i]->surface,
+						 &order[i]->repaint, z);
+		quads += order[i]->count;
+	}
+
+	p = quad_indices(gr, quads);
+	if (p == NULL)
+		goto out;
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	memset(gr->bound_textures, 0, sizeof gr->bound_textures);
+
+	if (gr->has_depth) {
+		glDepthMask(GL_TRUE);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_LESS);
+	}
+
+	v = gr->vertices.data;
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof *v, &v[0]);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof *v, &v[3]);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	for (i = 0; i < n; i += run) {
+		/* Opaque and blended items never share a run. */
+		if (gr->has_depth && i == opaque)
+			glDepthMask(GL_FALSE);
+
+		item = order[i];
+		use_draw_state(gr, output, &item->state, prev, item->surface);
+		prev = &item->state;
+
+		/* Quads of consecutive items are contiguous, so items
+		 * with identical state share one draw call. */
+		quads = item->count;
+		for (run = 1; i + run < n; run++) {
+			if (memcmp(&order[i + run]->state, prev, sizeof *prev))
+				break;
+			quads += order[i + run]->count;
+		}
+
+		glDrawElements(GL_TRIANGLES, quads * 6, GL_UNSIGNED_INT,
+			       p + item->first * 6);
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	if (gr->has_depth)
+		glDisable(GL_DEPTH_TEST);
+
+out:
+	gr->vertices.size = 0;
+	item = gr->draw_items.data;
+	for (i = 0; i < n; i++)
+		pixman_region32_fini(&item[i].repaint);
+}
+
+static int
+texture_border(struct weston_output *output)
+{
+	struct gles2_renderer *gr = get_renderer(output->compositor);
+	GLfloat *d;
+	int i, j, k, n;
+	GLfloat x[4], y[4], u[4], v[4];
+
+	x[0] = -output->border.left;
+	x[1] = 0;
+	x[2] = output->current->width;
+	x[3] = output->current->width + output->border.right;
+
+	y[0] = -output->border.top;
+	y[1] = 0;
+	y[2] = output->current->height;
+	y[3] = output->current->height + output->border.bottom;
+
+	u[0] = 0.0;
+	u[1] = (GLfloat) output->border.left / gr->border.width;
+	u[2] = (GLfloat) (gr->border.width - output->border.right) /
+		gr->border.width;
+	u[3] = 1.0;
+
+	v[0] = 0.0;
+	v[1] = (GLfloat) output->border.top / gr->border.height;
+	v[2] = (GLfloat) (gr->border.height - output->border.bottom) /
+		gr->border.height;
+	v[3] = 1.0;
+
+	n = 8;
+	d = wl_array_add(&gr->vertices, n * 20 * sizeof *d);
+
+	k = 0;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++) {
+
+			if (i == 1 && j == 1)
+				continue;
+
+			d[ 0] = x[i];
+			d[ 1] = y[j];
+			d[ 2] = 0.0;
+			d[ 3] = u[i];
+			d[ 4] = v[j];
+
+			d[ 5] = x[i];
+			d[ 6] = y[j + 1];
+			d[ 7] = 0.0;
+			d[ 8] = u[i];
+			d[ 9] = v[j + 1];
+
+			d[10] = x[i + 1];
+			d[11] = y[j];
+			d[12] = 0.0;
+			d[13] = u[i + 1];
+			d[14] = v[j];
+
+			d[15] = x[i + 1];
+			d[16] = y[j + 1];
+			d[17] = 0.0;
+			d[18] = u[i + 1];
+			d[19] = v[j + 1];
+
+			d += 20;
+			k += 4;
+		}
+
+	return k / 4;
+}
+
+static void
+draw_border(struct weston_output *output)
+{
+	struct gles2_renderer *gr = get_renderer(output->compositor);
+	struct gles2_shader *shader = &gr->texture_shader_rgba;
+	GLfloat *v;
+	unsigned int *p;
+	int n;
+
+	glDisable(GL_BLEND);
+	glUseProgram(shader->program);
+	gr->current_shader = shader;
+
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, output->matrix.d);
+
+	glUniform1i(shader->tex_uniforms[0], 0);
+	glUniform1f(shader->alpha_uniform, 1);
+	glUniform1f(shader->texwidth_uniform, 1);
+
+	n = texture_border(output);
+	p = quad_indices(gr, n);
+	if (p == NULL) {
+		gr->vertices.size = 0;
+		return;
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, gr->border.texture);
+
+	v = gr->vertices.data;
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof *v, &v[0]);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof *v, &v[3]);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	glDrawElements(GL_TRIANGLES, n * 6, GL_UNSIGNED_INT, p);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	gr->vertices.size = 0;
+}
+
+static int
+query_buffer_age(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gles2_renderer *gr = get_renderer(compositor);
+	struct gles2_output_state *go = get_output_state(output);
+	EGLint buffer_age;
+
+	/* Without the extension, assume plain double buffering. */
+	if (!gr->has_egl_buffer_age)
+		return 2;
+
+	if (!eglQuerySurface(compositor->egl_display, go->egl_surface,
+			     EGL_BUFFER_AGE_EXT, &buffer_age)) {
+		weston_log("buffer age query failed\n");
+		return 0;
+	}
+
+	return buffer_age;
+}
+
+static void
+gles2_renderer_repaint_output(struct weston_output *output,
+			      pixman_region32_t *output_damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gles2_renderer *gr = get_renderer(compositor);
+	struct gles2_output_state *go = get_output_state(output);
+	pixman_region32_t total_damage;
+	int32_t width, height;
+	int i, buffer_age;
+
+	width = output->current->width +
+		output->border.left + output->border.right;
+	height = output->current->height +
+		output->border.top + output->border.bottom;
+	glViewport(0, 0, width, height);
+
+	/* The back buffer is missing the damage of every frame since
+	 * it was last drawn; an age of 0 means undefined contents. */
+	buffer_age = query_buffer_age(output);
+
+	pixman_region32_init(&total_damage);
+	if (buffer_age > 0 && buffer_age - 1 <= BUFFER_DAMAGE_COUNT) {
+		pixman_region32_copy(&total_damage, output_damage);
+		for (i = 0; i < buffer_age - 1; i++)
+			pixman_region32_union(&total_damage, &total_damage,
+					      &go->buffer_damage[i]);
+	} else {
+		pixman_region32_copy(&total_damage, &output->region);
+	}
+
+	pixman_region32_fini(&go->buffer_damage[BUFFER_DAMAGE_COUNT - 1]);
+	memmove(&go->buffer_damage[1], &go->buffer_damage[0],
+		(BUFFER_DAMAGE_COUNT - 1) * sizeof go->buffer_damage[0]);
+	pixman_region32_init(&go->buffer_damage[0]);
+	pixman_region32_copy(&go->buffer_damage[0], output_damage);
+
+	repaint_surfaces(output, &total_damage);
+
+	pixman_region32_fini(&total_damage);
+
+	if (gr->border.texture)
+		draw_border(output);
+
+	evict_idle_textures(compositor);
+
+	wl_signal_emit(&output->frame_signal, output);
+}
+
+static int
+gles2_renderer_read_pixels(struct weston_output *output,
+			   pixman_format_code_t format, void *pixels,
+			   uint32_t x, uint32_t y,
+			   uint32_t width, uint32_t height)
+{
+	GLenum gl_format;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, pixels);
+
+	return 0;
+}
+
+/* The or'ed differences are accumulated over whole rows, a loop the
+ * compiler can vectorize, before checking them. */
+static int
+shm_region_is_pixel(struct weston_surface *surface, int32_t pitch,
+		    pixman_region32_t *region, uint32_t pixel, uint32_t mask)
+{
+	uint32_t *data = wl_shm_buffer_get_data(surface->buffer);
+	uint32_t *row, diff = 0;
+	pixman_box32_t *rectangles;
+	int32_t x, y;
+	int i, n;
+
+	rectangles = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		for (y = rectangles[i].y1; y < rectangles[i].y2; y++) {
+			row = data + y * pitch;
+			for (x = rectangles[i].x1; x < rectangles[i].x2; x++)
+				diff |= row[x] ^ pixel;
+			if (diff & mask)
+				return 0;
+		}
+
+	return 1;
+}
+
+/* Large single color buffers, like backgrounds and fill surfaces, are
+ * drawn like weston_surface_set_color() surfaces instead of uploaded.
+ * Returns 1 if the buffer is solid and there is nothing to upload. */
+static int
+update_solid_color(struct weston_surface *surface)
+{
+	struct gles2_renderer *gr = get_renderer(surface->compositor);
+	struct gles2_surface_state *gs = get_surface_state(surface);
+	struct wl_buffer *buffer = surface->buffer;
+	pixman_region32_t damage;
+	pixman_box32_t *e;
+	uint32_t mask, pixel;
+	int solid, opaque;
+
+	if (gs->shm_format->planes[0].format != GL_BGRA_EXT)
+		return 0;
+
+	opaque = wl_shm_buffer_get_format(buffer) == WL_SHM_FORMAT_XRGB8888;
+	mask = opaque ? 0x00ffffff : 0xffffffff;
+
+	pixman_region32_init_rect(&damage, 0, 0,
+				  buffer->width, buffer->height);
+	pixman_region32_intersect(&damage, &damage, &surface->damage);
+
+	/* Only a redraw of the whole buffer can make it solid. */
+	e = pixman_region32_extents(&damage);
+	if (!gs->solid &&
+	    (pixman_region32_n_rects(&damage) != 1 ||
+	     e->x1 != 0 || e->y1 != 0 ||
+	     e->x2 != buffer->width || e->y2 != buffer->height)) {
+		pixman_region32_fini(&damage);
+		return 0;
+	}
+
+	pixel = gs->solid ?
+		gs->solid_pixel : *(uint32_t *) wl_shm_buffer_get_data(buffer);
+	solid = shm_region_is_pixel(surface, gs->pitch, &damage, pixel, mask);
+	pixman_region32_fini(&damage);
+
+	if (solid) {
+		if (opaque)
+			pixel |= 0xff000000;
+		gs->solid = 1;
+		gs->solid_pixel = pixel;
+		gs->color[0] = ((pixel >> 16) & 0xff) / 255.0;
+		gs->color[1] = ((pixel >> 8) & 0xff) / 255.0;
+		gs->color[2] = (pixel & 0xff) / 255.0;
+		gs->color[3] = (pixel >> 24) / 255.0;
+		gs->shader = &gr->solid_shader;
+		gs->blend = (pixel >> 24) != 0xff;
+		return 1;
+	}
+
+	/* Nothing was uploaded while solid, so upload everything. */
+	if (gs->solid) {
+		gs->solid = 0;
+		gs->shader = &gr->texture_shader_rgba;
+		gs->blend = !opaque;
+		pixman_region32_union_rect(&surface->damage, &surface->damage,
+					   0, 0, buffer->width, buffer->height);
+	}
+
+	return 0;
+}
+
+static int
+gl_format_cpp(GLenum format, GLenum type)
+{
+	if (type != GL_UNSIGNED_BYTE)
+		return 2; /* packed 16 bit texels */
+
+	switch (format) {
+	case GL_LUMINANCE:
+		return 1;
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+static void
+ensure_textures(struct gles2_surface_state *gs, int num_textures)
+{
+	int i;
+
+	if (num_textures <= gs->num_textures)
+		return;
+
+	for (i = gs->num_textures; i < num_textures; i++) {
+		glGenTextures(1, &gs->textures[i]);
+		glBindTexture(GL_TEXTURE_2D, gs->textures[i]);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	gs->num_textures = num_textures;
+	gs->filter = 0;
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static const struct gles2_shm_format *
+lookup_shm_format(uint32_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(shm_formats); i++)
+		if (shm_formats[i].format == format)
+			return &shm_formats[i];
+
+	return NULL;
+}
+
+/* The byte stride of plane p.  Subsampled planes round up, so odd
+ * sized buffers keep their last column of chroma, and planes sampling
+ * the previous plane's data again share its rows.  The compositor
+ * checked on attach that the buffer holds all of them. */
+static int32_t
+shm_plane_stride(struct gles2_surface_state *gs, int p)
+{
+	const struct gles2_shm_format *fmt = gs->shm_format;
+	int hsub = fmt->planes[p].hsub;
+
+	if (p > 0 && fmt->planes[p].same_data)
+		return shm_plane_stride(gs, p - 1);
+
+	return (gs->pitch + hsub - 1) / hsub *
+		gl_format_cpp(fmt->planes[p].format, fmt->planes[p].type);
+}
+
+/* The row length of plane p in texels. */
+static int32_t
+shm_plane_pitch(struct gles2_surface_state *gs, int p)
+{
+	const struct gles2_shm_format *fmt = gs->shm_format;
+
+	return shm_plane_stride(gs, p) /
+		gl_format_cpp(fmt->planes[p].format, fmt->planes[p].type);
+}
+
+static int32_t
+shm_plane_height(struct gles2_surface_state *gs, int p)
+{
+	int vsub = gs->shm_format->planes[p].vsub;
+
+	return (gs->height + vsub - 1) / vsub;
+}
+
+static uint32_t
+shm_plane_bytes(struct gles2_surface_state *gs, int p)
+{
+	return shm_plane_stride(gs, p) * shm_plane_height(gs, p);
+}
+
+/* Allocates the texture of plane p and finds its data in the buffer. */
+static void
+setup_shm_plane(struct gles2_surface_state *gs, int p)
+{
+	const struct gles2_shm_format *fmt = gs->shm_format;
+	int32_t pitch, height;
+
+	pitch = shm_plane_pitch(gs, p);
+	height = shm_plane_height(gs, p);
+
+	if (p == 0)
+		gs->plane_offset[p] = 0;
+	else if (fmt->planes[p].same_data)
+		gs->plane_offset[p] = gs->plane_offset[p - 1];
+	else
+		gs->plane_offset[p] = gs->plane_offset[p - 1] +
+			shm_plane_bytes(gs, p - 1);
+
+	glBindTexture(GL_TEXTURE_2D, gs->textures[p]);
+	glTexImage2D(GL_TEXTURE_2D, 0, fmt->planes[p].format,
+		     pitch, height, 0,
+		     fmt->planes[p].format, fmt->planes[p].type, NULL);
+}
+
+/* Allocates the textures for the shm format and returns their size. */
+static uint32_t
+alloc_shm_textures(struct gles2_surface_state *gs)
+{
+	const struct gles2_shm_format *fmt = gs->shm_format;
+	uint32_t bytes = 0;
+	int p;
+
+	ensure_textures(gs, fmt->num_planes);
+	for (p = 0; p < fmt->num_planes; p++) {
+		setup_shm_plane(gs, p);
+		bytes += shm_plane_bytes(gs, p);
+	}
+
+	return bytes;
+}
+
+static void
+set_texture_bytes(struct gles2_renderer *gr,
+		  struct gles2_surface_state *gs, uint32_t bytes)
+{
+	gr->texture_bytes += bytes - gs->texture_bytes;
+	gs->texture_bytes = bytes;
+}
+
+static void
+upload_atlas(struct weston_surface *surface, pixman_region32_t *region)
+{
+	struct gles2_renderer *gr = get_renderer(surface->compositor);
+	struct gles2_surface_state *gs = get_surface_state(surface);
+	uint32_t *data = wl_shm_buffer_get_data(surface->buffer);
+	pixman_region32_t entry;
+	pixman_box32_t *rectangles, *r;
+	int32_t y;
+	int i, n;
+
+	/* Damage outside the buffer would overwrite other entries. */
+	pixman_region32_init_rect(&entry, 0, 0,
+				  gs->atlas.width, gs->atlas.height);
+	pixman_region32_intersect(&entry, &entry, region);
+
+	glBindTexture(GL_TEXTURE_2D, gs->atlas.page->texture);
+	rectangles = pixman_region32_rectangles(&entry, &n);
+	for (i = 0; i < n; i++) {
+		r = &rectangles[i];
+		if (!gr->has_unpack_subimage) {
+			for (y = r->y1; y < r->y2; y++)
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						gs->atlas.x + r->x1,
+						gs->atlas.y + y,
+						r->x2 - r->x1, 1,
+						GL_BGRA_EXT, GL_UNSIGNED_BYTE,
+						data + y * gs->pitch + r->x1);
+			continue;
+		}
+
+#ifdef GL_UNPACK_ROW_LENGTH
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, gs->pitch);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, r->x1);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, r->y1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0,
+				gs->atlas.x + r->x1, gs->atlas.y + r->y1,
+				r->x2 - r->x1, r->y2 - r->y1,
+				GL_BGRA_EXT, GL_UNSIGNED_BYTE, data);
+#endif
+	}
+	pixman_region32_fini(&entry);
+}
+
+static void
+upload_shm(struct weston_surface *surface, pixman_region32_t *region)
+{
+	struct gles2_renderer *gr = get_renderer(surface->compositor);
+	struct gles2_surface_state *gs = get_surface_state(surface);
+	const struct gles2_shm_format *fmt = gs->shm_format;
+	int32_t pitch, height;
+	uint8_t *data;
+	int p;
+
+#ifdef GL_UNPACK_ROW_LENGTH
+	pixman_box32_t *rectangles, r;
+	int i, n;
+#endif
+
+	gs->reduced.valid = 0;
+
+	if (gs->atlas.page) {
+		upload_atlas(surface, region);
+		return;
+	}
+
+	/* Rows of chroma and 16 bit formats are not necessarily 4 byte
+	 * aligned. */
+	if (fmt->planes[0].format != GL_BGRA_EXT)
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (p = 0; p < fmt->num_planes; p++) {
+		pitch = shm_plane_pitch(gs, p);
+		height = shm_plane_height(gs, p);
+		data = (uint8_t *) wl_shm_buffer_get_data(surface->buffer) +
+			gs->plane_offset[p];
+
+		glBindTexture(GL_TEXTURE_2D, gs->textures[p]);
+
+		if (!gr->has_unpack_subimage) {
+			glTexImage2D(GL_TEXTURE_2D, 0, fmt->planes[p].format,
+				     pitch, height, 0, fmt->planes[p].format,
+				     fmt->planes[p].type, data);
+			continue;
+		}
+
+#ifdef GL_UNPACK_ROW_LENGTH
+		/* Mesa does not define GL_EXT_unpack_subimage */
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch);
+		rectangles = pixman_region32_rectangles(region, &n);
+		for (i = 0; i < n; i++) {
+			/* Subsampled planes get every texel touched by
+			 * the damage. */
+			r.x1 = rectangles[i].x1 / fmt->planes[p].hsub;
+			r.y1 = rectangles[i].y1 / fmt->planes[p].vsub;
+			r.x2 = (rectangles[i].x2 + fmt->planes[p].hsub - 1) /
+				fmt->planes[p].hsub;
+			r.y2 = (rectangles[i].y2 + fmt->planes[p].vsub - 1) /
+				fmt->planes[p].vsub;
+			if (p > 0 && r.x2 > pitch)
+				r.x2 = pitch;
+			if (p > 0 && r.y2 > height)
+				r.y2 = height;
+			if (r.x1 >= r.x2 || r.y1 >= r.y2)
+				continue;
+
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, r.x1);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, r.y1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
+					r.x2 - r.x1, r.y2 - r.y1,
+					fmt->planes[p].format,
+					fmt->planes[p].type, data);
+		}
+#endif
+	}
+
+	if (fmt->planes[0].format != GL_BGRA_EXT)
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+/* Brings back the textures of an evicted surface, with the whole
+ * buffer uploaded. */
+static void
+restore_shm_textures(struct weston_surface *surface)
+{
+	struct gles2_renderer *gr = get_renderer(surface->compositor);
+	struct gles2_surface_state *gs = get_surface_state(surface);
+	struct wl_buffer *buffer = surface->buffer;
+	pixman_region32_t region;
+
+	if (!gs->atlas.page &&
+	    gs->num_textures < gs->shm_format->num_planes)
+		set_texture_bytes(gr, gs, alloc_shm_textures(gs));
+
+	pixman_region32_init_rect(&region, 0, 0,
+				  buffer->width, buffer->height);
+	upload_shm(surface, &region);
+	pixman_region32_fini(&region);
+
+	gs->evicted = 0;
+}
+
+static int
+gles2_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct gles2_surface_state *gs = get_surface_state(surface);
+
+	if (gs->shm_format == NULL)
+		return 0;
+
+	gs->reduced.valid = 0;
+
+	if (update_solid_color(surface))
+		return 1;
+
+	if (gs->evicted)
+		restore_shm_textures(surface);
+	else
+		upload_shm(surface, &surface->damage);
+
+	/* Under a texture budget the buffer is kept, to upload from
+	 * again if the textures get evicted. */
+	return surface->compositor->texture_budget == 0 && !gs->atlas.page;
+}
+
+static void
+evict_textures(struct gles2_renderer *gr, struct gles2_surface_state *gs)
+{
+	drop_reduced(gr, gs);
+	glDeleteTextures(gs->num_textures, gs->textures);
+	gs->num_textures = 0;
+	gs->filter = 0;
+	set_texture_bytes(gr, gs, 0);
+	gs->evicted = 1;
+}
+
+/* Only textures that can be recreated are evicted: solid surfaces
+ * draw without them and shm buffers still held can be read again. */
+static int
+textures_evictable(struct gles2_surface_state *gs)
+{
+	struct wl_buffer *buffer = gs->surface->buffer;
+
+	if (gs->texture_bytes == 0)
+		return 0;
+
+	return gs->solid ||
+		(buffer && wl_buffer_is_shm(buffer) &&
+		 !gs->surface->buffer_released);
+}
+
+static void
+evict_idle_textures(struct weston_compositor *ec)
+{
+	struct gles2_renderer *gr = get_renderer(ec);
+	struct gles2_surface_state *gs;
+	uint32_t now, bytes = 0;
+	int count = 0;
+
+	if (ec->texture_budget == 0 || gr->texture_bytes <= ec->texture_budget)
+		return;
+
+	now = weston_compositor_get_time();
+	wl_list_for_each_reverse(gs, &gr->texture_lru, lru_link) {
+		if (gr->texture_bytes <= ec->texture_budget ||
+		    now - gs->last_drawn < ec->texture_idle_time)
+			break;
+		if (!textures_evictable(gs)) {
+			bytes += gs->reduced.bytes;
+			drop_reduced(gr, gs);
+			continue;
+		}
+
+		bytes += gs->texture_bytes + gs->reduced.bytes;
+		count++;
+		evict_textures(gr, gs);
+	}
+
+	if (count > 0)
+		weston_log("evicted %u KiB of textures of %d idle surfaces\n",
+			   bytes >> 10, count);
+}
+
+/* Whether the surface shows on an output that is zoomed in, where it
+ * is drawn filtered. */
+static int
+surface_zoomed(struct weston_surface *es)
+{
+	struct weston_output *output;
+
+	wl_list_for_each(output, &es->compositor->output_list, link)
+		if (output->zoom.active &&
+		    (es->output_mask & (1 << output->id)))
+			return 1;
+
+	return 0;
+}
+
+static void
+gles2_renderer_attach(struct weston_surface *es, struct wl_buffer *buffer)
+{
+	struct weston_compositor *ec = es->compositor;
+	struct gles2_renderer *gr = get_renderer(ec);
+	struct gles2_surface_state *gs = get_surface_state(es);
+	const struct gles2_shm_format *shm_format;
+	EGLint attribs[3], format;
+	int i, num_planes;
+	int32_t pitch;
+
+	/* The pitch may change with the new buffer. */
+	gs->texcoord.valid = 0;
+	drop_reduced(gr, gs);
+
+	/* The solid color carries over to a new buffer of the same size,
+	 * as undamaged contents do. */
+	if (!buffer || !wl_buffer_is_shm(buffer) ||
+	    buffer->width != es->geometry.width ||
+	    buffer->height != es->geometry.height)
+		gs->solid = 0;
+
+	if (!buffer) {
+		for (i = 0; i < gs->num_images; i++) {
+			gr->destroy_image(ec->egl_display, gs->images[i]);
+			gs->images[i] = NULL;
+		}
+		gs->num_images = 0;
+		glDeleteTextures(gs->num_textures, gs->textures);
+		gs->num_textures = 0;
+		gs->filter = 0;
+		gs->shm_format = NULL;
+		set_texture_bytes(gr, gs, 0);
+		atlas_remove(gr, gs);
+		gs->evicted = 0;
+		return;
+	}
+
+	if (wl_buffer_is_shm(buffer)) {
+		shm_format = lookup_shm_format(wl_shm_buffer_get_format(buffer));
+		if (shm_format == NULL) {
+			weston_log("unsupported shm buffer format\n");
+			gs->shm_format = NULL;
+			return;
+		}
+		if (gs->shm_format != shm_format)
+			gs->solid = 0;
+
+		switch (shm_format->format) {
+		case WL_SHM_FORMAT_ARGB8888:
+			gs->shader = &gr->texture_shader_rgba;
+			gs->blend = 1;
+			break;
+		case WL_SHM_FORMAT_XRGB8888:
+			gs->shader = &gr->texture_shader_rgba;
+			gs->blend = 0;
+			break;
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+		case WL_SHM_FORMAT_RGB565:
+			gs->shader = &gr->texture_shader_rgba;
+			gs->blend = 0;
+			break;
+		case WL_SHM_FORMAT_ARGB4444:
+			gs->shader = &gr->texture_shader_argb4444;
+			gs->blend = 1;
+			break;
+		case WL_SHM_FORMAT_XRGB4444:
+			gs->shader = &gr->texture_shader_argb4444;
+			gs->blend = 0;
+			break;
+		case WL_SHM_FORMAT_YUYV:
+		case WL_SHM_FORMAT_NV12:
+			gs->shader = &gr->texture_shader_y_xuxv;
+			gs->blend = 0;
+			break;
+		case WL_SHM_FORMAT_YUV420:
+			gs->shader = &gr->texture_shader_y_u_v;
+			gs->blend = 0;
+			break;
+#endif
+		}
+
+		/* Nothing is uploaded for a buffer that stays solid. */
+		if (gs->solid) {
+			gs->shader = &gr->solid_shader;
+			gs->blend = (gs->solid_pixel >> 24) != 0xff;
+		}
+
+		pitch = wl_shm_buffer_get_stride(buffer) /
+			gl_format_cpp(shm_format->planes[0].format,
+				      shm_format->planes[0].type);
+
+		if (shm_format->planes[0].format == GL_BGRA_EXT &&
+		    buffer->width <= ATLAS_MAX_ENTRY &&
+		    buffer->height <= ATLAS_MAX_ENTRY &&
+		    !es->transform.enabled && !surface_zoomed(es)) {
+			/* A new entry starts out with nothing uploaded. */
+			if (!gs->atlas.page ||
+			    gs->atlas.width != buffer->width ||
+			    gs->atlas.height != buffer->height) {
+				atlas_remove(gr, gs);
+				if (atlas_place(gr, gs, buffer->width,
+						buffer->height) == 0)
+					gs->evicted = 1;
+			}
+
+			if (gs->atlas.page) {
+				glDeleteTextures(gs->num_textures,
+						 gs->textures);
+				gs->num_textures = 0;
+				gs->filter = 0;
+				set_texture_bytes(gr, gs, 0);
+				gs->shm_format = shm_format;
+				gs->pitch = pitch;
+				gs->height = buffer->height;
+				return;
+			}
+		} else if (gs->atlas.page) {
+			/* Grown past the atlas, back to textures. */
+			atlas_remove(gr, gs);
+			gs->evicted = 1;
+		}
+
+		/* A buffer of the same size and format keeps the textures
+		 * and their contents, only the damage gets uploaded. */
+		if (gs->shm_format != shm_format ||
+		    gs->num_textures < shm_format->num_planes ||
+		    gs->height != buffer->height || gs->pitch != pitch) {
+			gs->shm_format = shm_format;
+			gs->pitch = pitch;
+			gs->height = buffer->height;
+			set_texture_bytes(gr, gs, alloc_shm_textures(gs));
+			/* New textures hold nothing, upload all of the
+			 * buffer rather than just the damage. */
+			gs->evicted = 1;
+		}
+	} else if (gr->query_buffer(ec->egl_display, buffer,
+				    EGL_TEXTURE_FORMAT, &format)) {
+		gs->shm_format = NULL;
+		gs->height = 0;
+		set_texture_bytes(gr, gs, 0);
+		atlas_remove(gr, gs);
+		gs->evicted = 0;
+		for (i = 0; i < gs->num_images; i++)
+			gr->destroy_image(ec->egl_display, gs->images[i]);
+		gs->num_images = 0;
+
+		switch (format) {
+		case EGL_TEXTURE_RGB:
+		case EGL_TEXTURE_RGBA:
+		default:
+			num_planes = 1;
+			gs->shader = &gr->texture_shader_rgba;
+			break;
+		case EGL_TEXTURE_Y_UV_WL:
+			num_planes = 2;
+			gs->shader = &gr->texture_shader_y_uv;
+			break;
+		case EGL_TEXTURE_Y_U_V_WL:
+			num_planes = 3;
+			gs->shader = &gr->texture_shader_y_u_v;
+			break;
+		case EGL_TEXTURE_Y_XUXV_WL:
+			num_planes = 2;
+			gs->shader = &gr->texture_shader_y_xuxv;
+			break;
+		}
+
+		ensure_textures(gs, num_planes);
+		for (i = 0; i < num_planes; i++) {
+			attribs[0] = EGL_WAYLAND_PLANE_WL;
+			attribs[1] = i;
+			attribs[2] = EGL_NONE;
+			gs->images[i] = gr->create_image(ec->egl_display,
+							 NULL,
+							 EGL_WAYLAND_BUFFER_WL,
+							 buffer, attribs);
+			if (!gs->images[i])
+				continue;
+			gs->num_images++;
+
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, gs->textures[i]);
+			gr->image_target_texture_2d(GL_TEXTURE_2D,
+						    gs->images[i]);
+		}
+
+		gs->pitch = buffer->width;
+	} else {
+		/* unhandled buffer type */
+	}
+}
+
+static void
+gles2_renderer_surface_set_color(struct weston_surface *surface,
+				 float red, float green,
+				 float blue, float alpha)
+{
+	struct gles2_renderer *gr = get_renderer(surface->compositor);
+	struct gles2_surface_state *gs = get_surface_state(surface);
+
+	gs->color[0] = red;
+	gs->color[1] = green;
+	gs->color[2] = blue;
+	gs->color[3] = alpha;
+	gs->shader = &gr->solid_shader;
+}
+
+static int
+gles2_renderer_create_surface(struct weston_surface *surface)
+{
+	struct gles2_renderer *gr = get_renderer(surface->compositor);
+	struct gles2_surface_state *gs;
+
+	gs = calloc(1, sizeof *gs);
+	if (gs == NULL)
+		return -1;
+
+	gs->pitch = 1;
+	gs->blend = 1;
+	gs->surface = surface;
+	gs->last_drawn = weston_compositor_get_time();
+	wl_list_insert(&gr->texture_lru, &gs->lru_link);
+
+	surface->renderer_state = gs;
+
+	return 0;
+}
+
+static void
+gles2_renderer_destroy_surface(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct gles2_renderer *gr = get_renderer(ec);
+	struct gles2_surface_state *gs = get_surface_state(surface);
+	int i;
+
+	glDeleteTextures(gs->num_textures, gs->textures);
+	set_texture_bytes(gr, gs, 0);
+	drop_reduced(gr, gs);
+	atlas_remove(gr, gs);
+	wl_list_remove(&gs->lru_link);
+
+	for (i = 0; i < gs->num_images; i++)
+		gr->destroy_image(ec->egl_display, gs->images[i]);
+
+	free(gs);
+	surface->renderer_state = NULL;
+}
+
+static const char vertex_shader[] =
+	"uniform mat4 proj;\n"
+	"attribute vec3 position;\n"
+	"attribute vec2 texcoord;\n"
+	"varying vec2 v_texcoord;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = proj * vec4(position, 1.0);\n"
+	"   v_texcoord = texcoord;\n"
+	"}\n";
+
+/* Declare common fragment shader uniforms */
+#define FRAGMENT_SHADER_UNIFORMS		\
+	"uniform float alpha;\n"		\
+	"uniform float texwidth;\n"		\
+	"uniform vec4 opaque;\n"
+
+/* Common fragment shader init code (check texture bounds) */
+#define FRAGMENT_SHADER_INIT						\
+	"#ifdef CLIP\n"							\
+	"   if (v_texcoord.x < 0.0 || v_texcoord.x > texwidth ||\n"	\
+	"       v_texcoord.y < 0.0 || v_texcoord.y > 1.0)\n"		\
+	"      discard;\n"						\
+	"#endif\n"
+
+#define FRAGMENT_SHADER_EXIT						\
+	"#if defined(OPAQUE)\n"						\
+	"   gl_FragColor.a = 1.0;\n"					\
+	"#elif defined(OPAQUE_RECT)\n"					\
+	"   if (opaque.x <= v_texcoord.x && v_texcoord.x < opaque.y &&\n" \
+	"       opaque.z <= v_texcoord.y && v_texcoord.y < opaque.w)\n"	\
+	"      gl_FragColor.a = 1.0;\n"					\
+	"#endif\n"							\
+	"#ifdef ALPHA\n"							\
+	"   gl_FragColor = alpha * gl_FragColor;\n"			\
+	"#endif\n"
+
+#define FRAGMENT_CONVERT_YUV						\
+	"  gl_FragColor.r = y + 1.59602678 * v;\n"			\
+	"  gl_FragColor.g = y - 0.39176229 * u - 0.81296764 * v;\n"	\
+	"  gl_FragColor.b = y + 2.01723214 * u;\n"			\
+	"  gl_FragColor.a = 1.0;\n"
+
+static const char texture_fragment_shader_rgba[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	FRAGMENT_SHADER_UNIFORMS
+	"void main()\n"
+	"{\n"
+	FRAGMENT_SHADER_INIT
+	"   gl_FragColor = texture2D(tex, v_texcoord);\n"
+	FRAGMENT_SHADER_EXIT
+	"}\n";
+
+/* ARGB4444 uploaded as RGBA4444 has its channels rotated by one. */
+static const char texture_fragment_shader_argb4444[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	FRAGMENT_SHADER_UNIFORMS
+	"void main()\n"
+	"{\n"
+	FRAGMENT_SHADER_INIT
+	"   gl_FragColor = texture2D(tex, v_texcoord).gbar;\n"
+	FRAGMENT_SHADER_EXIT
+	"}\n";
+
+static const char texture_fragment_shader_y_uv[] =
+	"precision mediump float;\n"
+	"uniform sampler2D tex;\n"
+	"uniform sampler2D tex1;\n"
+	"varying vec2 v_texcoord;\n"
+	FRAGMENT_SHADER_UNIFORMS
+	"void main() {\n"
+	FRAGMENT_SHADER_INIT
+	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
+	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
+	"  float v = texture2D(tex1, v_texcoord).g - 0.5;\n"
+	FRAGMENT_CONVERT_YUV
+	FRAGMENT_SHADER_EXIT
+	"}\n";
+
+static const char texture_fragment_shader_y_u_v[] =
+	"precision mediump float;\n"
+	"uniform sampler2D tex;\n"
+	"uniform sampler2D tex1;\n"
+	"uniform sampler2D tex2;\n"
+	"varying vec2 v_texcoord;\n"
+	FRAGMENT_SHADER_UNIFORMS
+	"void main() {\n"
+	FRAGMENT_SHADER_INIT
+	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
+	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
+	"  float v = texture2D(tex2, v_texcoord).x - 0.5;\n"
+	FRAGMENT_CONVERT_YUV
+	FRAGMENT_SHADER_EXIT
+	"}\n";
+
+static const char texture_fragment_shader_y_xuxv[] =
+	"precision mediump float;\n"
+	"uniform sampler2D tex;\n"
+	"uniform sampler2D tex1;\n"
+	"varying vec2 v_texcoord;\n"
+	FRAGMENT_SHADER_UNIFORMS
+	"void main() {\n"
+	FRAGMENT_SHADER_INIT
+	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
+	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
+	"  float v = texture2D(tex1, v_texcoord).a - 0.5;\n"
+	FRAGMENT_CONVERT_YUV
+	FRAGMENT_SHADER_EXIT
+	"}\n";
+
+static const char solid_fragment_shader[] =
+	"precision mediump float;\n"
+	"uniform vec4 color;\n"
+	"uniform float alpha;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_FragColor = color;\n"
+	"#ifdef ALPHA\n"
+	"   gl_FragColor = alpha * gl_FragColor;\n"
+	"#endif\n"
+	"}\n";
+
+static int
+compile_shader(GLenum type, int count, const char **sources)
+{
+	GLuint s;
+	char msg[512];
+	GLint status;
+
+	s = glCreateShader(type);
+	glShaderSource(s, count, sources, NULL);
+	glCompileShader(s);
+	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
+		weston_log("shader info: %s\n", msg);
+		glDeleteShader(s);
+		return GL_NONE;
+	}
+
+	return s;
+}
+
+#define PROGRAM_CACHE_MAGIC "WPRGBIN1"
+
+struct program_cache_header {
+	char magic[8];
+	uint64_t hash;
+	uint32_t format;
+	uint32_t length;
+};
+
+/* 64-bit FNV-1a */
+static uint64_t
+hash_string(uint64_t hash, const char *s)
+{
+	if (s == NULL)
+		s = "(null)";
+
+	for (; *s; s++) {
+		hash ^= (unsigned char) *s;
+		hash *= 0x100000001b3ull;
+	}
+
+	/* Separate the strings, so "ab" + "c" != "a" + "bc" */
+	hash ^= 0xff;
+	hash *= 0x100000001b3ull;
+
+	return hash;
+}
+
+static int
+ensure_dir(const char *path)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+static void
+program_cache_init(struct gles2_renderer *gr, const char *extensions)
+{
+	const char *base, *home;
+	char path[PATH_MAX];
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	if (!strstr(extensions, "GL_OES_get_program_binary"))
+		return;
+
+	gr->program_cache.get_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_cache.load_binary =
+		(void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->program_cache.get_binary || !gr->program_cache.load_binary)
+		return;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base) {
+		snprintf(path, sizeof path, "%s", base);
+	} else {
+		home = getenv("HOME");
+		if (!home)
+			return;
+		snprintf(path, sizeof path, "%s/.cache", home);
+	}
+
+	if (ensure_dir(path) < 0)
+		return;
+	strncat(path, "/weston", sizeof path - strlen(path) - 1);
+	if (ensure_dir(path) < 0) {
+		weston_log("failed to create shader cache dir %s: %m\n", path);
+		return;
+	}
+
+	/* A driver update invalidates the whole cache. */
+	hash = hash_string(hash, (const char *) glGetString(GL_VENDOR));
+	hash = hash_string(hash, (const char *) glGetString(GL_RENDERER));
+	hash = hash_string(hash, (const char *) glGetString(GL_VERSION));
+	gr->program_cache.driver_hash = hash;
+
+	gr->program_cache.dir = strdup(path);
+	if (gr->program_cache.dir)
+		weston_log("using shader cache in %s\n", path);
+}
+
+static void
+program_cache_path(struct gles2_renderer *gr, uint64_t hash,
+		   char *path, size_t size)
+{
+	snprintf(path, size, "%s/program-%016llx.bin",
+		 gr->program_cache.dir, (unsigned long long) hash);
+}
+
+static int
+program_cache_load(struct gles2_renderer *gr, struct gles2_shader *shader,
+		   uint64_t hash)
+{
+	struct program_cache_header header;
+	char path[PATH_MAX];
+	void *binary = NULL;
+	GLint status = 0;
+	FILE *fp;
+
+	if (!gr->program_cache.dir)
+		return -1;
+
+	program_cache_path(gr, hash, path, sizeof path);
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return -1;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof header.magic) ||
+	    header.hash != hash || header.length == 0)
+		goto out;
+
+	binary = malloc(header.length);
+	if (binary == NULL ||
+	    fread(binary, header.length, 1, fp) != 1)
+		goto out;
+
+	shader->program = glCreateProgram();
+	gr->program_cache.load_binary(shader->program, header.format,
+				      binary, header.length);
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		/* The driver may reject binaries for any reason,
+		 * compile from source and overwrite the entry. */
+		glDeleteProgram(shader->program);
+		shader->program = 0;
+	}
+
+out:
+	free(binary);
+	fclose(fp);
+
+	return status ? 0 : -1;
+}
+
+static void
+program_cache_store(struct gles2_renderer *gr, struct gles2_shader *shader,
+		    uint64_t hash)
+{
+	struct program_cache_header header;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	void *binary;
+	GLint length = 0;
+	GLenum format;
+	FILE *fp;
+
+	if (!gr->program_cache.dir)
+		return;
+
+	glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (binary == NULL)
+		return;
+
+	gr->program_cache.get_binary(shader->program, length, &length,
+				     &format, binary);
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof header.magic);
+	header.hash = hash;
+	header.format = format;
+	header.length = length;
+
+	/* Write to a temporary file and rename, so concurrent
+	 * compositors never see a partial entry. */
+	program_cache_path(gr, hash, path, sizeof path);
+	snprintf(tmp, sizeof tmp, "%s.%d", path, getpid());
+	fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		goto out;
+
+	if (fwrite(&header, sizeof header, 1, fp) != 1 ||
+	    fwrite(binary, length, 1, fp) != 1) {
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+
+out:
+	free(binary);
+}
+
+static int
+gles2_shader_init(struct gles2_renderer *gr, struct gles2_shader *shader,
+		  const char *vertex_source, const char *fragment_source,
+		  uint32_t variant)
+{
+	char msg[512], defines[128];
+	const char *sources[2];
+	GLint status;
+	uint64_t hash;
+
+	snprintf(defines, sizeof defines, "%s%s%s%s",
+		 variant & SHADER_ALPHA ? "#define ALPHA\n" : "",
+		 variant & SHADER_CLIP ? "#define CLIP\n" : "",
+		 variant & SHADER_OPAQUE ? "#define OPAQUE\n" : "",
+		 variant & SHADER_OPAQUE_RECT ? "#define OPAQUE_RECT\n" : "");
+	sources[0] = defines;
+	sources[1] = fragment_source;
+
+	hash = gr->program_cache.driver_hash;
+	hash = hash_string(hash, vertex_source);
+	hash = hash_string(hash, defines);
+	hash = hash_string(hash, fragment_source);
+	if (program_cache_load(gr, shader, hash) == 0)
+		goto uniforms;
+
+	shader->vertex_shader =
+		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	shader->fragment_shader =
+		compile_shader(GL_FRAGMENT_SHADER, 2, sources);
+	if (shader->vertex_shader == GL_NONE ||
+	    shader->fragment_shader == GL_NONE)
+		goto err;
+
+	shader->program = glCreateProgram();
+	glAttachShader(shader->program, shader->vertex_shader);
+	glAttachShader(shader->program, shader->fragment_shader);
+	glBindAttribLocation(shader->program, 0, "position");
+	glBindAttribLocation(shader->program, 1, "texcoord");
+
+	glLinkProgram(shader->program);
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glGetProgramInfoLog(shader->program, sizeof msg, NULL, msg);
+		weston_log("link info: %s\n", msg);
+		goto err;
+	}
+
+	program_cache_store(gr, shader, hash);
+
+uniforms:
+	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
+	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
+	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
+	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
+	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
+	shader->color_uniform = glGetUniformLocation(shader->program, "color");
+	shader->texwidth_uniform = glGetUniformLocation(shader->program, "texwidth");
+	shader->opaque_uniform = glGetUniformLocation(shader->program, "opaque");
+
+	return 0;
+
+err:
+	glDeleteProgram(shader->program);
+	glDeleteShader(shader->vertex_shader);
+	glDeleteShader(shader->fragment_shader);
+	shader->program = 0;
+	shader->vertex_shader = 0;
+	shader->fragment_shader = 0;
+
+	return -1;
+}
+
+static void
+gles2_shader_release(struct gles2_shader *shader)
+{
+	glDeleteShader(shader->vertex_shader);
+	glDeleteShader(shader->fragment_shader);
+	glDeleteProgram(shader->program);
+}
+
+static int
+gles2_shader_init_generic(struct gles2_renderer *gr,
+			  struct gles2_shader *shader,
+			  const char *fragment_source, uint32_t variant_mask)
+{
+	shader->fragment_source = fragment_source;
+	shader->variant_mask = variant_mask;
+	shader->variants[SHADER_GENERIC & variant_mask] = shader;
+
+	return gles2_shader_init(gr, shader, vertex_shader, fragment_source,
+				 SHADER_GENERIC & variant_mask);
+}
+
+static struct gles2_shader *
+gles2_shader_get_variant(struct gles2_renderer *gr,
+			 struct gles2_shader *shader, uint32_t variant)
+{
+	struct gles2_shader *v;
+
+	variant &= shader->variant_mask;
+	if (shader->variants[variant])
+		return shader->variants[variant];
+
+	v = calloc(1, sizeof *v);
+	if (v == NULL)
+		return shader;
+
+	if (gles2_shader_init(gr, v, vertex_shader,
+			      shader->fragment_source, variant) < 0) {
+		weston_log("failed to compile shader variant 0x%x, "
+			   "using generic shader\n", variant);
+		free(v);
+		v = shader;
+	}
+
+	/* Failed variants map to the generic shader, so they are only
+	 * tried once. */
+	shader->variants[variant] = v;
+
+	return v;
+}
+
+static void
+gles2_shader_release_variants(struct gles2_shader *shader)
+{
+	int i;
+
+	for (i = 0; i < SHADER_VARIANT_COUNT; i++) {
+		if (shader->variants[i] && shader->variants[i] != shader) {
+			gles2_shader_release(shader->variants[i]);
+			free(shader->variants[i]);
+		}
+		shader->variants[i] = NULL;
+	}
+
+	gles2_shader_release(shader);
+}
+
+static void
+log_extensions(const char *name, const char *extensions)
+{
+	const char *p, *end;
+	int l;
+
+	l = weston_log("%s:", name);
+	p = extensions;
+	while (*p) {
+		end = strchrnul(p, ' ');
+		if (l + (end - p) > 78)
+			l = weston_log_continue("\n" STAMP_SPACE "%.*s",
+						end - p, p);
+		else
+			l += weston_log_continue(" %.*s", end - p, p);
+		for (p = end; isspace(*p); p++)
+			;
+	}
+	weston_log_continue("\n");
+}
+
+static void
+log_egl_gl_info(EGLDisplay egldpy)
+{
+	const char *str;
+
+	str = eglQueryString(egldpy, EGL_VERSION);
+	weston_log("EGL version: %s\n", str ? str : "(null)");
+
+	str = eglQueryString(egldpy, EGL_VENDOR);
+	weston_log("EGL vendor: %s\n", str ? str : "(null)");
+
+	str = eglQueryString(egldpy, EGL_CLIENT_APIS);
+	weston_log("EGL client APIs: %s\n", str ? str : "(null)");
+
+	str = eglQueryString(egldpy, EGL_EXTENSIONS);
+	log_extensions("EGL extensions", str ? str : "(null)");
+
+	str = (char *)glGetString(GL_VERSION);
+	weston_log("GL version: %s\n", str ? str : "(null)");
+
+	str = (char *)glGetString(GL_SHADING_LANGUAGE_VERSION);
+	weston_log("GLSL version: %s\n", str ? str : "(null)");
+
+	str = (char *)glGetString(GL_VENDOR);
+	weston_log("GL vendor: %s\n", str ? str : "(null)");
+
+	str = (char *)glGetString(GL_RENDERER);
+	weston_log("GL renderer: %s\n", str ? str : "(null)");
+
+	str = (char *)glGetString(GL_EXTENSIONS);
+	log_extensions("GL extensions", str ? str : "(null)");
+}
+
+static void
+gles2_renderer_destroy(struct weston_compositor *ec)
+{
+	struct gles2_renderer *gr = get_renderer(ec);
+	struct gles2_atlas_page *page, *next;
+
+	if (gr->has_bind_display)
+		gr->unbind_display(ec->egl_display, ec->wl_display);
+
+	wl_list_for_each_safe(page, next, &gr->atlas_pages, link)
+		atlas_page_destroy(gr, page);
+
+	if (gr->border.texture)
+		glDeleteTextures(1, &gr->border.texture);
+	if (gr->reduce_fbo)
+		glDeleteFramebuffers(1, &gr->reduce_fbo);
+
+	gles2_shader_release_variants(&gr->texture_shader_rgba);
+	gles2_shader_release_variants(&gr->texture_shader_argb4444);
+	gles2_shader_release_variants(&gr->texture_shader_y_uv);
+	gles2_shader_release_variants(&gr->texture_shader_y_u_v);
+	gles2_shader_release_variants(&gr->texture_shader_y_xuxv);
+	gles2_shader_release_variants(&gr->solid_shader);
+
+	wl_array_release(&gr->vertices);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->draw_items);
+	wl_array_release(&gr->draw_order);
+
+	free(gr->program_cache.dir);
+	free(gr);
+	ec->renderer = NULL;
+}
+
+WL_EXPORT int
+gles2_renderer_output_create(struct weston_output *output,
+			     EGLSurface surface)
+{
+	struct gles2_output_state *go;
+	int i;
+
+	go = calloc(1, sizeof *go);
+	if (go == NULL)
+		return -1;
+
+	go->egl_surface = surface;
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
+		pixman_region32_init(&go->buffer_damage[i]);
+
+	output->renderer_state = go;
+
+	return 0;
+}
+
+/* The damage history does not apply to the buffers of a new surface. */
+WL_EXPORT void
+gles2_renderer_output_set_surface(struct weston_output *output,
+				  EGLSurface surface)
+{
+	struct gles2_output_state *go = get_output_state(output);
+	int i;
+
+	go->egl_surface = surface;
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++) {
+		pixman_region32_fini(&go->buffer_damage[i]);
+		pixman_region32_init(&go->buffer_damage[i]);
+	}
+}
+
+WL_EXPORT void
+gles2_renderer_output_destroy(struct weston_output *output)
+{
+	struct gles2_output_state *go = get_output_state(output);
+	int i;
+
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
+		pixman_region32_fini(&go->buffer_damage[i]);
+
+	free(go);
+	output->renderer_state = NULL;
+}
+
+WL_EXPORT void
+gles2_renderer_set_border(struct weston_compositor *ec,
+			  int32_t width, int32_t height, void *data)
+{
+	struct gles2_renderer *gr = get_renderer(ec);
+
+	gr->border.width = width;
+	gr->border.height = height;
+
+	if (!gr->border.texture)
+		glGenTextures(1, &gr->border.texture);
+	glBindTexture(GL_TEXTURE_2D, gr->border.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT, width, height, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE, data);
+}
+
+WL_EXPORT int
+gles2_renderer_init(struct weston_compositor *ec)
+{
+	struct gles2_renderer *gr;
+	const char *extensions;
+	EGLint depth_size;
+
+	gr = calloc(1, sizeof *gr);
+	if (gr == NULL)
+		return -1;
+
+	wl_list_init(&gr->texture_lru);
+	wl_list_init(&gr->atlas_pages);
+	/* Set up front so that errors unwind through
+	 * gles2_renderer_destroy(). */
+	gr->base.destroy = gles2_renderer_destroy;
+	ec->renderer = &gr->base;
+
+	log_egl_gl_info(ec->egl_display);
+
+	gr->image_target_texture_2d =
+		(void *) eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	gr->image_target_renderbuffer_storage = (void *)
+		eglGetProcAddress("glEGLImageTargetRenderbufferStorageOES");
+	gr->create_image = (void *) eglGetProcAddress("eglCreateImageKHR");
+	gr->destroy_image = (void *) eglGetProcAddress("eglDestroyImageKHR");
+	gr->bind_display =
+		(void *) eglGetProcAddress("eglBindWaylandDisplayWL");
+	gr->unbind_display =
+		(void *) eglGetProcAddress("eglUnbindWaylandDisplayWL");
+	gr->query_buffer =
+		(void *) eglGetProcAddress("eglQueryWaylandBufferWL");
+
+	extensions = (const char *) glGetString(GL_EXTENSIONS);
+	if (!extensions) {
+		weston_log("Retrieving GL extension string failed.\n");
+		goto err;
+	}
+
+	if (!strstr(extensions, "GL_EXT_texture_format_BGRA8888")) {
+		weston_log("GL_EXT_texture_format_BGRA8888 not available\n");
+		goto err;
+	}
+
+	if (strstr(extensions, "GL_EXT_read_format_bgra"))
+		ec->read_format = PIXMAN_a8r8g8b8;
+	else
+		ec->read_format = PIXMAN_a8b8g8r8;
+
+	if (strstr(extensions, "GL_EXT_unpack_subimage"))
+		gr->has_unpack_subimage = 1;
+
+	program_cache_init(gr, extensions);
+
+	extensions =
+		(const char *) eglQueryString(ec->egl_display, EGL_EXTENSIONS);
+	if (!extensions) {
+		weston_log("Retrieving EGL extension string failed.\n");
+		goto err;
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+
+	if (gles2_shader_init_generic(gr, &gr->texture_shader_rgba,
+				      texture_fragment_shader_rgba,
+				      SHADER_ALPHA | SHADER_CLIP |
+				      SHADER_OPAQUE | SHADER_OPAQUE_RECT) < 0)
+		goto err;
+	if (gles2_shader_init_generic(gr, &gr->texture_shader_argb4444,
+				      texture_fragment_shader_argb4444,
+				      SHADER_ALPHA | SHADER_CLIP |
+				      SHADER_OPAQUE | SHADER_OPAQUE_RECT) < 0)
+		goto err;
+	if (gles2_shader_init_generic(gr, &gr->texture_shader_y_uv,
+				      texture_fragment_shader_y_uv,
+				      SHADER_ALPHA | SHADER_CLIP) < 0)
+		goto err;
+	if (gles2_shader_init_generic(gr, &gr->texture_shader_y_u_v,
+				      texture_fragment_shader_y_u_v,
+				      SHADER_ALPHA | SHADER_CLIP) < 0)
+		goto err;
+	if (gles2_shader_init_generic(gr, &gr->texture_shader_y_xuxv,
+				      texture_fragment_shader_y_xuxv,
+				      SHADER_ALPHA | SHADER_CLIP) < 0)
+		goto err;
+	if (gles2_shader_init_generic(gr, &gr->solid_shader,
+				      solid_fragment_shader,
+				      SHADER_ALPHA) < 0)
+		goto err;
+
+	if (strstr(extensions, "EGL_EXT_buffer_age"))
+		gr->has_egl_buffer_age = 1;
+
+	if (eglGetConfigAttrib(ec->egl_display, ec->egl_config,
+			       EGL_DEPTH_SIZE, &depth_size) && depth_size > 0) {
+		weston_log("using a %d bit depth buffer for occlusion\n",
+			   depth_size);
+		gr->has_depth = 1;
+	}
+
+	if (strstr(extensions, "EGL_WL_bind_wayland_display"))
+		gr->has_bind_display = 1;
+	if (gr->has_bind_display)
+		gr->bind_display(ec->egl_display, ec->wl_display);
+
+	gr->base.repaint_output = gles2_renderer_repaint_output;
+	gr->base.flush_damage = gles2_renderer_flush_damage;
+	gr->base.attach = gles2_renderer_attach;
+	gr->base.read_pixels = gles2_renderer_read_pixels;
+	gr->base.create_surface = gles2_renderer_create_surface;
+	gr->base.surface_set_color = gles2_renderer_surface_set_color;
+	gr->base.destroy_surface = gles2_renderer_destroy_surface;
+
+	return 0;
+
+err:
+	gles2_renderer_destroy(ec);
+	return -1;
+}
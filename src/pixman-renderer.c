@@ -0,0 +1,547 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixman-renderer.h"
+
+struct pixman_output_state {
+	pixman_image_t *hw_buffer;
+};
+
+struct pixman_surface_state {
+	pixman_image_t *image;
+	int blend;
+
+	/* Non-zero if image is a private RGB copy of a buffer in this
+	 * shm format that pixman cannot read, updated on flush. */
+	uint32_t convert_format;
+
+	struct wl_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+};
+
+struct pixman_renderer {
+	struct weston_renderer base;
+};
+
+static inline struct pixman_output_state *
+get_output_state(struct weston_output *output)
+{
+	return (struct pixman_output_state *) output->renderer_state;
+}
+
+static inline struct pixman_surface_state *
+get_surface_state(struct weston_surface *surface)
+{
+	return (struct pixman_surface_state *) surface->renderer_state;
+}
+
+static pixman_format_code_t
+pixman_format_from_shm(uint32_t shm_format)
+{
+	switch (shm_format) {
+	case WL_SHM_FORMAT_XRGB8888:
+		return PIXMAN_x8r8g8b8;
+	case WL_SHM_FORMAT_ARGB8888:
+		return PIXMAN_a8r8g8b8;
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	case WL_SHM_FORMAT_RGB565:
+		return PIXMAN_r5g6b5;
+	case WL_SHM_FORMAT_ARGB4444:
+		return PIXMAN_a4r4g4b4;
+	case WL_SHM_FORMAT_XRGB4444:
+		return PIXMAN_x4r4g4b4;
+	case WL_SHM_FORMAT_YUYV:
+		return PIXMAN_yuy2;
+#endif
+	default:
+		return 0;
+	}
+}
+
+static void
+matrix_to_pixman_transform(pixman_transform_t *transform,
+			   struct weston_matrix *matrix)
+{
+	/* weston_matrix is column major, drop the z row and column. */
+	transform->matrix[0][0] = pixman_double_to_fixed(matrix->d[0]);
+	transform->matrix[0][1] = pixman_double_to_fixed(matrix->d[4]);
+	transform->matrix[0][2] = pixman_double_to_fixed(matrix->d[12]);
+	transform->matrix[1][0] = pixman_double_to_fixed(matrix->d[1]);
+	transform->matrix[1][1] = pixman_double_to_fixed(matrix->d[5]);
+	transform->matrix[1][2] = pixman_double_to_fixed(matrix->d[13]);
+	transform->matrix[2][0] = pixman_double_to_fixed(matrix->d[3]);
+	transform->matrix[2][1] = pixman_double_to_fixed(matrix->d[7]);
+	transform->matrix[2][2] = pixman_double_to_fixed(matrix->d[15]);
+}
+
+static void
+draw_surface(struct weston_surface *es, struct weston_output *output,
+	     pixman_region32_t *damage)
+{
+	struct pixman_surface_state *ps = get_surface_state(es);
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t repaint;
+	pixman_transform_t transform, translate;
+	pixman_image_t *mask = NULL;
+	pixman_color_t mask_color;
+	pixman_op_t op;
+
+	if (!ps->image)
+		return;
+
+	pixman_region32_init(&repaint);
+	pixman_region32_intersect(&repaint,
+				  &es->transform.boundingbox, damage);
+	pixman_region32_subtract(&repaint, &repaint, &es->clip);
+
+	if (!pixman_region32_not_empty(&repaint))
+		goto out;
+
+	/* The clip is in output coordinates, and the source transform
+	 * maps output coordinates back to surface coordinates. */
+	pixman_region32_translate(&repaint, -output->x, -output->y);
+	pixman_image_set_clip_region32(po->hw_buffer, &repaint);
+
+	if (es->transform.enabled) {
+		matrix_to_pixman_transform(&transform,
+					   &es->transform.inverse);
+		pixman_transform_init_translate(&translate,
+						pixman_int_to_fixed(output->x),
+						pixman_int_to_fixed(output->y));
+		pixman_transform_multiply(&transform, &transform, &translate);
+		pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR,
+					NULL, 0);
+	} else {
+		pixman_transform_init_translate(&transform,
+			pixman_double_to_fixed(output->x - es->geometry.x),
+			pixman_double_to_fixed(output->y - es->geometry.y));
+		pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST,
+					NULL, 0);
+	}
+	pixman_image_set_transform(ps->image, &transform);
+
+	if (es->alpha < 1.0) {
+		mask_color.red = 0;
+		mask_color.green = 0;
+		mask_color.blue = 0;
+		mask_color.alpha = es->alpha * 0xffff;
+		mask = pixman_image_create_solid_fill(&mask_color);
+	}
+
+	/* A transformed surface doesn't cover its whole bounding box,
+	 * the corners it leaves out must not be cleared. */
+	if (ps->blend || mask || es->transform.enabled)
+		op = PIXMAN_OP_OVER;
+	else
+		op = PIXMAN_OP_SRC;
+
+	pixman_image_composite32(op, ps->image, mask, po->hw_buffer,
+				 0, 0, 0, 0, 0, 0,
+				 pixman_image_get_width(po->hw_buffer),
+				 pixman_image_get_height(po->hw_buffer));
+
+	if (mask)
+		pixman_image_unref(mask);
+
+	pixman_image_set_transform(ps->image, NULL);
+	pixman_image_set_clip_region32(po->hw_buffer, NULL);
+
+out:
+	pixman_region32_fini(&repaint);
+}
+
+static void
+pixman_renderer_repaint_output(struct weston_output *output,
+			       pixman_region32_t *output_damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_surface *surface;
+
+	if (!po->hw_buffer)
+		return;
+
+	wl_list_for_each_reverse(surface, &compositor->surface_list, link)
+		if (surface->plane == &compositor->primary_plane)
+			draw_surface(surface, output, output_damage);
+
+	wl_signal_emit(&output->frame_signal, output);
+}
+
+static int
+pixman_renderer_read_pixels(struct weston_output *output,
+			    pixman_format_code_t format, void *pixels,
+			    uint32_t x, uint32_t y,
+			    uint32_t width, uint32_t height)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_transform_t transform;
+	pixman_image_t *out_buf;
+	int32_t output_height;
+
+	if (!po->hw_buffer)
+		return -1;
+
+	out_buf = pixman_image_create_bits(format, width, height,
+					   pixels,
+					   PIXMAN_FORMAT_BPP(format) / 8 * width);
+	if (!out_buf)
+		return -1;
+
+	/* Match the GL renderer: origin in the lower left corner and
+	 * the rows bottom up, so flip while copying. */
+	output_height = pixman_image_get_height(po->hw_buffer);
+	pixman_transform_init_identity(&transform);
+	pixman_transform_scale(&transform, NULL,
+			       pixman_int_to_fixed(1),
+			       pixman_int_to_fixed(-1));
+	pixman_transform_translate(&transform, NULL,
+				   pixman_int_to_fixed(x),
+				   pixman_int_to_fixed(output_height - y));
+	pixman_image_set_transform(po->hw_buffer, &transform);
+
+	pixman_image_composite32(PIXMAN_OP_SRC, po->hw_buffer, NULL, out_buf,
+				 0, 0, 0, 0, 0, 0, width, height);
+
+	pixman_image_set_transform(po->hw_buffer, NULL);
+	pixman_image_unref(out_buf);
+
+	return 0;
+}
+
+static inline uint32_t
+clamp_component(int32_t c)
+{
+	return c < 0 ? 0 : c > 255 ? 255 : c;
+}
+
+/* BT.601 limited range like the GL shaders, in 16.16 fixed point. */
+static inline uint32_t
+yuv_to_xrgb(int32_t y, int32_t u, int32_t v)
+{
+	int32_t r, g, b;
+
+	y = (y - 16) * 76309;
+	u -= 128;
+	v -= 128;
+	r = (y + 104597 * v) >> 16;
+	g = (y - 25675 * u - 53279 * v) >> 16;
+	b = (y + 132202 * u) >> 16;
+
+	return 0xff000000 | clamp_component(r) << 16 |
+		clamp_component(g) << 8 | clamp_component(b);
+}
+
+/* Converts a box of an NV12 or YUV420 buffer into the RGB copy.  The
+ * chroma planes follow the luma plane, a row of interleaved U and V
+ * samples or one of each at half the stride per two luma rows, both
+ * rounded up for odd sizes. */
+static void
+convert_yuv_box(struct wl_buffer *buffer, uint32_t format,
+		pixman_image_t *image, pixman_box32_t *box)
+{
+	uint8_t *data = wl_shm_buffer_get_data(buffer);
+	int32_t stride = wl_shm_buffer_get_stride(buffer);
+	int32_t height = buffer->height;
+	uint32_t *dst = pixman_image_get_data(image), *d;
+	int32_t dst_stride = pixman_image_get_stride(image) / 4;
+	uint8_t *u_plane, *v_plane, *y_row, *u_row, *v_row;
+	int32_t x, y, cy, chroma_stride, step;
+
+	u_plane = data + stride * height;
+	if (format == WL_SHM_FORMAT_NV12) {
+		chroma_stride = (stride + 1) / 2 * 2;
+		step = 2;
+		v_plane = u_plane + 1;
+	} else {
+		chroma_stride = (stride + 1) / 2;
+		step = 1;
+		v_plane = u_plane + chroma_stride * ((height + 1) / 2);
+	}
+
+	for (y = box->y1; y < box->y2; y++) {
+		cy = y / 2;
+		y_row = data + y * stride;
+		u_row = u_plane + cy * chroma_stride;
+		v_row = v_plane + cy * chroma_stride;
+		d = dst + y * dst_stride;
+		for (x = box->x1; x < box->x2; x++)
+			d[x] = yuv_to_xrgb(y_row[x],
+					   u_row[x / 2 * step],
+					   v_row[x / 2 * step]);
+	}
+}
+
+static int
+pixman_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct wl_buffer *buffer = surface->buffer;
+	pixman_region32_t damage;
+	pixman_box32_t *rectangles;
+	int i, n;
+
+	/* Other shm buffers are sampled directly, nothing to upload. */
+	if (!ps->convert_format || !ps->image)
+		return 0;
+
+	pixman_region32_init_rect(&damage, 0, 0,
+				  buffer->width, buffer->height);
+	pixman_region32_intersect(&damage, &damage, &surface->damage);
+	rectangles = pixman_region32_rectangles(&damage, &n);
+	for (i = 0; i < n; i++)
+		convert_yuv_box(buffer, ps->convert_format,
+				ps->image, &rectangles[i]);
+	pixman_region32_fini(&damage);
+
+	/* The copy is complete, the buffer can go back to the client. */
+	return 1;
+}
+
+static void
+surface_release_buffer(struct pixman_surface_state *ps)
+{
+	if (ps->buffer) {
+		wl_list_remove(&ps->buffer_destroy_listener.link);
+		ps->buffer = NULL;
+	}
+
+	if (ps->image) {
+		pixman_image_unref(ps->image);
+		ps->image = NULL;
+	}
+}
+
+static void
+surface_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct pixman_surface_state *ps =
+		container_of(listener, struct pixman_surface_state,
+			     buffer_destroy_listener);
+	pixman_format_code_t format;
+	pixman_image_t *copy;
+	int width, height;
+
+	/* The client memory goes away with the buffer, keep a private
+	 * copy so the surface still has content until the next attach.
+	 * pixman only reads YUV, so those are copied as RGB. */
+	width = pixman_image_get_width(ps->image);
+	height = pixman_image_get_height(ps->image);
+	format = pixman_image_get_format(ps->image);
+	if (format == PIXMAN_yuy2)
+		format = PIXMAN_x8r8g8b8;
+	copy = pixman_image_create_bits(format, width, height, NULL, 0);
+	if (copy)
+		pixman_image_composite32(PIXMAN_OP_SRC, ps->image, NULL, copy,
+					 0, 0, 0, 0, 0, 0, width, height);
+
+	surface_release_buffer(ps);
+	ps->image = copy;
+}
+
+static void
+pixman_renderer_attach(struct weston_surface *es, struct wl_buffer *buffer)
+{
+	struct pixman_surface_state *ps = get_surface_state(es);
+	pixman_format_code_t format;
+	uint32_t shm_format;
+
+	if (buffer && wl_buffer_is_shm(buffer))
+		shm_format = wl_shm_buffer_get_format(buffer);
+	else
+		shm_format = 0;
+
+	switch (shm_format) {
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	case WL_SHM_FORMAT_NV12:
+	case WL_SHM_FORMAT_YUV420:
+		/* A copy of the same size keeps its contents, only the
+		 * damage gets converted. */
+		if (ps->convert_format == shm_format && ps->image &&
+		    pixman_image_get_width(ps->image) == buffer->width &&
+		    pixman_image_get_height(ps->image) == buffer->height)
+			return;
+
+		surface_release_buffer(ps);
+		ps->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						     buffer->width,
+						     buffer->height, NULL, 0);
+		ps->blend = 0;
+		ps->convert_format = shm_format;
+		return;
+#endif
+	default:
+		break;
+	}
+
+	surface_release_buffer(ps);
+	ps->convert_format = 0;
+
+	if (!buffer)
+		return;
+
+	if (!wl_buffer_is_shm(buffer)) {
+		weston_log("Pixman renderer supports only SHM buffers\n");
+		return;
+	}
+
+	format = pixman_format_from_shm(shm_format);
+	if (!format) {
+		weston_log("Unsupported SHM buffer format\n");
+		return;
+	}
+
+	ps->image = pixman_image_create_bits(format,
+					     buffer->width, buffer->height,
+					     wl_shm_buffer_get_data(buffer),
+					     wl_shm_buffer_get_stride(buffer));
+	if (!ps->image)
+		return;
+
+	ps->blend = PIXMAN_FORMAT_A(format) != 0;
+	ps->buffer = buffer;
+	wl_signal_add(&buffer->resource.destroy_signal,
+		      &ps->buffer_destroy_listener);
+}
+
+static void
+pixman_renderer_surface_set_color(struct weston_surface *es,
+				  float red, float green,
+				  float blue, float alpha)
+{
+	struct pixman_surface_state *ps = get_surface_state(es);
+	pixman_color_t color;
+
+	/* Same semantics as the GL solid shader: premultiplied. */
+	color.red = red * 0xffff;
+	color.green = green * 0xffff;
+	color.blue = blue * 0xffff;
+	color.alpha = alpha * 0xffff;
+
+	surface_release_buffer(ps);
+	ps->convert_format = 0;
+	ps->image = pixman_image_create_solid_fill(&color);
+	ps->blend = alpha < 1.0;
+}
+
+static int
+pixman_renderer_create_surface(struct weston_surface *surface)
+{
+	struct pixman_surface_state *ps;
+
+	ps = calloc(1, sizeof *ps);
+	if (ps == NULL)
+		return -1;
+
+	ps->buffer_destroy_listener.notify = surface_handle_buffer_destroy;
+	surface->renderer_state = ps;
+
+	return 0;
+}
+
+static void
+pixman_renderer_destroy_surface(struct weston_surface *surface)
+{
+	struct pixman_surface_state *ps = get_surface_state(surface);
+
+	surface_release_buffer(ps);
+	free(ps);
+	surface->renderer_state = NULL;
+}
+
+static void
+pixman_renderer_destroy(struct weston_compositor *ec)
+{
+	free(ec->renderer);
+	ec->renderer = NULL;
+}
+
+WL_EXPORT int
+pixman_renderer_init(struct weston_compositor *ec)
+{
+	struct pixman_renderer *renderer;
+
+	renderer = calloc(1, sizeof *renderer);
+	if (renderer == NULL)
+		return -1;
+
+	renderer->base.repaint_output = pixman_renderer_repaint_output;
+	renderer->base.flush_damage = pixman_renderer_flush_damage;
+	renderer->base.attach = pixman_renderer_attach;
+	renderer->base.read_pixels = pixman_renderer_read_pixels;
+	renderer->base.create_surface = pixman_renderer_create_surface;
+	renderer->base.surface_set_color = pixman_renderer_surface_set_color;
+	renderer->base.destroy_surface = pixman_renderer_destroy_surface;
+	renderer->base.destroy = pixman_renderer_destroy;
+	ec->renderer = &renderer->base;
+
+	ec->read_format = PIXMAN_a8r8g8b8;
+
+	weston_log("Using pixman software renderer\n");
+
+	return 0;
+}
+
+WL_EXPORT int
+pixman_renderer_output_create(struct weston_output *output)
+{
+	struct pixman_output_state *po;
+
+	po = calloc(1, sizeof *po);
+	if (po == NULL)
+		return -1;
+
+	output->renderer_state = po;
+
+	return 0;
+}
+
+WL_EXPORT void
+pixman_renderer_output_set_buffer(struct weston_output *output,
+				  pixman_image_t *buffer)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	if (po->hw_buffer)
+		pixman_image_unref(po->hw_buffer);
+	po->hw_buffer = buffer;
+
+	if (po->hw_buffer)
+		pixman_image_ref(po->hw_buffer);
+}
+
+WL_EXPORT void
+pixman_renderer_output_destroy(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	if (po->hw_buffer)
+		pixman_image_unref(po->hw_buffer);
+	free(po);
+	output->renderer_state = NULL;
+}
@@ -112,10 +112,10 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 		return;
 	}
 
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(0, 0, output->current->width, output->current->height,
-		     output->compositor->read_format,
-		     GL_UNSIGNED_BYTE, pixels);
+	output->compositor->renderer->read_pixels(output,
+				output->compositor->read_format, pixels,
+				0, 0, output->current->width,
+				output->current->height);
 
 	stride = wl_shm_buffer_get_stride(l->buffer);
 
@@ -123,10 +123,10 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	s = pixels + stride * (l->buffer->height - 1);
 
 	switch (output->compositor->read_format) {
-	case GL_BGRA_EXT:
+	case PIXMAN_a8r8g8b8:
 		copy_bgra_yflip(d, s, output->current->height, stride);
 		break;
-	case GL_RGBA:
+	case PIXMAN_a8b8g8r8:
 		copy_rgba_yflip(d, s, output->current->height, stride);
 		break;
 	default:
@@ -148,7 +148,9 @@ screenshooter_shoot(struct wl_client *client,
 	struct screenshooter_frame_listener *l;
 	struct wl_buffer *buffer = buffer_resource->data;
 
-	if (!wl_buffer_is_shm(buffer))
+	if (!wl_buffer_is_shm(buffer) ||
+	    (wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_ARGB8888 &&
+	     wl_shm_buffer_get_format(buffer) != WL_SHM_FORMAT_XRGB8888))
 		return;
 
 	if (buffer->width < output->current->width ||
@@ -290,10 +292,11 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
-		glReadPixels(r[i].x1, output->current->height - r[i].y2,
-			     width, height,
-			     output->compositor->read_format,
-			     GL_UNSIGNED_BYTE, recorder->rect);
+		output->compositor->renderer->read_pixels(output,
+				output->compositor->read_format,
+				recorder->rect, r[i].x1,
+				output->current->height - r[i].y2,
+				width, height);
 
 		s = recorder->rect;
 		p = recorder->rect;
@@ -358,12 +361,14 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (output->compositor->read_format) {
-	case GL_BGRA_EXT:
+	case PIXMAN_a8r8g8b8:
 		header.format = WCAP_FORMAT_XRGB8888;
 		break;
-	case GL_RGBA:
+	case PIXMAN_a8b8g8r8:
 		header.format = WCAP_FORMAT_XBGR8888;
 		break;
+	default:
+		break;
 	}
 
 	header.width = output->current->width;
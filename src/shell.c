@@ -1428,6 +1428,17 @@ shell_configure_fullscreen(struct shell_surface *shsurf)
 			center_on_output(surface, shsurf->fullscreen_output);
 		break;
 	case WL_SHELL_SURFACE_FULLSCREEN_METHOD_SCALE:
+		/* Without a transform, a surface of the output's size can
+		 * be scanned out directly. */
+		if (surface->geometry.width == output->current->width &&
+		    surface->geometry.height == output->current->height) {
+			wl_list_remove(&shsurf->fullscreen.transform.link);
+			wl_list_init(&shsurf->fullscreen.transform.link);
+			weston_surface_set_position(surface,
+						    output->x, output->y);
+			break;
+		}
+
 		matrix = &shsurf->fullscreen.transform.matrix;
 		weston_matrix_init(matrix);
 
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "test-runner.h"
+
+struct context {
+	struct weston_layer layer;
+	struct weston_surface *surface;
+};
+
+static void
+handle_surface(struct test_client *client, struct context *context)
+{
+	struct wl_resource *resource;
+	uint32_t id;
+
+	assert(sscanf(client->buf, "surface %u", &id) == 1);
+	resource = wl_client_get_object(client->client, id);
+	assert(resource);
+
+	context->surface = (struct weston_surface *) resource;
+	weston_surface_configure(context->surface, 100, 100, 64, 64);
+	weston_surface_assign_output(context->surface);
+	wl_list_insert(&context->layer.surface_list,
+		       &context->surface->layer_link);
+	weston_surface_damage(context->surface);
+
+	test_client_send_after_repaint(client, "state\n");
+}
+
+/* Both renderers convert or upload NV12 into their own copy, so the
+ * buffer goes back to the client as soon as it has been drawn. */
+static void
+handle_state(struct test_client *client, struct context *context)
+{
+	int released, frames;
+
+	assert(sscanf(client->buf, "state %d %d", &released, &frames) == 2);
+	fprintf(stderr, "buffer released %d times\n", released);
+
+	assert(context->surface->buffer_released);
+	assert(released == 1);
+
+	test_client_send(client, "bye\n");
+}
+
+static void
+handle_reply(struct test_client *client)
+{
+	struct context *context = client->data;
+
+	if (strncmp(client->buf, "surface ", 8) == 0)
+		handle_surface(client, context);
+	else if (strncmp(client->buf, "state ", 6) == 0)
+		handle_state(client, context);
+	else
+		assert(0);
+}
+
+TEST(buffer_release_test)
+{
+#if HAVE_DECL_WL_DISPLAY_ADD_SHM_FORMAT
+	struct test_client *client;
+	struct context *context;
+
+	context = malloc(sizeof *context);
+	assert(context);
+	memset(context, 0, sizeof *context);
+	weston_layer_init(&context->layer, &compositor->cursor_layer.link);
+
+	client = test_client_launch(compositor);
+	client->terminate = 1;
+	client->handle = handle_reply;
+	client->data = context;
+
+	test_client_send(client, "shm-surface %u 64 64\n",
+			 WL_SHM_FORMAT_NV12);
+#else
+	fprintf(stderr, "no NV12 support, skipping\n");
+	wl_display_terminate(compositor->wl_display);
+#endif
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "test-runner.h"
+
+/* The surface is kept out of the layers, so no repaint takes its
+ * damage before it is checked. */
+struct context {
+	struct weston_surface *surface;
+	int step;
+};
+
+static void
+assert_damage(struct weston_surface *surface,
+	      int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	pixman_box32_t *box;
+	int n;
+
+	box = pixman_region32_rectangles(&surface->damage, &n);
+	fprintf(stderr, "damage: %d rectangles\n", n);
+	assert(n == 1);
+	assert(box->x1 == x1 && box->y1 == y1);
+	assert(box->x2 == x2 && box->y2 == y2);
+}
+
+static void
+clear_damage(struct weston_surface *surface)
+{
+	pixman_region32_fini(&surface->damage);
+	pixman_region32_init(&surface->damage);
+}
+
+static void
+handle_surface(struct test_client *client, struct context *context)
+{
+	struct wl_resource *resource;
+	uint32_t id;
+
+	assert(sscanf(client->buf, "surface %u", &id) == 1);
+	resource = wl_client_get_object(client->client, id);
+	assert(resource);
+	context->surface = (struct weston_surface *) resource;
+
+	/* Nothing hashed yet, all of it counts. */
+	assert_damage(context->surface, 0, 0, 64, 64);
+	clear_damage(context->surface);
+
+	test_client_send(client, "paint 40 8\n");
+}
+
+static void
+handle_painted(struct test_client *client, struct context *context)
+{
+	switch (context->step++) {
+	case 0:
+		/* Only the tile with the new pixel changed. */
+		assert_damage(context->surface, 32, 0, 64, 32);
+		clear_damage(context->surface);
+		test_client_send(client, "paint 40 8\n");
+		break;
+	case 1:
+		/* The same pixel again, nothing changed. */
+		assert(!pixman_region32_not_empty(&context->surface->damage));
+		test_client_send(client, "bye\n");
+		break;
+	}
+}
+
+static void
+handle_reply(struct test_client *client)
+{
+	struct context *context = client->data;
+
+	if (strncmp(client->buf, "surface ", 8) == 0)
+		handle_surface(client, context);
+	else if (strcmp(client->buf, "painted") == 0)
+		handle_painted(client, context);
+	else
+		assert(0);
+}
+
+TEST(damage_refine_test)
+{
+	struct test_client *client;
+	struct context *context;
+
+	context = malloc(sizeof *context);
+	assert(context);
+	memset(context, 0, sizeof *context);
+
+	compositor->refine_damage = 1;
+
+	client = test_client_launch(compositor);
+	client->terminate = 1;
+	client->handle = handle_reply;
+	client->data = context;
+
+	test_client_send(client, "shm-surface %u 64 64\n",
+			 WL_SHM_FORMAT_XRGB8888);
+}
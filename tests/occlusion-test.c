@@ -0,0 +1,143 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "test-runner.h"
+
+struct context {
+	struct weston_layer layer;
+	struct weston_surface *surface;
+	struct weston_surface *cover;
+	int step;
+};
+
+static void
+handle_surface(struct test_client *client, struct context *context)
+{
+	struct wl_resource *resource;
+	uint32_t id;
+
+	assert(sscanf(client->buf, "surface %u", &id) == 1);
+	resource = wl_client_get_object(client->client, id);
+	assert(resource);
+
+	context->surface = (struct weston_surface *) resource;
+	weston_surface_configure(context->surface, 100, 100, 64, 64);
+	weston_surface_assign_output(context->surface);
+	wl_list_insert(&context->layer.surface_list,
+		       &context->surface->layer_link);
+	weston_surface_damage(context->surface);
+
+	test_client_send(client, "frame\n");
+}
+
+/* An opaque surface on top that hides the client surface. */
+static void
+cover_surface(struct context *context)
+{
+	struct weston_compositor *compositor = context->surface->compositor;
+	struct weston_surface *cover;
+
+	cover = weston_surface_create(compositor);
+	assert(cover);
+	weston_surface_configure(cover, 50, 50, 200, 200);
+	weston_surface_set_color(cover, 0.0, 0.0, 0.0, 1.0);
+	pixman_region32_union_rect(&cover->opaque, &cover->opaque,
+				   0, 0, 200, 200);
+	weston_surface_assign_output(cover);
+	wl_list_insert(&context->layer.surface_list, &cover->layer_link);
+	weston_surface_damage(cover);
+
+	context->cover = cover;
+}
+
+static void
+handle_state(struct test_client *client, struct context *context)
+{
+	int released, frames;
+
+	assert(sscanf(client->buf, "state %d %d", &released, &frames) == 2);
+	fprintf(stderr, "step %d: %d frame callbacks done\n",
+		context->step, frames);
+
+	switch (context->step++) {
+	case 0:
+		/* Visible, the callback comes with the repaint. */
+		assert(frames == 1);
+		cover_surface(context);
+		test_client_send(client, "frame\n");
+		break;
+	case 1:
+		/* Hidden, the callback is held back. */
+		assert(frames == 1);
+		assert(context->surface->occluded);
+		assert(!wl_list_empty(&context->surface->frame_callback_list));
+		weston_surface_destroy(context->cover);
+		context->cover = NULL;
+		test_client_send_after_repaint(client, "state\n");
+		break;
+	case 2:
+		/* Visible again, the held callback is sent. */
+		assert(frames == 2);
+		assert(wl_list_empty(&context->surface->frame_callback_list));
+		test_client_send(client, "bye\n");
+		break;
+	}
+}
+
+static void
+handle_reply(struct test_client *client)
+{
+	struct context *context = client->data;
+
+	if (strncmp(client->buf, "surface ", 8) == 0)
+		handle_surface(client, context);
+	else if (strcmp(client->buf, "frame") == 0)
+		test_client_send_after_repaint(client, "state\n");
+	else if (strncmp(client->buf, "state ", 6) == 0)
+		handle_state(client, context);
+	else
+		assert(0);
+}
+
+TEST(occluded_frame_test)
+{
+	struct test_client *client;
+	struct context *context;
+
+	context = malloc(sizeof *context);
+	assert(context);
+	memset(context, 0, sizeof *context);
+	weston_layer_init(&context->layer, &compositor->cursor_layer.link);
+
+	client = test_client_launch(compositor);
+	client->terminate = 1;
+	client->handle = handle_reply;
+	client->data = context;
+
+	test_client_send(client, "shm-surface %u 64 64\n",
+			 WL_SHM_FORMAT_XRGB8888);
+}
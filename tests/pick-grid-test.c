@@ -0,0 +1,129 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "test-runner.h"
+
+struct context {
+	struct weston_animation animation;
+	struct weston_layer layer;
+	struct weston_surface *below, *above, *cursor;
+	uint32_t generation;
+};
+
+static struct weston_surface *
+add_surface(struct context *context, struct weston_compositor *compositor,
+	    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct weston_surface *surface;
+
+	surface = weston_surface_create(compositor);
+	assert(surface);
+	weston_surface_configure(surface, x, y, width, height);
+	weston_surface_set_color(surface, 0.0, 0.0, 0.0, 1.0);
+	weston_surface_assign_output(surface);
+	wl_list_insert(&context->layer.surface_list, &surface->layer_link);
+	weston_surface_damage(surface);
+
+	return surface;
+}
+
+static struct weston_surface *
+pick(struct weston_compositor *compositor, int x, int y)
+{
+	struct wl_seat *seat = &compositor->seat->seat;
+
+	notify_motion(seat, 100, wl_fixed_from_int(x), wl_fixed_from_int(y));
+
+	return (struct weston_surface *) seat->pointer->current;
+}
+
+static void
+frame(struct weston_animation *animation,
+      struct weston_output *output, uint32_t msecs)
+{
+	struct context *context =
+		container_of(animation, struct context, animation);
+	struct weston_compositor *compositor = output->compositor;
+
+	if (animation->frame_counter == 1) {
+		/* The cursor takes no input and is picked through. */
+		assert(pick(compositor, 75, 75) == context->above);
+		assert(pick(compositor, 25, 25) == context->below);
+		context->generation = compositor->pick_grid.generation;
+
+		/* Moving a surface only updates its own cells. */
+		weston_surface_set_position(context->above, 0, 0);
+		weston_surface_update_transform(context->above);
+		assert(pick(compositor, 25, 25) == context->above);
+
+		/* A surface mapped with an input region of its own is
+		 * added to the cells it covers. */
+		pixman_region32_fini(&context->cursor->input);
+		pixman_region32_init_rect(&context->cursor->input,
+					  150, 150, 10, 10);
+		weston_surface_configure(context->cursor, 0, 0, 200, 200);
+		weston_surface_update_transform(context->cursor);
+		assert(pick(compositor, 155, 155) == context->cursor);
+		assert(pick(compositor, 25, 25) == context->above);
+		assert(compositor->pick_grid.generation ==
+		       context->generation);
+
+		weston_compositor_schedule_repaint(compositor);
+		return;
+	}
+
+	/* A repaint that doesn't restack keeps the grid. */
+	assert(pick(compositor, 25, 25) == context->above);
+	assert(pick(compositor, 155, 155) == context->cursor);
+	assert(compositor->pick_grid.generation == context->generation);
+
+	wl_list_remove(&animation->link);
+	wl_display_terminate(compositor->wl_display);
+}
+
+TEST(pick_grid)
+{
+	struct weston_output *output;
+	struct context *context;
+
+	context = calloc(1, sizeof *context);
+	assert(context);
+	weston_layer_init(&context->layer, &compositor->cursor_layer.link);
+
+	compositor->focus = 1;
+	context->below = add_surface(context, compositor, 0, 0, 100, 100);
+	context->above = add_surface(context, compositor, 50, 50, 100, 100);
+	context->cursor = add_surface(context, compositor, 0, 0, 200, 200);
+	pixman_region32_fini(&context->cursor->input);
+	pixman_region32_init(&context->cursor->input);
+
+	context->animation.frame = frame;
+	context->animation.frame_counter = 0;
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	wl_list_insert(&output->animation_list, &context->animation.link);
+	weston_compositor_schedule_repaint(compositor);
+}
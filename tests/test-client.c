@@ -22,19 +22,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <poll.h>
+#include <sys/mman.h>
 #include <wayland-client.h>
 #include <GLES2/gl2.h> /* needed for GLfloat */
 #include <linux/input.h>
 
+#include "../shared/os-compatibility.h"
+
 struct display {
 	struct wl_display *display;
 	struct wl_compositor *compositor;
+	struct wl_shm *shm;
 	struct input *input;
 	struct output *output;
+	struct shm_surface *shm_surface;
 };
 
 struct input {
@@ -58,6 +64,14 @@ struct surface {
 	struct output *output;
 };
 
+struct shm_surface {
+	struct wl_surface *surface;
+	struct wl_buffer *buffer;
+	uint32_t *data;
+	int width, height, size;
+	int released, frames;
+};
+
 static void
 pointer_handle_enter(void *data, struct wl_pointer *pointer,
 			   uint32_t serial, struct wl_surface *surface,
@@ -248,6 +262,9 @@ handle_global(struct wl_display *_display, uint32_t id,
 		display->compositor =
 			wl_display_bind(display->display,
 					id, &wl_compositor_interface);
+	} else if (strcmp(interface, "wl_shm") == 0) {
+		display->shm = wl_display_bind(display->display,
+					       id, &wl_shm_interface);
 	} else if (strcmp(interface, "wl_seat") == 0) {
 		input = malloc(sizeof *input);
 		input->seat = wl_display_bind(display->display, id,
@@ -320,11 +337,136 @@ create_surface(int fd, struct display *display)
 	assert(display->input->y == 50);
 }
 
+static void
+buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct shm_surface *surface = data;
+
+	surface->released++;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release
+};
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct shm_surface *surface = data;
+
+	surface->frames++;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static void
+reply(int fd, struct display *display, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	int len;
+
+	/* The compositor has handled the requests once it answers. */
+	wl_display_roundtrip(display->display);
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	assert(write(fd, buf, len) == len);
+}
+
+/* Creates a surface showing a zeroed shm buffer of the given format,
+ * all of it damaged. */
+static void
+create_shm_surface(int fd, struct display *display,
+		   uint32_t format, int width, int height)
+{
+	struct shm_surface *surface;
+	struct wl_shm_pool *pool;
+	int stride, buffer_fd;
+
+	surface = malloc(sizeof *surface);
+	assert(surface);
+	memset(surface, 0, sizeof *surface);
+	surface->width = width;
+	surface->height = height;
+
+	/* NV12 is a byte wide luma plane followed by half as much
+	 * chroma, the other formats tested are 32 bit. */
+	if (format == WL_SHM_FORMAT_NV12) {
+		stride = width;
+		surface->size = stride * height * 3 / 2;
+	} else {
+		stride = width * 4;
+		surface->size = stride * height;
+	}
+
+	buffer_fd = os_create_anonymous_file(surface->size);
+	assert(buffer_fd >= 0);
+	surface->data = mmap(NULL, surface->size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, buffer_fd, 0);
+	assert(surface->data != MAP_FAILED);
+
+	pool = wl_shm_create_pool(display->shm, buffer_fd, surface->size);
+	surface->buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+						    stride, format);
+	wl_shm_pool_destroy(pool);
+	close(buffer_fd);
+	wl_buffer_add_listener(surface->buffer, &buffer_listener, surface);
+
+	surface->surface = wl_compositor_create_surface(display->compositor);
+	wl_surface_attach(surface->surface, surface->buffer, 0, 0);
+	wl_surface_damage(surface->surface, 0, 0, width, height);
+	display->shm_surface = surface;
+
+	reply(fd, display, "surface %d\n",
+	      wl_proxy_get_id((struct wl_proxy *) surface->surface));
+}
+
+static void
+request_frame(int fd, struct display *display)
+{
+	struct shm_surface *surface = display->shm_surface;
+	struct wl_callback *callback;
+
+	callback = wl_surface_frame(surface->surface);
+	wl_callback_add_listener(callback, &frame_listener, surface);
+
+	reply(fd, display, "frame\n");
+}
+
+/* Sets one pixel of a 32 bit buffer and damages all of it. */
+static void
+paint_pixel(int fd, struct display *display, int x, int y)
+{
+	struct shm_surface *surface = display->shm_surface;
+
+	surface->data[y * surface->width + x] = 0xffffffff;
+	wl_surface_damage(surface->surface,
+			  0, 0, surface->width, surface->height);
+
+	reply(fd, display, "painted\n");
+}
+
+static void
+send_state(int fd, struct display *display)
+{
+	struct shm_surface *surface = display->shm_surface;
+
+	reply(fd, display, "state %d %d\n",
+	      surface->released, surface->frames);
+}
+
 int main(int argc, char *argv[])
 {
 	struct display *display;
 	char buf[256], *p;
-	int ret, fd;
+	int ret, fd, x, y;
+	uint32_t format;
 
 	display = malloc(sizeof *display);
 	assert(display);
@@ -343,11 +485,12 @@ int main(int argc, char *argv[])
 		fd = strtol(p, NULL, 0);
 
 	while (1) {
-		ret = read(fd, buf, sizeof buf);
+		ret = read(fd, buf, sizeof buf - 1);
 		if (ret == -1) {
 			fprintf(stderr, "read error: fd %d, %m\n", fd);
 			return -1;
 		}
+		buf[ret] = '\0';
 
 		fprintf(stderr, "test-client: got %.*s\n", ret - 1, buf);
 
@@ -355,6 +498,15 @@ int main(int argc, char *argv[])
 			return 0;
 		} else if (strncmp(buf, "create-surface\n", ret) == 0) {
 			create_surface(fd, display);
+		} else if (sscanf(buf, "shm-surface %u %d %d",
+				  &format, &x, &y) == 3) {
+			create_shm_surface(fd, display, format, x, y);
+		} else if (strncmp(buf, "frame\n", ret) == 0) {
+			request_frame(fd, display);
+		} else if (sscanf(buf, "paint %d %d", &x, &y) == 2) {
+			paint_pixel(fd, display, x, y);
+		} else if (strncmp(buf, "state\n", ret) == 0) {
+			send_state(fd, display);
 		} else {
 			fprintf(stderr, "unknown command %.*s\n", ret, buf);
 			return -1;
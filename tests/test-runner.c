@@ -120,6 +120,46 @@ test_client_send(struct test_client *client, const char *fmt, ...)
 	assert(write(client->fd, buf, len) == len);
 }
 
+struct test_frame {
+	struct weston_animation animation;
+	struct test_client *client;
+	const char *msg;
+};
+
+static void
+test_frame(struct weston_animation *animation,
+	   struct weston_output *output, uint32_t msecs)
+{
+	struct test_frame *frame =
+		container_of(animation, struct test_frame, animation);
+
+	wl_list_remove(&animation->link);
+	test_client_send(frame->client, "%s", frame->msg);
+	free(frame);
+}
+
+/* Sends msg once the compositor has repainted, which also sends the
+ * frame callbacks and buffer releases due in that repaint. */
+void
+test_client_send_after_repaint(struct test_client *client, const char *msg)
+{
+	struct weston_compositor *compositor = client->compositor;
+	struct weston_output *output;
+	struct test_frame *frame;
+
+	frame = malloc(sizeof *frame);
+	assert(frame);
+	frame->client = client;
+	frame->msg = msg;
+	frame->animation.frame = test_frame;
+	frame->animation.frame_counter = 0;
+
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	wl_list_insert(&output->animation_list, &frame->animation.link);
+	weston_compositor_schedule_repaint(compositor);
+}
+
 extern const struct test __start_test_section, __stop_test_section;
 
 static void
@@ -38,5 +38,7 @@ struct test_client {
 
 struct test_client *test_client_launch(struct weston_compositor *compositor);
 void test_client_send(struct test_client *client, const char *fmt, ...);
+void test_client_send_after_repaint(struct test_client *client,
+				    const char *msg);
 
 #endif